@@ -0,0 +1,108 @@
+// Extension filter benchmark: the old per-file CSV parse against the
+// compiled ExtSet, on synthetic file names. Also cross-checks hit counts for
+// lists without multi-dot entries, where the two must agree.
+//
+//   gcc -O3 -pthread bench/bench_ext.c -o bench_ext
+//   cl /O2 bench\bench_ext.c
+//
+// Usage: bench_ext [names] [rounds]
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define FFIND_NO_MAIN
+#include "../ffind.c"
+
+// the filter ffind used before
+static int ext_allowed_old(const wchar_t *filename, const wchar_t *extcsv) {
+    if (!extcsv || !*extcsv) return 1;
+
+    const wchar_t *dot = wcsrchr(filename, L'.');
+    if (!dot || !dot[1]) return 0;
+    const wchar_t *ext = dot + 1;
+
+    const wchar_t *p = extcsv;
+    while (*p) {
+        while (*p == L',' || *p == L' ' || *p == L'\t') p++;
+        const wchar_t *start = p;
+        while (*p && *p != L',') p++;
+        size_t len = (size_t)(p - start);
+        if (len > 0) {
+            if (wcslen(ext) == len && _wcsnicmp(ext, start, len) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t g_rng = 12345;
+static uint32_t rnd(void) {
+    g_rng = g_rng * 1664525u + 1013904223u;
+    return g_rng >> 8;
+}
+
+static const char *k_stems[] = { "main", "README", "util", "index", "libfoo", "Makefile", "data_0042", "report-v2" };
+static const char *k_exts[] = {
+    ".c", ".h", ".cpp", ".HPP", ".txt", ".json", ".log", ".o", ".md", ".py", ".so", ".so.6",
+    ".tar.gz", ".png", ".JPG", ".min.js", ".d.ts", "", ".", ".cache",
+};
+
+static wchar_t* make_name(void) {
+    wchar_t buf[128];
+    size_t n = 0;
+    for (const char *s = k_stems[rnd() % ARRAYSIZE(k_stems)]; *s; s++) buf[n++] = (wchar_t)*s;
+    for (const char *s = k_exts[rnd() % ARRAYSIZE(k_exts)]; *s; s++) buf[n++] = (wchar_t)*s;
+    buf[n] = 0;
+    return wcsdup_heap(buf);
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    if (count < 1 || rounds < 1) {
+        fprintf(stderr, "usage: bench_ext [names] [rounds]\n");
+        return 2;
+    }
+
+    // the set is given names the way the walker has them (UTF-8 on Linux)
+    wchar_t **names = (wchar_t**)malloc((size_t)count * sizeof(wchar_t*));
+    pchar **pnames = (pchar**)malloc((size_t)count * sizeof(pchar*));
+    size_t *lens = (size_t*)malloc((size_t)count * sizeof(size_t));
+    if (!names || !pnames || !lens) return 1;
+    for (int i = 0; i < count; i++) {
+        names[i] = make_name();
+        if (!names[i]) return 1;
+        pnames[i] = pchar_dup(names[i], &lens[i]);
+        if (!pnames[i]) return 1;
+    }
+
+    static const wchar_t *lists[] = {
+        L"", L"c", L"c,h,cpp", L"c,h,cpp,hpp,cc,cxx,hh,inl,ipp,tcc",
+        L"txt,json,log,md,py,so,png,jpg,cache,o,gif,bmp,svg,xml,yml,toml,ini,csv", L"tar.gz,min.js",
+    };
+    printf("%d names, %d rounds\n\n", count, rounds);
+    printf("%-44s %10s %10s %10s\n", "list", "hits", "old ns", "set ns");
+
+    for (size_t k = 0; k < ARRAYSIZE(lists); k++) {
+        ExtFilter f;
+        memset(&f, 0, sizeof(f));
+        if (!ext_set_init(&f.only, lists[k])) return 1;
+        int multi = wcschr(lists[k], L'.') != NULL;
+
+        long hits = 0;
+        double t0 = now_seconds();
+        for (int r = 0; r < rounds; r++)
+            for (int i = 0; i < count; i++) hits += ext_allowed_old(names[i], lists[k]);
+        double old_ns = (now_seconds() - t0) * 1e9 / ((double)count * rounds);
+
+        long h2 = 0;
+        t0 = now_seconds();
+        for (int r = 0; r < rounds; r++)
+            for (int i = 0; i < count; i++) h2 += PNAME_EXT_ALLOWED(&f, pnames[i], lens[i]);
+        double new_ns = (now_seconds() - t0) * 1e9 / ((double)count * rounds);
+
+        if (!multi && h2 != hits) fprintf(stderr, "%ls: hit count mismatch\n", lists[k]);
+        printf("%-44.44ls %10ld %10.1f %10.1f\n", *lists[k] ? lists[k] : L"(none)", h2 / rounds, old_ns, new_ns);
+        ext_filter_free(&f);
+    }
+    return 0;
+}
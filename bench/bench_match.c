@@ -0,0 +1,175 @@
+// Substring matcher benchmark: the old per-offset _wcsnicmp loop against the
+// scalar, SSE2 and AVX2 matchers, on a synthetic corpus of file names. Also
+// cross-checks every matcher against the old function on random ASCII. The
+// matchers run on names as the walker has them: UTF-16 on Windows, UTF-8
+// bytes on Linux.
+//
+//   gcc -O3 -pthread bench/bench_match.c -o bench_match
+//   cl /O2 bench\bench_match.c
+//
+// Usage: bench_match [names] [rounds] [name|path]
+//   path joins several names per entry, like -f matching against full paths
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define FFIND_NO_MAIN
+#include "../ffind.c"
+
+#ifdef _WIN32
+typedef wunit unit;
+typedef wcontains_fn contains_fn;
+#define IMPL(x) wcontains_##x
+#define FOLDED(nd) (nd).folded, (nd).len
+#else
+typedef uint8_t unit;
+typedef bcontains_fn contains_fn;
+#define IMPL(x) bcontains_##x
+#define FOLDED(nd) (nd).folded8, (nd).len8
+#endif
+
+// the matcher ffind used before (C locale: ASCII-only folding)
+static int wcontains_i_old(const wchar_t *hay, const wchar_t *needle) {
+    if (!needle || !*needle) return 1;
+    size_t nlen = wcslen(needle);
+    for (const wchar_t *p = hay; *p; ++p) {
+        if (_wcsnicmp(p, needle, nlen) == 0) return 1;
+    }
+    return 0;
+}
+
+static uint32_t g_rng = 12345;
+static uint32_t rnd(void) {
+    g_rng = g_rng * 1664525u + 1013904223u;
+    return g_rng >> 8;
+}
+
+static const char *k_parts[] = {
+    "lib", "src", "test", "Main", "util", "CONFIG", "data", "build", "core",
+    "index", "Prime", "module", "cache", "log", "report", "v2", "tmp", "node",
+};
+static const char *k_exts[] = { ".c", ".h", ".cpp", ".txt", ".json", ".log", ".o", ".md", "" };
+
+static size_t g_segments = 1;
+
+static size_t append_segment(wchar_t *buf, size_t n) {
+    int parts = 1 + (int)(rnd() % 4);
+    for (int p = 0; p < parts; p++) {
+        const char *s = k_parts[rnd() % ARRAYSIZE(k_parts)];
+        while (*s) buf[n++] = (wchar_t)*s++;
+        if (p + 1 < parts) buf[n++] = (rnd() & 1) ? L'_' : L'-';
+    }
+    if (rnd() % 3 == 0) {
+        int digits = 1 + (int)(rnd() % 6);
+        for (int d = 0; d < digits; d++) buf[n++] = (wchar_t)(L'0' + rnd() % 10);
+    }
+    const char *e = k_exts[rnd() % ARRAYSIZE(k_exts)];
+    while (*e) buf[n++] = (wchar_t)*e++;
+    return n;
+}
+
+static wchar_t* make_name(void) {
+    wchar_t buf[1024];
+    size_t n = 0;
+    for (size_t seg = 0; seg < g_segments; seg++) {
+        if (seg) buf[n++] = PATH_SEP;
+        n = append_segment(buf, n);
+    }
+    buf[n] = 0;
+    return wcsdup_heap(buf);
+}
+
+static int cross_check(contains_fn fn, const char *label) {
+    static const wchar_t alpha[] = L"aAbBzZ@[`{_.09";
+    wchar_t hay[80], nd[8];
+    unit phay[80];
+    for (int iter = 0; iter < 200000; iter++) {
+        size_t hn = rnd() % 70, nn = 1 + rnd() % 6;
+        for (size_t i = 0; i < hn; i++) hay[i] = alpha[rnd() % (ARRAYSIZE(alpha) - 1)];
+        for (size_t i = 0; i < nn; i++) nd[i] = alpha[rnd() % (ARRAYSIZE(alpha) - 1)];
+        hay[hn] = 0;
+        nd[nn] = 0;
+        for (size_t i = 0; i < hn; i++) phay[i] = (unit)hay[i];
+        Needle needle;
+        if (!needle_init(&needle, nd)) return 0;
+        int want = wcontains_i_old(hay, nd);
+        int got = nn > hn ? 0 : fn(FOLDED(needle), phay, hn);
+        needle_free(&needle);
+        if (want != got) {
+            fprintf(stderr, "%s mismatch: hay=%ls needle=%ls old=%d new=%d\n", label, hay, nd, want, got);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    if (argc > 3 && strcmp(argv[3], "path") == 0) g_segments = 6;
+    if (count < 1 || rounds < 1) {
+        fprintf(stderr, "usage: bench_match [names] [rounds] [name|path]\n");
+        return 2;
+    }
+
+    printf("dispatch picks: %s\n", match_init());
+
+    struct { const char *label; contains_fn fn; } impls[4];
+    int nimpl = 0;
+    impls[nimpl].label = "scalar"; impls[nimpl++].fn = IMPL(scalar);
+#ifdef HAVE_X86_SIMD
+    impls[nimpl].label = "sse2"; impls[nimpl++].fn = IMPL(sse2);
+    if (cpu_has_avx2()) { impls[nimpl].label = "avx2"; impls[nimpl++].fn = IMPL(avx2); }
+#endif
+
+    for (int i = 0; i < nimpl; i++) {
+        if (!cross_check(impls[i].fn, impls[i].label)) return 1;
+    }
+    printf("cross-check vs _wcsnicmp loop: ok\n");
+
+    wchar_t **names = (wchar_t**)malloc((size_t)count * sizeof(wchar_t*));
+    pchar **pnames = (pchar**)malloc((size_t)count * sizeof(pchar*));
+    size_t *lens = (size_t*)malloc((size_t)count * sizeof(size_t));
+    if (!names || !pnames || !lens) return 1;
+    size_t total_chars = 0;
+    for (int i = 0; i < count; i++) {
+        names[i] = make_name();
+        pnames[i] = names[i] ? pchar_dup(names[i], &lens[i]) : NULL;
+        if (!pnames[i]) return 1;
+        total_chars += lens[i];
+    }
+    printf("%d names, avg %.1f chars\n\n", count, (double)total_chars / count);
+
+    static const wchar_t *needles[] = { L"x", L"prime", L"CONFIG_", L"report-v2", L"zzzz", L"util.json" };
+    printf("%-12s %10s %10s", "needle", "hits", "old ns");
+    for (int i = 0; i < nimpl; i++) printf(" %9s ns", impls[i].label);
+    printf("\n");
+
+    for (size_t k = 0; k < ARRAYSIZE(needles); k++) {
+        Needle nd;
+        if (!needle_init(&nd, needles[k])) return 1;
+
+        long hits = 0;
+        double t0 = now_seconds();
+        for (int r = 0; r < rounds; r++)
+            for (int i = 0; i < count; i++) hits += wcontains_i_old(names[i], needles[k]);
+        double old_ns = (now_seconds() - t0) * 1e9 / ((double)count * rounds);
+        printf("%-12ls %10ld %10.1f", needles[k], hits / rounds, old_ns);
+
+        for (int m = 0; m < nimpl; m++) {
+            long h2 = 0;
+            t0 = now_seconds();
+            for (int r = 0; r < rounds; r++) {
+                for (int i = 0; i < count; i++) {
+                    if (nd.len <= lens[i]) h2 += impls[m].fn(FOLDED(nd), (const unit*)pnames[i], lens[i]);
+                }
+            }
+            double ns = (now_seconds() - t0) * 1e9 / ((double)count * rounds);
+            if (h2 != hits) fprintf(stderr, "\n%s: hit count mismatch\n", impls[m].label);
+            printf(" %12.1f", ns);
+        }
+        printf("\n");
+        needle_free(&nd);
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Pattern benchmark: -g/-r DFA throughput against plain substring search, on
+// a synthetic corpus of file names. For each pattern: the substring matcher
+// alone on the pattern's required literal, the DFA alone, and the two
+// together (literal first, DFA on what passes). ffind skips the literal when
+// the DFA can turn names down at their first byte; "runs" says which it uses.
+//
+//   gcc -O3 -pthread bench/bench_pattern.c -o bench_pattern
+//   cl /O2 bench\bench_pattern.c
+//
+// Usage: bench_pattern [names] [rounds] [name|path]
+//   path prefixes each name with directories, like -f matching full paths
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define FFIND_NO_MAIN
+#include "../ffind.c"
+
+static uint32_t g_rng = 12345;
+static uint32_t rnd(void) {
+    g_rng = g_rng * 1664525u + 1013904223u;
+    return g_rng >> 8;
+}
+
+static const char *k_parts[] = {
+    "lib", "src", "test", "Main", "util", "CONFIG", "data", "build", "core",
+    "index", "Prime", "module", "cache", "log", "report", "v2", "tmp", "node",
+};
+static const char *k_exts[] = {
+    ".c", ".h", ".cpp", ".txt", ".json", ".log", ".log.1", ".log.gz", ".so", ".so.6", ".o", ".md", "",
+};
+
+static int g_dirs;
+
+// one name at buf, NUL-terminated, as the walker has it (UTF-8 on Linux);
+// returns its length
+static size_t make_name(pchar *buf) {
+    size_t n = 0;
+    for (int d = 0; d < g_dirs; d++) {
+        for (const char *s = k_parts[rnd() % ARRAYSIZE(k_parts)]; *s; s++) buf[n++] = (pchar)*s;
+        if (rnd() & 1) {
+            for (const char *s = k_parts[rnd() % ARRAYSIZE(k_parts)]; *s; s++) buf[n++] = (pchar)*s;
+        }
+        buf[n++] = PATH_SEP;
+    }
+    if (rnd() % 50 == 0) {
+        for (const char *s = "core."; *s; s++) buf[n++] = (pchar)*s;
+        for (int d = 1 + (int)(rnd() % 5); d > 0; d--) buf[n++] = (pchar)('0' + rnd() % 10);
+        buf[n] = 0;
+        return n;
+    }
+    int parts = 1 + (int)(rnd() % 4);
+    for (int p = 0; p < parts; p++) {
+        for (const char *s = k_parts[rnd() % ARRAYSIZE(k_parts)]; *s; s++) buf[n++] = (pchar)*s;
+        if (p + 1 < parts) buf[n++] = (rnd() & 1) ? '_' : '-';
+    }
+    if (rnd() % 3 == 0) {
+        for (int d = 1 + (int)(rnd() % 4); d > 0; d--) buf[n++] = (pchar)('0' + rnd() % 10);
+    }
+    for (const char *s = k_exts[rnd() % ARRAYSIZE(k_exts)]; *s; s++) buf[n++] = (pchar)*s;
+    buf[n] = 0;
+    return n;
+}
+
+static int g_count, g_rounds;
+static pchar **g_names;
+static size_t *g_lens;
+
+// ns per name; *hits from the last round
+static double time_it(const Needle *nd, const Pattern *p, long *hits) {
+    double t0 = now_seconds();
+    long h = 0;
+    for (int r = 0; r < g_rounds; r++) {
+        h = 0;
+        for (int i = 0; i < g_count; i++) {
+            if (nd && !PNAME_NEEDLE(nd, g_names[i], g_lens[i])) continue;
+            if (p && !PNAME_PAT(p, g_names[i], g_lens[i])) continue;
+            h++;
+        }
+    }
+    *hits = h;
+    return (now_seconds() - t0) * 1e9 / ((double)g_count * g_rounds);
+}
+
+int main(int argc, char **argv) {
+    g_count = argc > 1 ? atoi(argv[1]) : 1000000;
+    g_rounds = argc > 2 ? atoi(argv[2]) : 5;
+    if (argc > 3 && strcmp(argv[3], "path") == 0) g_dirs = 6;
+    if (g_count < 1 || g_rounds < 1) {
+        fprintf(stderr, "usage: bench_pattern [names] [rounds] [name|path]\n");
+        return 2;
+    }
+    printf("dispatch picks: %s\n", match_init());
+
+    // back to back, like a directory read hands them over
+    g_names = (pchar**)malloc((size_t)g_count * sizeof(pchar*));
+    g_lens = (size_t*)malloc((size_t)g_count * sizeof(size_t));
+    pchar *pool = (pchar*)malloc((size_t)g_count * 192 * sizeof(pchar));
+    if (!g_names || !g_lens || !pool) return 1;
+    for (int i = 0; i < g_count; i++) {
+        g_names[i] = pool;
+        g_lens[i] = make_name(pool);
+        pool += g_lens[i] + 1;
+    }
+    printf("%d names\n\n", g_count);
+
+    static const struct { int glob; const wchar_t *src; } pats[] = {
+        { 0, L"prime" },
+        { 1, L"*prime*" },
+        { 1, L"*.log.[0-9]" },
+        { 0, L"^core\\.[0-9]+$" },
+        { 0, L"^lib.*\\.so\\.\\d+$" },
+        { 0, L"util.*\\.json$" },
+        { 0, L"(report|cache)[-_]v2" },
+        { 1, L"*" },
+    };
+
+    printf("%-22s %-8s %6s %8s %11s %8s %12s  %s\n", "pattern", "literal", "states", "hits", "literal ns", "dfa ns", "lit+dfa ns", "runs");
+    for (size_t k = 0; k < ARRAYSIZE(pats); k++) {
+        Pattern p;
+        if (!pat_init(&p, pats[k].src, pats[k].glob)) {
+            fprintf(stderr, "%ls: %ls\n", pats[k].src, p.error ? p.error : L"out of memory");
+            return 1;
+        }
+        Needle nd;
+        if (!needle_init(&nd, p.literal)) return 1;
+
+        long lh, dh, bh;
+        double lns = time_it(&nd, NULL, &lh);
+        double dns = time_it(NULL, &p, &dh);
+        double bns = time_it(&nd, &p, &bh);
+        if (dh != bh) fprintf(stderr, "%ls: prefilter changed the hits (%ld vs %ld)\n", pats[k].src, dh, bh);
+
+        char label[64];
+        snprintf(label, sizeof(label), "%s %ls", pats[k].glob ? "-g" : "-r", pats[k].src);
+        char lit[32];
+        snprintf(lit, sizeof(lit), "%ls", p.literal ? p.literal : L"-");
+        printf("%-22s %-8s %6u %8ld %11.1f %8.1f %12.1f  %s\n", label, lit, p.nstates, bh, lns, dns, bns,
+            p.fails_fast || !p.literal ? "dfa" : "lit+dfa");
+        fflush(stdout);
+
+        needle_free(&nd);
+        pat_free(&p);
+    }
+    return 0;
+}
@@ -0,0 +1,226 @@
+// End-to-end benchmark: generates a deterministic synthetic tree, then runs
+// an ffind binary over it for every thread count and match mode and prints
+// CSV, one row per run (best of rounds). Run it before and after a change,
+// on the same machine, and compare the files_per_s column.
+//
+// The tree: depth levels of fanout subdirectories, files per directory, and
+// one directory in 64 holding 50 times as many (the long tail). Names are
+// 6-16 characters mostly, 17-40 for a quarter, up to 120 for a few. The
+// same settings always give the same tree; the directory is reused when its
+// stamp says it was made with them, and never deleted.
+//
+//   gcc -O3 -pthread bench/bench_tree.c -o bench_tree
+//   cl /O2 bench\bench_tree.c
+//
+// Usage: bench_tree <ffind> [dir] [depth] [fanout] [files] [max_threads] [rounds]
+//   dir defaults to ffind_bench_tree under $TMPDIR (%TEMP%)
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define FFIND_NO_MAIN
+#include "../ffind.c"
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(p) _mkdir(p)
+#define popen _popen
+#define pclose _pclose
+#define DEV_NULL "NUL"
+#define SEP "\\"
+#define CMD_OPEN "\""      // cmd /c drops the outer quotes of the line
+#define CMD_CLOSE "\""
+#else
+#define make_dir(p) mkdir((p), 0777)
+#define DEV_NULL "/dev/null"
+#define SEP "/"
+#define CMD_OPEN ""
+#define CMD_CLOSE ""
+#endif
+
+#define STAMP_NAME ".bench_tree"
+
+static int g_depth = 5, g_fanout = 5, g_files = 16;
+static long g_made_dirs, g_made_files;
+
+static uint32_t g_rng = 12345;
+static uint32_t rnd(void) {
+    g_rng = g_rng * 1664525u + 1013904223u;
+    return g_rng >> 8;
+}
+
+static const char *k_exts[] = { ".c", ".h", ".txt", ".log", ".json", ".so.6", ".tar.gz", ".md", "" };
+
+// a random stem of the length distribution above, then a counter for uniqueness
+static size_t make_name(char *buf, const char *prefix, int k, int is_dir) {
+    static const char alpha[] = "abcdefghijklmnopqrstuvwxyz0123456789_-";
+    uint32_t r = rnd() % 100;
+    int len = r < 70 ? 6 + (int)(rnd() % 11) : r < 95 ? 17 + (int)(rnd() % 24) : 41 + (int)(rnd() % 80);
+    size_t n = (size_t)sprintf(buf, "%s", prefix);
+    for (int i = 0; i < len; i++) buf[n++] = alpha[rnd() % (sizeof(alpha) - 1)];
+    n += (size_t)sprintf(buf + n, "_%d%s", k, is_dir ? "" : k_exts[rnd() % ARRAYSIZE(k_exts)]);
+    return n;
+}
+
+static int make_tree(char *path, size_t len, int level) {
+    if (make_dir(path) != 0) {
+        fprintf(stderr, "cannot create %s\n", path);
+        return 0;
+    }
+    g_made_dirs++;
+    int files = rnd() % 64 == 0 ? g_files * 50 : g_files;
+    for (int k = 0; k < files; k++) {
+        size_t n = len;
+        path[n++] = SEP[0];
+        n += make_name(path + n, "", k, 0);
+        path[n] = 0;
+        FILE *f = fopen(path, "wb");
+        if (!f) {
+            fprintf(stderr, "cannot create %s\n", path);
+            return 0;
+        }
+        fclose(f);
+        g_made_files++;
+    }
+    for (int k = 0; level < g_depth && k < g_fanout; k++) {
+        size_t n = len;
+        path[n++] = SEP[0];
+        n += make_name(path + n, "d", k, 1);
+        path[n] = 0;
+        if (!make_tree(path, n, level + 1)) return 0;
+    }
+    path[len] = 0;
+    return 1;
+}
+
+// reuses dir if its stamp matches, creates it if missing, refuses anything else
+static int prepare_tree(const char *dir) {
+    char stamp[64], want[64], path[4096];
+    snprintf(want, sizeof(want), "depth=%d fanout=%d files=%d v1\n", g_depth, g_fanout, g_files);
+    snprintf(path, sizeof(path), "%s" SEP STAMP_NAME, dir);
+
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        size_t n = fread(stamp, 1, sizeof(stamp) - 1, f);
+        stamp[n] = 0;
+        fclose(f);
+        if (strcmp(stamp, want) == 0) {
+            fprintf(stderr, "reusing %s\n", dir);
+            return 1;
+        }
+        fprintf(stderr, "%s was made with other settings (%.*s); remove it or pick another dir\n",
+            dir, (int)strcspn(stamp, "\n"), stamp);
+        return 0;
+    }
+
+    if (strlen(dir) > 1024) return 0;
+    strcpy(path, dir);
+    fprintf(stderr, "generating %s ...\n", dir);
+    double t0 = now_seconds();
+    if (!make_tree(path, strlen(path), 0)) {
+        fprintf(stderr, "(if %s already existed, remove it or pick another dir)\n", dir);
+        return 0;
+    }
+    fprintf(stderr, "%ld dirs, %ld files in %.1f s\n", g_made_dirs, g_made_files, now_seconds() - t0);
+
+    snprintf(path, sizeof(path), "%s" SEP STAMP_NAME, dir);
+    f = fopen(path, "wb");
+    if (!f) return 0;
+    fputs(want, f);
+    fclose(f);
+    return 1;
+}
+
+// one number out of the --stats=json report
+static double stat_field(const char *json, const char *key) {
+    char k[64];
+    snprintf(k, sizeof(k), "\"%s\": ", key);
+    const char *p = strstr(json, k);
+    return p ? strtod(p + strlen(k), NULL) : -1;
+}
+
+typedef struct {
+    double secs, dirs, files, found;
+} RunResult;
+
+// runs ffind once, output discarded; 0 if it failed
+static int run_ffind(const char *ffind, const char *dir, const char *args, int threads, RunResult *r) {
+    char cmd[8192], json[1 << 16];
+    snprintf(cmd, sizeof(cmd), CMD_OPEN "\"%s\" \"%s\" %s -t %d -b fill --stats=json 2>&1 >" DEV_NULL CMD_CLOSE,
+        ffind, dir, args, threads);
+    FILE *p = popen(cmd, "r");
+    if (!p) return 0;
+    size_t n = fread(json, 1, sizeof(json) - 1, p);
+    json[n] = 0;
+    if (pclose(p) != 0) {
+        fprintf(stderr, "failed: %s\n%s", cmd, json);
+        return 0;
+    }
+    r->secs = stat_field(json, "time_s");
+    r->dirs = stat_field(json, "dirs");
+    r->files = stat_field(json, "files");
+    r->found = stat_field(json, "found");
+    return r->secs >= 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: bench_tree <ffind> [dir] [depth] [fanout] [files] [max_threads] [rounds]\n");
+        return 2;
+    }
+    const char *ffind = argv[1];
+    char dir[1024];
+    if (argc > 2) {
+        snprintf(dir, sizeof(dir), "%s", argv[2]);
+    } else {
+#ifdef _WIN32
+        const char *tmp = getenv("TEMP");
+#else
+        const char *tmp = getenv("TMPDIR");
+#endif
+        snprintf(dir, sizeof(dir), "%s" SEP "ffind_bench_tree", tmp && *tmp ? tmp : "/tmp");
+    }
+    if (argc > 3) g_depth = atoi(argv[3]);
+    if (argc > 4) g_fanout = atoi(argv[4]);
+    if (argc > 5) g_files = atoi(argv[5]);
+    int max_threads = argc > 6 ? atoi(argv[6]) : default_threads();
+    int rounds = argc > 7 ? atoi(argv[7]) : 3;
+    if (g_depth < 0 || g_depth > 12 || g_fanout < 1 || g_files < 0 || max_threads < 1 || rounds < 1) {
+        fprintf(stderr, "usage: bench_tree <ffind> [dir] [depth] [fanout] [files] [max_threads] [rounds]\n");
+        return 2;
+    }
+    if (!prepare_tree(dir)) return 1;
+
+    static const struct { const char *mode, *args; } modes[] = {
+        { "name",  "zq" },
+        { "all",   "\"\"" },
+        { "ext",   "a -e c,h" },
+        { "path",  "_3 -f" },
+        { "multi", "zq -a qz -a x_9" },
+        { "glob",  "-g \"*_1?.log\"" },
+        { "regex", "-r \"^[a-m].*_[0-9]+\\.txt$\"" },
+    };
+
+    // the first pass warms the cache and is not reported
+    RunResult r;
+    if (!run_ffind(ffind, dir, modes[0].args, max_threads, &r)) return 1;
+
+    printf("threads,mode,dirs,files,matches,seconds,files_per_s\n");
+    // 1, 2, 4, ... and max_threads itself
+    for (int t = 1; ; t *= 2) {
+        if (t > max_threads) t = max_threads;
+        for (size_t m = 0; m < ARRAYSIZE(modes); m++) {
+            RunResult best;
+            memset(&best, 0, sizeof(best));
+            for (int k = 0; k < rounds; k++) {
+                if (!run_ffind(ffind, dir, modes[m].args, t, &r)) return 1;
+                if (!k || r.secs < best.secs) best = r;
+            }
+            printf("%d,%s,%.0f,%.0f,%.0f,%.6f,%.0f\n", t, modes[m].mode, best.dirs, best.files, best.found,
+                best.secs, best.secs > 0 ? best.files / best.secs : 0);
+            fflush(stdout);
+        }
+        if (t == max_threads) break;
+    }
+    return 0;
+}
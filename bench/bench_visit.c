@@ -0,0 +1,128 @@
+// Per-file visit benchmark: the specialized visit_N functions against the
+// same body reading its options at run time, like the single visit_file did
+// before. Feeds synthetic names through each option combination with output
+// discarded, and cross-checks match counts between the two.
+//
+//   gcc -O3 -pthread bench/bench_visit.c -o bench_visit
+//   cl /O2 bench\bench_visit.c
+//
+// Usage: bench_visit [names] [rounds]
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define FFIND_NO_MAIN
+#include "../ffind.c"
+
+// the baseline: one function, options tested per file
+static unsigned g_flags;
+DEFINE_VISIT(visit_generic, g_flags)
+
+static uint32_t g_rng = 12345;
+static uint32_t rnd(void) {
+    g_rng = g_rng * 1664525u + 1013904223u;
+    return g_rng >> 8;
+}
+
+static const char *k_parts[] = {
+    "lib", "src", "test", "Main", "util", "CONFIG", "data", "build", "core",
+    "index", "Prime", "module", "cache", "log", "report", "v2", "tmp", "node",
+};
+static const char *k_exts[] = { ".c", ".h", ".cpp", ".txt", ".json", ".log", ".o", ".md", "" };
+
+static pchar* make_name(size_t *len) {
+    wchar_t buf[128];
+    size_t n = 0;
+    int parts = 1 + (int)(rnd() % 3);
+    for (int p = 0; p < parts; p++) {
+        for (const char *s = k_parts[rnd() % ARRAYSIZE(k_parts)]; *s; s++) buf[n++] = (wchar_t)*s;
+        if (p + 1 < parts) buf[n++] = L'_';
+    }
+    for (const char *s = k_exts[rnd() % ARRAYSIZE(k_exts)]; *s; s++) buf[n++] = (wchar_t)*s;
+    buf[n] = 0;
+    return pchar_dup(buf, len);
+}
+
+// best of rounds passes; fn is read through a volatile so both sides pay
+// for an indirect call, as the walker does
+static double run(Worker *w, visit_fn fn, const Node *dir, pchar **names, const size_t *lens,
+                  int count, int rounds, LONG64 *found) {
+    visit_fn volatile call = fn;
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        w->ctx->found = 0;
+        double t0 = now_seconds();
+        for (int i = 0; i < count; i++) {
+            call(w, dir, names[i], lens[i]);
+            w->out.len = 0;
+        }
+        double t = now_seconds() - t0;
+        if (!r || t < best) best = t;
+    }
+    *found = w->ctx->found;
+    return best * 1e9 / count;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    if (count < 1 || rounds < 1) {
+        fprintf(stderr, "usage: bench_visit [names] [rounds]\n");
+        return 2;
+    }
+    printf("dispatch picks: %s\n", match_init());
+
+    pchar **names = (pchar**)malloc((size_t)count * sizeof(pchar*));
+    size_t *lens = (size_t*)malloc((size_t)count * sizeof(size_t));
+    if (!names || !lens) return 1;
+    for (int i = 0; i < count; i++) {
+        names[i] = make_name(&lens[i]);
+        if (!names[i]) return 1;
+    }
+
+    static const wchar_t *many[] = { L"prime", L"config", L"v2", L"zzzz" };
+    AcAuto ac;
+    if (!ac_init(&ac, many, (uint32_t)ARRAYSIZE(many))) return 1;
+
+    static Ctx ctx;
+    static Worker w;
+    InitializeCriticalSection(&ctx.out_mu);
+    w.ctx = &ctx;
+    if (!out_init(&w.out) || !ac_hits_init(&w.hits, &ac)) return 1;
+    size_t root_len;
+    pchar *root = pchar_dup(L"/home/user/src/project/lib", &root_len);
+    Node *dir = root ? node_new(&w.arena, NULL, root, root_len, 0, 0) : NULL;
+    if (!dir) return 1;
+
+    static const struct { const char *label; const wchar_t *needle; int full, multi; const wchar_t *ext; } cases[] = {
+        { "name",       L"prime",    0, 0, NULL },
+        { "name -e",    L"prime",    0, 0, L"c,h,cpp" },
+        { "-f",         L"lib/util", 1, 0, NULL },
+        { "-f -e",      L"lib/util", 1, 0, L"c,h,cpp" },
+        { "-a x4",      NULL,        0, 1, NULL },
+        { "-a x4 -f",   NULL,        1, 1, NULL },
+        { "'' (all)",   L"",         0, 0, NULL },
+        { "'' -e",      L"",         0, 0, L"c,h,cpp" },
+    };
+
+    printf("%d names\n\n", count);
+    printf("%-10s %8s %10s %12s %8s\n", "case", "hits", "generic ns", "special ns", "speedup");
+    for (size_t k = 0; k < ARRAYSIZE(cases); k++) {
+        if (!needle_init(&ctx.needle, cases[k].multi ? L"" : cases[k].needle)) return 1;
+        if (!ext_set_init(&ctx.ext.only, cases[k].ext)) return 1;
+        ctx.ac = cases[k].multi ? &ac : NULL;
+        ctx.match_full_path = cases[k].full;
+        g_flags = visit_flags(&ctx);
+
+        LONG64 gh = 0, sh = 0;
+        double gns = run(&w, visit_generic, dir, names, lens, count, rounds, &gh);
+        double sns = run(&w, k_visit[g_flags], dir, names, lens, count, rounds, &sh);
+        if (gh != sh) fprintf(stderr, "%s: hit count mismatch\n", cases[k].label);
+        printf("%-10s %8lld %10.1f %12.1f %7.2fx\n", cases[k].label, (long long)sh, gns, sns, gns / sns);
+        fflush(stdout);
+
+        ext_set_free(&ctx.ext.only);
+        needle_free(&ctx.needle);
+    }
+    return 0;
+}
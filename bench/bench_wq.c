@@ -0,0 +1,208 @@
+// Queue contention benchmark: expands a synthetic tree through the work queue
+// with no I/O, so the numbers are pure scheduling overhead. Compares the
+// work-stealing WorkQ against the old single-mutex queue it replaced.
+//
+//   gcc -O3 -pthread bench/bench_wq.c -o bench_wq
+//   cl /O2 bench\bench_wq.c
+//
+// Usage: bench_wq [fanout] [depth] [work] [max_threads]
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define FFIND_NO_MAIN
+#include "../ffind.c"
+
+static int g_fanout = 8;
+static int g_depth = 7;
+static int g_work = 200;
+
+static unsigned spin_work(unsigned seed) {
+    volatile unsigned x = seed;
+    for (int i = 0; i < g_work; i++) x = x * 1664525u + 1013904223u;
+    return x;
+}
+
+// -------------------- old queue (baseline) --------------------
+
+typedef struct MNode {
+    struct MNode *next;
+    int depth;
+} MNode;
+
+typedef struct {
+    MNode *head, *tail;
+    LONG active_workers;
+    LONG stop;
+    CRITICAL_SECTION mu;
+    CONDITION_VARIABLE cv;
+} MutexQ;
+
+static void mq_push(MutexQ *q, int depth) {
+    MNode *n = (MNode*)malloc(sizeof(MNode));
+    if (!n) return;
+    n->depth = depth;
+    n->next = NULL;
+    EnterCriticalSection(&q->mu);
+    if (q->tail) q->tail->next = n;
+    else q->head = n;
+    q->tail = n;
+    WakeConditionVariable(&q->cv);
+    LeaveCriticalSection(&q->mu);
+}
+
+static MNode* mq_pop(MutexQ *q) {
+    EnterCriticalSection(&q->mu);
+    for (;;) {
+        if (q->stop) {
+            LeaveCriticalSection(&q->mu);
+            return NULL;
+        }
+        if (q->head) {
+            MNode *n = q->head;
+            q->head = n->next;
+            if (!q->head) q->tail = NULL;
+            InterlockedIncrement(&q->active_workers);
+            LeaveCriticalSection(&q->mu);
+            return n;
+        }
+        if (q->active_workers == 0) {
+            q->stop = 1;
+            WakeAllConditionVariable(&q->cv);
+            LeaveCriticalSection(&q->mu);
+            return NULL;
+        }
+        SleepConditionVariableCS(&q->cv, &q->mu, INFINITE);
+    }
+}
+
+static void mq_done_one(MutexQ *q) {
+    EnterCriticalSection(&q->mu);
+    InterlockedDecrement(&q->active_workers);
+    WakeAllConditionVariable(&q->cv);
+    LeaveCriticalSection(&q->mu);
+}
+
+typedef struct {
+    MutexQ *mq;
+    WorkQ *wq;
+    WqLocal local;
+    LONG64 items;
+    unsigned sink;
+} BenchWorker;
+
+static THREAD_PROC mutex_worker(void *p) {
+    BenchWorker *w = (BenchWorker*)p;
+    for (;;) {
+        MNode *n = mq_pop(w->mq);
+        if (!n) break;
+        w->sink += spin_work((unsigned)n->depth);
+        if (n->depth < g_depth) {
+            for (int i = 0; i < g_fanout; i++) mq_push(w->mq, n->depth + 1);
+        }
+        free(n);
+        w->items++;
+        mq_done_one(w->mq);
+    }
+    return 0;
+}
+
+// -------------------- work-stealing queue --------------------
+
+// depth rides along in Node.id
+static Node* bench_node(int depth) {
+    Node *n = (Node*)calloc(1, sizeof(Node));
+    if (!n) return NULL;
+    n->id = (uint32_t)depth;
+    return n;
+}
+
+static THREAD_PROC steal_worker(void *p) {
+    BenchWorker *w = (BenchWorker*)p;
+    for (;;) {
+        Node *n = wq_pop(w->wq, &w->local);
+        if (!n) break;
+        int depth = (int)n->id;
+        w->sink += spin_work((unsigned)depth);
+        if (depth < g_depth) {
+            for (int i = 0; i < g_fanout; i++) {
+                Node *c = bench_node(depth + 1);
+                if (c && !wq_push(w->wq, &w->local, c)) free(c);
+            }
+        }
+        free(n);
+        w->items++;
+        wq_done_one(w->wq, &w->local);
+    }
+    return 0;
+}
+
+// -------------------- driver --------------------
+
+static double run(int threads, int use_steal, LONG64 *items_out) {
+    MutexQ mq;
+    WorkQ wq;
+    thread_t *hs = (thread_t*)malloc((size_t)threads * sizeof(thread_t));
+    BenchWorker *ws = (BenchWorker*)calloc((size_t)threads, sizeof(BenchWorker));
+    if (!hs || !ws) exit(1);
+
+    if (use_steal) {
+        if (!wq_init(&wq, threads, 0)) exit(1);
+        for (int i = 0; i < threads; i++) {
+            ws[i].wq = &wq;
+            wq_local_init(&ws[i].local, i);
+        }
+        Node *root = bench_node(0);
+        if (!root || !wq_push(&wq, &ws[0].local, root)) exit(1);
+    } else {
+        mq.head = mq.tail = NULL;
+        mq.active_workers = 0;
+        mq.stop = 0;
+        InitializeCriticalSection(&mq.mu);
+        InitializeConditionVariable(&mq.cv);
+        for (int i = 0; i < threads; i++) ws[i].mq = &mq;
+        mq_push(&mq, 0);
+    }
+
+    double t0 = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        if (!thread_start(&hs[i], use_steal ? steal_worker : mutex_worker, &ws[i])) exit(1);
+    }
+    thread_join_all(hs, threads);
+    double t1 = now_seconds();
+
+    LONG64 items = 0;
+    for (int i = 0; i < threads; i++) items += ws[i].items;
+    *items_out = items;
+
+    if (use_steal) wq_destroy(&wq);
+    else DeleteCriticalSection(&mq.mu);
+    free(ws);
+    free(hs);
+    return t1 - t0;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = 64;
+    if (argc > 1) g_fanout = atoi(argv[1]);
+    if (argc > 2) g_depth = atoi(argv[2]);
+    if (argc > 3) g_work = atoi(argv[3]);
+    if (argc > 4) max_threads = atoi(argv[4]);
+    if (g_fanout < 1 || g_depth < 0 || max_threads < 1) {
+        fprintf(stderr, "usage: bench_wq [fanout] [depth] [work] [max_threads]\n");
+        return 2;
+    }
+
+    printf("fanout=%d depth=%d work=%d cpus=%d\n", g_fanout, g_depth, g_work, default_threads());
+    printf("%8s %12s %14s %14s %8s\n", "threads", "items", "mutex Mitem/s", "steal Mitem/s", "speedup");
+    for (int t = 1; t <= max_threads; t *= 2) {
+        LONG64 mi = 0, si = 0;
+        double mt = run(t, 0, &mi);
+        double st = run(t, 1, &si);
+        if (mi != si) fprintf(stderr, "item count mismatch: %lld vs %lld\n", (long long)mi, (long long)si);
+        printf("%8d %12lld %14.2f %14.2f %7.2fx\n",
+            t, (long long)si, (double)mi / mt / 1e6, (double)si / st / 1e6, mt / st);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -1,385 +1,7288 @@
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <locale.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <setjmp.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
 #include <wchar.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #ifndef ARRAYSIZE
 #define ARRAYSIZE(a) (sizeof(a)/sizeof((a)[0]))
 #endif
 
-// -------------------- small helpers --------------------
+// -------------------- platform --------------------
+
+#ifdef _WIN32
+
+#define PATH_SEP L'\\'
+#define THREAD_PROC DWORD WINAPI
+typedef HANDLE thread_t;
+typedef wchar_t pchar;      // names and paths as the system gives them: UTF-16
+
+#else
+
+#if !defined(__linux__)
+#error "ffind supports Win32 and Linux"
+#endif
+
+// Just enough of the Win32 surface for the queue and shared stats to compile unchanged.
+typedef int32_t LONG;
+typedef int64_t LONG64;
+typedef uint32_t DWORD;
+typedef pthread_mutex_t CRITICAL_SECTION;
+typedef pthread_cond_t CONDITION_VARIABLE;
+
+#define INFINITE 0xFFFFFFFFu
+#define InitializeCriticalSection(m)           pthread_mutex_init((m), NULL)
+#define DeleteCriticalSection(m)               pthread_mutex_destroy(m)
+#define EnterCriticalSection(m)                pthread_mutex_lock(m)
+#define LeaveCriticalSection(m)                pthread_mutex_unlock(m)
+#define InitializeConditionVariable(cv)        pthread_cond_init((cv), NULL)
+#define WakeConditionVariable(cv)              pthread_cond_signal(cv)
+#define WakeAllConditionVariable(cv)           pthread_cond_broadcast(cv)
+#define SleepConditionVariableCS(cv, m, ms)    pthread_cond_wait((cv), (m))
+#define InterlockedIncrement(p)                __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)                __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(p)              __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement64(p)              __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+
+#define _wcsnicmp wcsncasecmp
+#define _wtoi(s) ((int)wcstol((s), NULL, 10))
+
+#define PATH_SEP '/'
+#define THREAD_PROC void*
+typedef pthread_t thread_t;
+typedef char pchar;         // ... raw bytes, never decoded
+
+#endif
+
+// Atomics for the lock-free queue. MSVC: plain volatile accesses are
+// acquire/release under /volatile:ms (the x86/x64 default).
+#if defined(_MSC_VER) && !defined(__clang__)
+#define ATOMIC_LOAD_RLX(p)      (*(p))
+#define ATOMIC_LOAD_ACQ(p)      (*(p))
+#define ATOMIC_STORE_RLX(p, v)  (*(p) = (v))
+#define ATOMIC_STORE_REL(p, v)  (*(p) = (v))
+#define ATOMIC_FENCE()          MemoryBarrier()
+#define ATOMIC_CAS64(p, e, d)   (InterlockedCompareExchange64((p), (d), (e)) == (e))
+#define ATOMIC_ADD64(p, v)      InterlockedExchangeAdd64((p), (v))
+#define CPU_RELAX()             YieldProcessor()
+#else
+#define ATOMIC_LOAD_RLX(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD_ACQ(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_RLX(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define ATOMIC_STORE_REL(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_FENCE()          __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define ATOMIC_CAS64(p, e, d)   __extension__ ({ LONG64 e_ = (e); \
+                                    __atomic_compare_exchange_n((p), &e_, (d), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED); })
+#define ATOMIC_ADD64(p, v)      __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()             __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX()             __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX()             ((void)0)
+#endif
+#endif
+
+typedef THREAD_PROC thread_fn(void *);
+
+static int thread_start(thread_t *t, thread_fn *fn, void *arg) {
+#ifdef _WIN32
+    *t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *t != NULL;
+#else
+    int e = pthread_create(t, NULL, fn, arg);
+    if (e) errno = e;
+    return e == 0;
+#endif
+}
+
+static void thread_join_all(thread_t *ts, int n) {
+#ifdef _WIN32
+    WaitForMultipleObjects((DWORD)n, ts, TRUE, INFINITE);
+    for (int i = 0; i < n; i++) CloseHandle(ts[i]);
+#else
+    for (int i = 0; i < n; i++) pthread_join(ts[i], NULL);
+#endif
+}
+
+static void thread_yield(void) {
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+static void sleep_us(unsigned us) {
+#ifdef _WIN32
+    Sleep(us >= 1000 ? us / 1000 : 0);
+#else
+    struct timespec ts = { 0, (long)us * 1000 };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+// -------------------- small helpers --------------------
+
+static void print_syserr(const wchar_t *what) {
+#ifdef _WIN32
+    DWORD e = GetLastError();
+    wchar_t *msg = NULL;
+    FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+                   NULL, e, 0, (LPWSTR)&msg, 0, NULL);
+    fwprintf(stderr, L"%ls failed (err=%lu): %ls\n", what, (unsigned long)e, msg ? msg : L"(no message)");
+    if (msg) LocalFree(msg);
+#else
+    int e = errno;
+    fwprintf(stderr, L"%ls failed (err=%d): %s\n", what, e, strerror(e));
+#endif
+}
+
+#define FOLD_ASCII(c) ((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c))
+
+static wchar_t* wcsdup_heap(const wchar_t *s) {
+    size_t n = wcslen(s);
+    wchar_t *p = (wchar_t*)malloc((n + 1) * sizeof(wchar_t));
+    if (!p) return NULL;
+    memcpy(p, s, (n + 1) * sizeof(wchar_t));
+    return p;
+}
+
+// Bump allocator with size-class free lists, one per worker. A block freed on
+// any thread goes onto that thread's list and is reused by its next
+// allocation of the same class; memory returns to the heap only in
+// arena_destroy.
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_GRAIN 16
+#define ARENA_CLASSES 64    // blocks under 1 KiB are recycled
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+} ArenaChunk;
+
+#define ARENA_HDR ((sizeof(ArenaChunk) + ARENA_GRAIN - 1) & ~(size_t)(ARENA_GRAIN - 1))
+
+typedef struct {
+    ArenaChunk *chunks;
+    char *bump, *end;
+    void *free_list[ARENA_CLASSES];
+    size_t reserved;        // bytes taken from the heap
+} Arena;
+
+// ARENA_CLASSES for blocks too big to recycle
+static unsigned arena_class(size_t n) {
+    size_t c = (n + ARENA_GRAIN - 1) / ARENA_GRAIN;
+    return c < ARENA_CLASSES ? (unsigned)c : ARENA_CLASSES;
+}
+
+static void* arena_alloc(Arena *a, size_t n) {
+    unsigned c = arena_class(n);
+    if (c < ARENA_CLASSES && a->free_list[c]) {
+        void *p = a->free_list[c];
+        a->free_list[c] = *(void**)p;
+        return p;
+    }
+    size_t sz = c < ARENA_CLASSES ? (size_t)c * ARENA_GRAIN : n;
+    if (c == ARENA_CLASSES || (size_t)(a->end - a->bump) < sz) {
+        // big blocks get a chunk of their own; otherwise the old chunk's tail is dropped
+        size_t cap = c == ARENA_CLASSES ? sz : ARENA_CHUNK;
+        ArenaChunk *ch = (ArenaChunk*)malloc(ARENA_HDR + cap);
+        if (!ch) return NULL;
+        ch->next = a->chunks;
+        a->chunks = ch;
+        a->reserved += ARENA_HDR + cap;
+        if (c == ARENA_CLASSES) return (char*)ch + ARENA_HDR;
+        a->bump = (char*)ch + ARENA_HDR;
+        a->end = a->bump + cap;
+    }
+    void *p = a->bump;
+    a->bump += sz;
+    return p;
+}
+
+static void arena_free(Arena *a, void *p, size_t n) {
+    unsigned c = arena_class(n);
+    if (c == ARENA_CLASSES) return;
+    *(void**)p = a->free_list[c];
+    a->free_list[c] = p;
+}
+
+static void arena_destroy(Arena *a) {
+    while (a->chunks) {
+        ArenaChunk *next = a->chunks->next;
+        free(a->chunks);
+        a->chunks = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+// wchar_t -> UTF-8 for n characters; out needs 4*n bytes. Windows: UTF-16,
+// unpaired surrogates become U+FFFD. Linux: UTF-32 where U+DC80..U+DCFF are
+// undecodable bytes (see utf8_to_wide) and go back out unchanged.
+static size_t utf8_encode(char *out, const wchar_t *s, size_t n) {
+    size_t o = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t cp = (uint32_t)s[i];
+#if WCHAR_MAX <= 0xFFFF
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < n && (uint32_t)s[i+1] >= 0xDC00 && (uint32_t)s[i+1] <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + ((uint32_t)s[++i] - 0xDC00);
+        } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+            cp = 0xFFFD;
+        }
+#else
+        if (cp >= 0xDC80 && cp <= 0xDCFF) {
+            out[o++] = (char)(cp & 0xFF);
+            continue;
+        }
+#endif
+        if (cp < 0x80) {
+            out[o++] = (char)cp;
+        } else if (cp < 0x800) {
+            out[o++] = (char)(0xC0 | (cp >> 6));
+            out[o++] = (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out[o++] = (char)(0xE0 | (cp >> 12));
+            out[o++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            out[o++] = (char)(0x80 | (cp & 0x3F));
+        } else {
+            out[o++] = (char)(0xF0 | (cp >> 18));
+            out[o++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+            out[o++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            out[o++] = (char)(0x80 | (cp & 0x3F));
+        }
+    }
+    return o;
+}
+
+// NUL-terminated heap UTF-8 copy
+static char* utf8_dup(const wchar_t *s) {
+    size_t n = wcslen(s);
+    char *p = (char*)malloc(n * 4 + 1);
+    if (!p) return NULL;
+    p[utf8_encode(p, s, n)] = 0;
+    return p;
+}
+
+// NUL-terminated heap copy of s as pchars, *len of them
+static pchar* pchar_dup(const wchar_t *s, size_t *len) {
+#ifdef _WIN32
+    pchar *p = wcsdup_heap(s);
+    *len = p ? wcslen(p) : 0;
+#else
+    pchar *p = utf8_dup(s);
+    *len = p ? strlen(p) : 0;
+#endif
+    return p;
+}
+
+// n pchars as UTF-8 into out, which needs 4*n bytes; returns the length
+static size_t pchar_utf8(char *out, const pchar *s, size_t n) {
+#ifdef _WIN32
+    return utf8_encode(out, s, n);
+#else
+    memcpy(out, s, n);
+    return n;
+#endif
+}
+
+// grow *p (elem bytes each) so that need elements fit; 0 on out of memory
+static int grow_array(void **p, size_t *cap, size_t need, size_t elem) {
+    if (need <= *cap) return 1;
+    size_t nc = *cap ? *cap : 64;
+    while (nc < need) nc *= 2;
+    void *np = realloc(*p, nc * elem);
+    if (!np) return 0;
+    *p = np;
+    *cap = nc;
+    return 1;
+}
+
+#ifdef _WIN32
+
+static int is_dot_or_dotdot(const wchar_t *s) {
+    return (s[0] == L'.' && s[1] == 0) || (s[0] == L'.' && s[1] == L'.' && s[2] == 0);
+}
+
+#define PATH_CAP (MAX_PATH * 8)
+
+// UTF-8 (as stored in an index) to UTF-16; returns 0 if it does not fit.
+static size_t utf8_to_wide(wchar_t *out, size_t cap, const char *s) {
+    int n = MultiByteToWideChar(CP_UTF8, 0, s, -1, out, (int)cap);
+    return n > 0 ? (size_t)n - 1 : 0;
+}
+
+#else
+
+#define PATH_CAP (4096 * 2)
+
+// Linux names are bytes. Decode UTF-8 into wchar_t without consulting the locale;
+// bytes that are not valid UTF-8 map to U+DC80..U+DCFF so they round-trip back.
+static size_t utf8_to_wide(wchar_t *out, size_t cap, const char *s) {
+    const unsigned char *p = (const unsigned char*)s;
+    size_t n = 0;
+    while (*p) {
+        if (n + 1 >= cap) return 0;
+        unsigned c = p[0];
+        uint32_t cp;
+        int len;
+        if (c < 0x80)                { cp = c;        len = 1; }
+        else if ((c & 0xE0) == 0xC0) { cp = c & 0x1F; len = 2; }
+        else if ((c & 0xF0) == 0xE0) { cp = c & 0x0F; len = 3; }
+        else if ((c & 0xF8) == 0xF0) { cp = c & 0x07; len = 4; }
+        else                          { cp = 0;        len = 0; }
+        int ok = len > 0;
+        for (int i = 1; ok && i < len; i++) {
+            if ((p[i] & 0xC0) != 0x80) ok = 0;
+            else cp = (cp << 6) | (p[i] & 0x3F);
+        }
+        if (ok) {
+            static const uint32_t min_cp[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+            if (cp < min_cp[len] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) ok = 0;
+        }
+        if (ok) {
+            out[n++] = (wchar_t)cp;
+            p += len;
+        } else {
+            out[n++] = (wchar_t)(0xDC00 | c);
+            p += 1;
+        }
+    }
+    out[n] = 0;
+    return n;
+}
+
+// Inverse of utf8_to_wide (including the escaped bytes); returns 0 if it does not fit.
+static size_t wide_to_utf8(char *out, size_t cap, const wchar_t *s) {
+    size_t n = wcslen(s);
+    if (n * 4 + 1 > cap) return 0;
+    n = utf8_encode(out, s, n);
+    out[n] = 0;
+    return n;
+}
+
+static int is_dot_or_dotdot_u8(const char *s) {
+    return (s[0] == '.' && s[1] == 0) || (s[0] == '.' && s[1] == '.' && s[2] == 0);
+}
+
+// Directory fd shared by the queued children of one directory so they can be
+// opened with openat(). Closed when the last reference goes away.
+typedef struct DirFd {
+    int fd;
+    LONG refs;
+} DirFd;
+
+static volatile LONG g_fds_retained;   // DirFds currently holding an fd open
+static LONG g_fd_budget;               // stop retaining above this many
+
+static DirFd* dirfd_share(int fd) {
+    if (ATOMIC_LOAD_RLX(&g_fds_retained) >= g_fd_budget) return NULL;
+    DirFd *d = (DirFd*)malloc(sizeof(DirFd));
+    if (!d) return NULL;
+    d->fd = fd;
+    d->refs = 1;
+    InterlockedIncrement(&g_fds_retained);
+    return d;
+}
+
+static void dirfd_release(DirFd *d) {
+    if (!d) return;
+    if (InterlockedDecrement(&d->refs) == 0) {
+        close(d->fd);
+        InterlockedDecrement(&g_fds_retained);
+        free(d);
+    }
+}
+
+#endif
+
+// -------------------- extension filter --------------------
+//
+// -e and -E lists are compiled once into an ExtSet. An extension is the part
+// of a name after any of its dots, so "tar.gz" matches "a.tar.gz" and so does
+// "gz". Extensions of up to 8 bytes (nearly all) are packed, ASCII-folded,
+// into one uint64_t and found with a single probe of a perfect hash; longer
+// ones go to a short list.
+
+#define EXT_MAX 255     // longer entries can never match a file name
+
+typedef struct {
+    uint64_t *slots;    // packed extensions, 0 = empty
+    uint64_t mul;
+    unsigned shift;
+    char **longs;       // folded, NUL-terminated
+    size_t nlongs;
+    size_t count;
+    size_t max_len;     // bytes in the longest entry
+} ExtSet;
+
+typedef struct {
+    ExtSet only;        // -e; empty: everything
+    ExtSet skip;        // -E
+} ExtFilter;
+
+// last byte lowest, so a backwards scan can build the key of every suffix
+static uint64_t ext_pack(const char *s, size_t n) {
+    uint64_t k = 0;
+    for (size_t i = 0; i < n; i++) k |= (uint64_t)(uint8_t)FOLD_ASCII(s[i]) << (8 * (n - 1 - i));
+    return k;
+}
+
+static size_t ext_slot(const ExtSet *e, uint64_t k) {
+    return (size_t)((k * e->mul) >> e->shift);
+}
+
+static void ext_set_free(ExtSet *e) {
+    for (size_t i = 0; i < e->nlongs; i++) free(e->longs[i]);
+    free(e->longs);
+    free(e->slots);
+    memset(e, 0, sizeof(*e));
+}
+
+// finds a multiplier that sends every key to its own slot
+static int ext_set_hash(ExtSet *e, const uint64_t *keys, size_t n) {
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    for (unsigned bits = 2; bits < 32; bits++) {
+        size_t size = (size_t)1 << bits;
+        if (size < 2 * n) continue;
+        uint64_t *slots = (uint64_t*)calloc(size, sizeof(uint64_t));
+        if (!slots) return 0;
+        for (int attempt = 0; attempt < 64; attempt++) {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            e->mul = seed | 1;
+            e->shift = 64 - bits;
+            size_t k = 0;
+            for (; k < n; k++) {
+                uint64_t *s = &slots[ext_slot(e, keys[k])];
+                if (*s && *s != keys[k]) break;
+                *s = keys[k];
+            }
+            if (k == n) {
+                e->slots = slots;
+                return 1;
+            }
+            memset(slots, 0, size * sizeof(uint64_t));
+        }
+        free(slots);
+    }
+    return 0;
+}
+
+// csv like "c,h,tar.gz" (leading dots optional); 0 on out of memory
+static int ext_set_init(ExtSet *e, const wchar_t *csv) {
+    memset(e, 0, sizeof(*e));
+    if (!csv || !*csv) return 1;
+
+    size_t cap = wcslen(csv) + 1, n = 0, longs_cap = 0;
+    uint64_t *keys = (uint64_t*)malloc(cap * sizeof(uint64_t));
+    char *buf = (char*)malloc(cap * 4 + 1);
+    int ok = keys && buf;
+
+    for (const wchar_t *p = csv; ok && *p; ) {
+        while (*p == L',' || *p == L' ' || *p == L'\t') p++;
+        while (*p == L'.') p++;
+        const wchar_t *start = p;
+        while (*p && *p != L',') p++;
+        const wchar_t *end = p;
+        while (end > start && (end[-1] == L' ' || end[-1] == L'\t')) end--;
+
+        size_t len = utf8_encode(buf, start, (size_t)(end - start));
+        if (len == 0 || len > EXT_MAX) continue;
+        if (len > e->max_len) e->max_len = len;
+        if (len <= 8) {
+            keys[n++] = ext_pack(buf, len);
+            continue;
+        }
+        for (size_t i = 0; i < len; i++) buf[i] = (char)FOLD_ASCII(buf[i]);
+        buf[len] = 0;
+        char *copy = (char*)malloc(len + 1);
+        ok = copy && grow_array((void**)&e->longs, &longs_cap, e->nlongs + 1, sizeof(char*));
+        if (!ok) {
+            free(copy);
+            break;
+        }
+        memcpy(copy, buf, len + 1);
+        e->longs[e->nlongs++] = copy;
+    }
+    e->count = n + e->nlongs;
+    if (ok && n) ok = ext_set_hash(e, keys, n);
+    free(keys);
+    free(buf);
+    if (!ok) ext_set_free(e);
+    return ok;
+}
+
+static int ext_set_has_long(const ExtSet *e, const char *ext, size_t n) {
+    for (size_t i = 0; i < e->nlongs; i++) {
+        const char *s = e->longs[i];
+        size_t k = 0;
+        while (k < n && s[k] && FOLD_ASCII((uint8_t)ext[k]) == (uint8_t)s[k]) k++;
+        if (k == n && !s[k]) return 1;
+    }
+    return 0;
+}
+
+// One pass backwards over the tail of a name, keying the suffix seen so far;
+// each dot costs one probe. T is char (UTF-8) or wchar_t.
+#define EXT_SCAN(e, name, n, T, on_wide) do { \
+    size_t stop_ = (n) > (e)->max_len + 1 ? (n) - (e)->max_len - 1 : 0; \
+    uint64_t k_ = 0; \
+    for (size_t i_ = (n); i_-- > stop_; ) { \
+        uint32_t c_ = sizeof(T) == 1 ? (uint8_t)(name)[i_] : (uint32_t)(name)[i_]; \
+        size_t len_ = (n) - 1 - i_; \
+        if (c_ >= 0x80 && sizeof(T) > 1) on_wide; \
+        if (c_ == '.' && len_ > 8) { \
+            if (sizeof(T) > 1) on_wide; \
+            if (ext_set_has_long((e), (const char*)((name) + i_ + 1), len_)) return 1; \
+        } else if (c_ == '.' && len_ && (e)->slots && (e)->slots[ext_slot((e), k_)] == k_) { \
+            return 1; \
+        } \
+        if (len_ < 8) k_ |= (uint64_t)FOLD_ASCII(c_) << (8 * len_); \
+    } \
+    return 0; \
+} while (0)
+
+// name (UTF-8, n bytes) ends in ".<entry>" for some entry
+static int ext_set_match8(const ExtSet *e, const char *name, size_t n) {
+    EXT_SCAN(e, name, n, char, (void)0);
+}
+
+#ifdef _WIN32
+
+static int ext_set_match(const ExtSet *e, const wchar_t *name, size_t n) {
+    EXT_SCAN(e, name, n, wchar_t, goto wide);
+wide:
+    // non-ASCII or a long entry: go through UTF-8. An entry of k bytes is at
+    // most k characters, so the last max_len + 1 of them are enough.
+    {
+        char tail[(EXT_MAX + 1) * 4];
+        size_t keep = n > e->max_len + 1 ? e->max_len + 1 : n;
+        return ext_set_match8(e, tail, utf8_encode(tail, name + n - keep, keep));
+    }
+}
+
+static int ext_allowed(const ExtFilter *f, const wchar_t *name, size_t n) {
+    if (f->only.count && !ext_set_match(&f->only, name, n)) return 0;
+    return !f->skip.count || !ext_set_match(&f->skip, name, n);
+}
+
+#endif
+
+static int ext_allowed8(const ExtFilter *f, const char *name, size_t n) {
+    if (f->only.count && !ext_set_match8(&f->only, name, n)) return 0;
+    return !f->skip.count || !ext_set_match8(&f->skip, name, n);
+}
+
+static void ext_filter_free(ExtFilter *f) {
+    ext_set_free(&f->only);
+    ext_set_free(&f->skip);
+}
+
+// -------------------- matching --------------------
+//
+// Case-insensitive substring search. Folding rule: ASCII 'A'-'Z' fold to
+// 'a'-'z'; every other code unit, including all non-ASCII, must match exactly.
+// That is what _wcsnicmp does in the default "C" locale, which ffind never
+// changes on Windows, so results are identical to the old per-offset
+// _wcsnicmp loop. Windows matches UTF-16 names; Linux matches the names'
+// bytes against the needle's UTF-8, which folding treats the same way.
+//
+// The needle is folded once. Candidates are positions whose first and last
+// characters match the needle's (Mula's generic SIMD strstr), checked a whole
+// vector of positions at a time; only those are verified.
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#if WCHAR_MAX > 0xFFFF
+#define WCHAR_BITS 32
+#else
+#define WCHAR_BITS 16
+#endif
+
+static unsigned ctz32(unsigned x) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctz(x);
+#endif
+}
+
+static unsigned ctz64(uint64_t x) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctzll(x);
+#endif
+}
+
+// needle[1..m-2] against hay (needle already folded)
+#define DEFINE_FOLD_EQ(NAME, T) \
+static int NAME(const T *hay, const T *needle, size_t m) { \
+    for (size_t k = 0; k < m; k++) { \
+        if (FOLD_ASCII(hay[k]) != needle[k]) return 0; \
+    } \
+    return 1; \
+}
+
+#define DEFINE_CONTAINS_SCALAR(NAME, T, EQ) \
+static int NAME(const T *needle, size_t m, const T *hay, size_t n) { \
+    T first = needle[0], last = needle[m - 1]; \
+    for (size_t i = 0; i + m <= n; i++) { \
+        if (FOLD_ASCII(hay[i]) != first || FOLD_ASCII(hay[i + m - 1]) != last) continue; \
+        if (m <= 2 || EQ(hay + i + 1, needle + 1, m - 2)) return 1; \
+    } \
+    return 0; \
+}
+
+// P/B pick the instruction set (_mm/128 = SSE2, _mm256/256 = AVX2), W the lane width.
+#define SIMD_FOLD(P, B, W, x) \
+    P##_or_si##B((x), P##_and_si##B( \
+        P##_and_si##B(P##_cmpgt_epi##W((x), P##_set1_epi##W('A' - 1)), \
+                      P##_cmpgt_epi##W(P##_set1_epi##W('Z' + 1), (x))), \
+        P##_set1_epi##W(0x20)))
+
+#define DEFINE_CONTAINS_SIMD(NAME, T, W, P, B, ATTR, EQ, SCALAR) \
+ATTR static int NAME(const T *needle, size_t m, const T *hay, size_t n) { \
+    const size_t lanes = (B / 8) / sizeof(T); \
+    const unsigned lane_bits = (1u << sizeof(T)) - 1; \
+    const __m##B##i vf = P##_set1_epi##W(needle[0]); \
+    const __m##B##i vl = P##_set1_epi##W(needle[m - 1]); \
+    size_t i = 0; \
+    for (; i + m - 1 + lanes <= n; i += lanes) { \
+        __m##B##i a = P##_loadu_si##B((const __m##B##i*)(hay + i)); \
+        __m##B##i b = P##_loadu_si##B((const __m##B##i*)(hay + i + m - 1)); \
+        a = SIMD_FOLD(P, B, W, a); \
+        b = SIMD_FOLD(P, B, W, b); \
+        unsigned mask = (unsigned)P##_movemask_epi8( \
+            P##_and_si##B(P##_cmpeq_epi##W(a, vf), P##_cmpeq_epi##W(b, vl))); \
+        while (mask) { \
+            unsigned bit = ctz32(mask); \
+            if (m <= 2 || EQ(hay + i + bit / sizeof(T) + 1, needle + 1, m - 2)) return 1; \
+            mask &= ~(lane_bits << bit); \
+        } \
+    } \
+    return i + m <= n && SCALAR(needle, m, hay + i, n - i); \
+}
+
+#ifdef _WIN32
+
+typedef uint16_t wunit;
+
+DEFINE_FOLD_EQ(wfold_eq, wunit)
+DEFINE_CONTAINS_SCALAR(wcontains_scalar, wunit, wfold_eq)
+#ifdef HAVE_X86_SIMD
+DEFINE_CONTAINS_SIMD(wcontains_sse2, wunit, 16, _mm, 128, , wfold_eq, wcontains_scalar)
+DEFINE_CONTAINS_SIMD(wcontains_avx2, wunit, 16, _mm256, 256, TARGET_AVX2, wfold_eq, wcontains_scalar)
+#endif
+
+typedef int (*wcontains_fn)(const wunit *needle, size_t m, const wunit *hay, size_t n);
+static wcontains_fn g_wcontains = wcontains_scalar;
+
+#endif
+
+// UTF-8 names (Linux, index files). ASCII bytes never occur inside a
+// multi-byte sequence, so the same folding rule gives the same answers as on
+// wchar_t.
+DEFINE_FOLD_EQ(bfold_eq, uint8_t)
+DEFINE_CONTAINS_SCALAR(bcontains_scalar, uint8_t, bfold_eq)
+#ifdef HAVE_X86_SIMD
+DEFINE_CONTAINS_SIMD(bcontains_sse2, uint8_t, 8, _mm, 128, , bfold_eq, bcontains_scalar)
+DEFINE_CONTAINS_SIMD(bcontains_avx2, uint8_t, 8, _mm256, 256, TARGET_AVX2, bfold_eq, bcontains_scalar)
+#endif
+
+typedef int (*bcontains_fn)(const uint8_t *needle, size_t m, const uint8_t *hay, size_t n);
+static bcontains_fn g_bcontains = bcontains_scalar;
+
+static int cpu_has_avx2(void) {
+#if defined(HAVE_X86_SIMD) && defined(_MSC_VER) && !defined(__clang__)
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) return 0;
+    __cpuid(r, 1);
+    if (!(r[2] & (1 << 27)) || !(r[2] & (1 << 28))) return 0; // OSXSAVE, AVX
+    if ((_xgetbv(0) & 6) != 6) return 0;                      // OS saves YMM
+    __cpuidex(r, 7, 0);
+    return (r[1] >> 5) & 1;
+#elif defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+static const char* match_init(void) {
+#ifdef HAVE_X86_SIMD
+    if (cpu_has_avx2()) {
+#ifdef _WIN32
+        g_wcontains = wcontains_avx2;
+#endif
+        g_bcontains = bcontains_avx2;
+        return "avx2";
+    }
+#ifdef _WIN32
+    g_wcontains = wcontains_sse2;
+#endif
+    g_bcontains = bcontains_sse2;
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+typedef struct {
+#ifdef _WIN32
+    wunit *folded;    // owned, NULL for the empty needle
+#endif
+    size_t len;       // characters
+    uint8_t *folded8; // the same needle as UTF-8, for Linux names and index files
+    size_t len8;
+} Needle;
+
+static int needle_init(Needle *nd, const wchar_t *s) {
+    memset(nd, 0, sizeof(*nd));
+    nd->len = s ? wcslen(s) : 0;
+    if (!nd->len) return 1;
+    nd->folded8 = (uint8_t*)malloc(nd->len * 4);
+    if (!nd->folded8) return 0;
+#ifdef _WIN32
+    nd->folded = (wunit*)malloc(nd->len * sizeof(wunit));
+    if (!nd->folded) return 0;
+    for (size_t i = 0; i < nd->len; i++) nd->folded[i] = (wunit)FOLD_ASCII(s[i]);
+#endif
+    nd->len8 = utf8_encode((char*)nd->folded8, s, nd->len);
+    for (size_t i = 0; i < nd->len8; i++) nd->folded8[i] = (uint8_t)FOLD_ASCII(nd->folded8[i]);
+    return 1;
+}
+
+static void needle_free(Needle *nd) {
+#ifdef _WIN32
+    free(nd->folded);
+    nd->folded = NULL;
+#endif
+    free(nd->folded8);
+    nd->folded8 = NULL;
+}
+
+#ifdef _WIN32
+// empty needle matches everything
+static int needle_match(const Needle *nd, const wchar_t *hay, size_t n) {
+    if (!nd->len) return 1;
+    if (nd->len > n) return 0;
+    return g_wcontains(nd->folded, nd->len, (const wunit*)hay, n);
+}
+#endif
+
+static int needle_match8(const Needle *nd, const char *hay, size_t n) {
+    if (!nd->len8) return 1;
+    if (nd->len8 > n) return 0;
+    return g_bcontains(nd->folded8, nd->len8, (const uint8_t*)hay, n);
+}
+
+// ---- file contents (-c) ----
+//
+// -c looks for the text's UTF-8 in the bytes of files, ASCII-folded like
+// names. Rather than the first and last bytes, the scan lines up the text's
+// two rarest bytes (by a rough frequency order for text, code and binaries),
+// a vector of positions at a time, and compares in full only where both
+// agree. Without SIMD, memchr jumps to the rarest byte when it is not a
+// letter.
+
+#define CONTENT_TEXT_MAX 4096
+
+typedef struct ContentText {
+    uint8_t *folded;    // owned
+    size_t len;
+    size_t r1, r2;      // offsets of the rarest byte and the next rarest
+    int (*find)(const struct ContentText *c, const uint8_t *hay, size_t n);
+} ContentText;
+
+// lower is rarer; bytes not listed are rarest of all
+static unsigned byte_rank(uint8_t c) {
+    static const char k_common[] =
+        "zqjxkvbywgpf#[]<>{}*'\"!?&|+%$@\\~`^0123456789/:;=)(,._-mucdlhrsnioate\r\t\x00\xff\n ";
+    const char *p = (const char*)memchr(k_common, c, sizeof(k_common) - 1);
+    return p ? (unsigned)(p - k_common) + 1 : 0;
+}
+
+static int content_scalar(const ContentText *c, const uint8_t *hay, size_t n) {
+    size_t m = c->len;
+    if (n < m) return 0;
+    uint8_t b1 = c->folded[c->r1], b2 = c->folded[c->r2];
+    int jump = b1 < 'a' || b1 > 'z';
+    for (size_t i = 0; i + m <= n; i++) {
+        if (jump) {
+            const uint8_t *p = (const uint8_t*)memchr(hay + i + c->r1, b1, n - m + 1 - i);
+            if (!p) return 0;
+            i = (size_t)(p - hay) - c->r1;
+        } else if (FOLD_ASCII(hay[i + c->r1]) != b1) {
+            continue;
+        }
+        if (FOLD_ASCII(hay[i + c->r2]) == b2 && bfold_eq(hay + i, c->folded, m)) return 1;
+    }
+    return 0;
+}
+
+// Folding is only needed for a rare byte that is a letter.
+#define DEFINE_CONTENT_SIMD(NAME, P, B, ATTR) \
+ATTR static int NAME(const ContentText *c, const uint8_t *hay, size_t n) { \
+    const size_t lanes = B / 8, m = c->len; \
+    const uint8_t b1 = c->folded[c->r1], b2 = c->folded[c->r2]; \
+    const int f1 = b1 >= 'a' && b1 <= 'z', f2 = b2 >= 'a' && b2 <= 'z'; \
+    const __m##B##i v1 = P##_set1_epi8((char)b1); \
+    const __m##B##i v2 = P##_set1_epi8((char)b2); \
+    size_t i = 0; \
+    for (; i + m - 1 + lanes <= n; i += lanes) { \
+        __m##B##i a = P##_loadu_si##B((const __m##B##i*)(hay + i + c->r1)); \
+        __m##B##i b = P##_loadu_si##B((const __m##B##i*)(hay + i + c->r2)); \
+        if (f1) a = SIMD_FOLD(P, B, 8, a); \
+        if (f2) b = SIMD_FOLD(P, B, 8, b); \
+        unsigned mask = (unsigned)P##_movemask_epi8( \
+            P##_and_si##B(P##_cmpeq_epi8(a, v1), P##_cmpeq_epi8(b, v2))); \
+        while (mask) { \
+            unsigned bit = ctz32(mask); \
+            if (bfold_eq(hay + i + bit, c->folded, m)) return 1; \
+            mask &= mask - 1; \
+        } \
+    } \
+    return content_scalar(c, hay + i, n - i); \
+}
+
+#ifdef HAVE_X86_SIMD
+DEFINE_CONTENT_SIMD(content_sse2, _mm, 128, )
+DEFINE_CONTENT_SIMD(content_avx2, _mm256, 256, TARGET_AVX2)
+#endif
+
+// s is not empty; 0 if out of memory
+static int content_init(ContentText *c, const wchar_t *s) {
+    memset(c, 0, sizeof(*c));
+    size_t n = wcslen(s);
+    c->folded = (uint8_t*)malloc(n * 4);
+    if (!c->folded) return 0;
+    c->len = utf8_encode((char*)c->folded, s, n);
+    for (size_t i = 0; i < c->len; i++) c->folded[i] = (uint8_t)FOLD_ASCII(c->folded[i]);
+    for (size_t i = 1; i < c->len; i++) {
+        if (byte_rank(c->folded[i]) < byte_rank(c->folded[c->r1])) c->r1 = i;
+    }
+    c->r2 = c->r1 ? 0 : c->len > 1;
+    for (size_t i = 0; i < c->len; i++) {
+        if (i != c->r1 && byte_rank(c->folded[i]) < byte_rank(c->folded[c->r2])) c->r2 = i;
+    }
+    c->find = content_scalar;
+#ifdef HAVE_X86_SIMD
+    c->find = cpu_has_avx2() ? content_avx2 : content_sse2;
+#endif
+    return 1;
+}
+
+static void content_free(ContentText *c) {
+    free(c->folded);
+    c->folded = NULL;
+}
+
+// ---- several needles ----
+//
+// Aho-Corasick over the needles' UTF-8 bytes, ASCII-folded like the single
+// needle matcher (folding only touches ASCII, so byte and character matches
+// agree). Bytes that occur in no needle share column 0 of the transition
+// table and 'A'-'Z' share their lowercase column, so the automaton is a full
+// DFA of nstates x nclasses and scanning is one lookup per byte.
+
+#define AC_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t nneedles;
+    const wchar_t **text;   // needles as given, for the output tag
+    char **text8;
+    uint8_t cls[256];       // byte -> column
+    uint32_t nclasses, nstates;
+    uint32_t *next;         // nstates x nclasses
+    uint32_t *term;         // needle spelled by this state, AC_NONE if none
+    uint32_t *dict;         // longest proper suffix state with a term, 0 if none
+} AcAuto;
+
+// needles hit by one name; stamp[] dedups without clearing between names
+typedef struct {
+    uint32_t *stamp;
+    uint32_t gen;
+    uint32_t *ids;
+    uint32_t n;
+} AcHits;
+
+static void ac_free(AcAuto *ac) {
+    if (ac->text8) {
+        for (uint32_t i = 0; i < ac->nneedles; i++) free(ac->text8[i]);
+    }
+    free(ac->text8);
+    free(ac->next);
+    free(ac->term);
+    free(ac->dict);
+    memset(ac, 0, sizeof(*ac));
+}
+
+static int ac_init(AcAuto *ac, const wchar_t **needles, uint32_t n) {
+    memset(ac, 0, sizeof(*ac));
+    ac->nneedles = n;
+    ac->text = needles;
+    ac->text8 = (char**)calloc(n, sizeof(char*));
+    if (!ac->text8) goto oom;
+
+    size_t total = 1;
+    int used[256] = {0};
+    for (uint32_t i = 0; i < n; i++) {
+        size_t len = wcslen(needles[i]);
+        ac->text8[i] = (char*)malloc(len * 4 + 1);
+        if (!ac->text8[i]) goto oom;
+        ac->text8[i][utf8_encode(ac->text8[i], needles[i], len)] = 0;
+        for (const char *p = ac->text8[i]; *p; p++) used[FOLD_ASCII((uint8_t)*p)] = 1;
+        total += strlen(ac->text8[i]);
+    }
+    ac->nclasses = 1;
+    for (int b = 0; b < 256; b++) {
+        if (used[b]) ac->cls[b] = (uint8_t)ac->nclasses++;
+    }
+    for (int b = 'A'; b <= 'Z'; b++) ac->cls[b] = ac->cls[b | 0x20];
+    if (total > UINT32_MAX / ac->nclasses) goto oom;
+
+    ac->next = (uint32_t*)calloc(total * ac->nclasses, sizeof(uint32_t));
+    ac->term = (uint32_t*)malloc(total * sizeof(uint32_t));
+    ac->dict = (uint32_t*)calloc(total, sizeof(uint32_t));
+    uint32_t *fail = (uint32_t*)calloc(total, sizeof(uint32_t));
+    if (!ac->next || !ac->term || !ac->dict || !fail) {
+        free(fail);
+        goto oom;
+    }
+
+    // trie; 0 means "no edge" while building since nothing points back at the root
+    ac->nstates = 1;
+    ac->term[0] = AC_NONE;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t s = 0;
+        for (const char *p = ac->text8[i]; *p; p++) {
+            uint32_t *e = &ac->next[(size_t)s * ac->nclasses + ac->cls[(uint8_t)*p]];
+            if (!*e) {
+                ac->term[ac->nstates] = AC_NONE;
+                *e = ac->nstates++;
+            }
+            s = *e;
+        }
+        if (ac->term[s] == AC_NONE) ac->term[s] = i;   // a repeated needle is reported once
+    }
+
+    // breadth-first: fill the missing edges from the failure state's row. A
+    // row is complete once dequeued, so nonzero entries before that are trie edges.
+    uint32_t *queue = (uint32_t*)malloc(ac->nstates * sizeof(uint32_t));
+    if (!queue) {
+        free(fail);
+        goto oom;
+    }
+    uint32_t head = 0, tail = 0;
+    for (uint32_t c = 1; c < ac->nclasses; c++) {
+        if (ac->next[c]) queue[tail++] = ac->next[c];
+    }
+    while (head < tail) {
+        uint32_t u = queue[head++];
+        uint32_t *row = &ac->next[(size_t)u * ac->nclasses];
+        const uint32_t *frow = &ac->next[(size_t)fail[u] * ac->nclasses];
+        for (uint32_t c = 0; c < ac->nclasses; c++) {
+            if (row[c]) {
+                fail[row[c]] = frow[c];
+                queue[tail++] = row[c];
+            } else {
+                row[c] = frow[c];
+            }
+        }
+        uint32_t f = fail[u];
+        ac->dict[u] = f && ac->term[f] != AC_NONE ? f : ac->dict[f];
+    }
+    free(queue);
+    free(fail);
+    return 1;
+
+oom:
+    ac_free(ac);
+    return 0;
+}
+
+static int ac_hits_init(AcHits *h, const AcAuto *ac) {
+    memset(h, 0, sizeof(*h));
+    h->stamp = (uint32_t*)calloc(ac->nneedles, sizeof(uint32_t));
+    h->ids = (uint32_t*)malloc(ac->nneedles * sizeof(uint32_t));
+    return h->stamp && h->ids;
+}
+
+static void ac_hits_free(AcHits *h) {
+    free(h->stamp);
+    free(h->ids);
+    memset(h, 0, sizeof(*h));
+}
+
+static void ac_report(const AcAuto *ac, AcHits *h, uint32_t s) {
+    uint32_t i = ac->term[s];
+    if (i == AC_NONE || h->stamp[i] == h->gen) return;
+    h->stamp[i] = h->gen;
+    h->ids[h->n++] = i;
+}
+
+static void ac_begin(const AcAuto *ac, AcHits *h) {
+    if (++h->gen == 0) {
+        memset(h->stamp, 0, ac->nneedles * sizeof(uint32_t));
+        h->gen = 1;
+    }
+    h->n = 0;
+    ac_report(ac, h, 0);    // empty needles
+}
+
+#define AC_STEP(ac, h, s, b) do { \
+    s = (ac)->next[(size_t)(s) * (ac)->nclasses + (ac)->cls[(uint8_t)(b)]]; \
+    for (uint32_t d_ = (ac)->term[s] != AC_NONE ? (s) : (ac)->dict[s]; d_; d_ = (ac)->dict[d_]) \
+        ac_report((ac), (h), d_); \
+} while (0)
+
+// ids sorted so the tag lists needles in command-line order
+static uint32_t ac_end(AcHits *h) {
+    for (uint32_t i = 1; i < h->n; i++) {
+        uint32_t v = h->ids[i], j = i;
+        for (; j > 0 && h->ids[j - 1] > v; j--) h->ids[j] = h->ids[j - 1];
+        h->ids[j] = v;
+    }
+    return h->n;
+}
+
+#ifdef _WIN32
+// number of needles found in hay; their ids are in h->ids
+static uint32_t ac_match(const AcAuto *ac, AcHits *h, const wchar_t *hay, size_t n) {
+    ac_begin(ac, h);
+    uint32_t s = 0;
+    for (size_t i = 0; i < n; i++) {
+        if ((uint32_t)hay[i] < 0x80) {
+            AC_STEP(ac, h, s, hay[i]);
+            continue;
+        }
+        size_t k = 1;
+#if WCHAR_BITS == 16
+        if (hay[i] >= 0xD800 && hay[i] <= 0xDBFF && i + 1 < n) k = 2;
+#endif
+        char u[8];
+        size_t m = utf8_encode(u, hay + i, k);
+        for (size_t j = 0; j < m; j++) AC_STEP(ac, h, s, u[j]);
+        i += k - 1;
+    }
+    return ac_end(h);
+}
+#endif
+
+static uint32_t ac_match8(const AcAuto *ac, AcHits *h, const char *hay, size_t n) {
+    ac_begin(ac, h);
+    uint32_t s = 0;
+    for (size_t i = 0; i < n; i++) AC_STEP(ac, h, s, hay[i]);
+    return ac_end(h);
+}
+
+// Appends a TAB and the needles that hit, comma separated, to the line in
+// buf (len characters of cap); needles that do not fit are left out.
+#ifdef _WIN32
+static size_t ac_tag(const AcAuto *ac, const AcHits *h, wchar_t *buf, size_t len, size_t cap) {
+    for (uint32_t k = 0; k < h->n; k++) {
+        const wchar_t *t = ac->text[h->ids[k]];
+        size_t tl = wcslen(t);
+        if (len + tl + 2 > cap) break;
+        buf[len++] = k ? L',' : L'\t';
+        memcpy(buf + len, t, tl * sizeof(wchar_t));
+        len += tl;
+    }
+    buf[len] = 0;
+    return len;
+}
+#endif
+
+static size_t ac_tag8(const AcAuto *ac, const AcHits *h, char *buf, size_t len, size_t cap) {
+    for (uint32_t k = 0; k < h->n; k++) {
+        const char *t = ac->text8[h->ids[k]];
+        size_t tl = strlen(t);
+        if (len + tl + 2 > cap) break;
+        buf[len++] = k ? ',' : '\t';
+        memcpy(buf + len, t, tl);
+        len += tl;
+    }
+    buf[len] = 0;
+    return len;
+}
+
+// ---- patterns (-g, -r) ----
+//
+// A glob or regular expression compiles once into a DFA over the name's UTF-8
+// bytes, ASCII-folded like the needles, which every worker then only reads.
+// The parser builds a Thompson NFA and subset construction turns it into a
+// full nstates x nsym table. Two extra symbols stand for the start and the
+// end of the name; ^ and $ are edges on them. A regex matches anywhere in the
+// name, a glob must match all of it. Any state containing the NFA's match
+// state is the single accepting state, so scanning stops at the first match,
+// and anchored patterns stop at the first byte that rules them out.
+//
+// The longest run of plain characters every match must contain goes to the
+// index as trigrams, and to the needle matcher as a prefilter unless the DFA
+// can turn a name down at its first byte, which is cheaper. A pattern that is
+// nothing but that run (a plain regex, or a glob "*run*") is a substring
+// search and runs as the needle alone.
+
+
+#define RE_MAX_NODES  (1 << 16)
+#define RE_MAX_STATES 4096
+#define RE_MAX_REPEAT 255
+
+#define PAT_ACCEPT 1
+#define PAT_DEAD   2
+#define PAT_NONE   UINT32_MAX
+
+enum { RE_EMPTY, RE_SPLIT, RE_BYTES, RE_BEGIN, RE_END, RE_MATCH };
+
+typedef struct {
+    uint8_t op, lo, hi;     // RE_BYTES: lo..hi
+    uint32_t out, out1;     // out1 only for RE_SPLIT
+} ReNode;
+
+typedef struct {
+    uint32_t lo, hi;
+} CpRange;
+
+// start node, and the unpatched outs threaded through themselves (slot + 1, 0 ends)
+typedef struct {
+    uint32_t start, outs;
+} ReFrag;
+
+typedef struct {
+    const wchar_t *s, *p;
+    int glob, depth;
+    ReNode *nodes;
+    size_t nnodes, nodes_cap;
+    CpRange *set;           // class being parsed
+    size_t nset, set_cap;
+    wchar_t *run, *best;    // plain characters in a row at the top level
+    size_t nrun, nbest;
+    int alt_top;            // a top-level | leaves nothing required
+    int special;            // top-level atoms that are not plain characters
+    int star_ends;          // glob: * first, * last
+    int path;               // glob: * and ? stop at '/', ** spans directories
+    int exact_case;         // no ASCII folding (both for ignore files)
+    const wchar_t *error;
+    int oom;
+} ReParse;
+
+typedef struct {
+    uint8_t cls[256];       // byte -> column
+    uint32_t nsym;          // byte columns, then the start and end of the name
+    uint32_t nstates;
+    uint32_t *next;         // nstates x nsym, holding row offsets (state x nsym)
+    uint32_t start;         // row after the start symbol
+    uint32_t accept;        // the accepting row (nsym), PAT_NONE if nothing matches
+    uint32_t stop;          // rows below this are final: dead (0) and accept
+    wchar_t *literal;       // every match contains it; NULL if none is known
+    int fails_fast;         // the first byte can rule a name out: no prefilter
+    int exact;              // "lit" or "*lit*": the literal alone decides
+    const wchar_t *error;   // why pat_init failed, NULL when out of memory
+    size_t error_at;
+} Pattern;
+
+static int re_fail(ReParse *r, const wchar_t *msg) {
+    if (!r->error && !r->oom) r->error = msg;
+    return 0;
+}
+
+static uint32_t re_node(ReParse *r, int op, uint32_t out, uint32_t out1) {
+    if (r->nnodes >= RE_MAX_NODES) return re_fail(r, L"pattern too large");
+    if (!grow_array((void**)&r->nodes, &r->nodes_cap, r->nnodes + 1, sizeof(ReNode))) {
+        r->oom = 1;
+        return 0;
+    }
+    ReNode *n = &r->nodes[r->nnodes];
+    n->op = (uint8_t)op;
+    n->lo = n->hi = 0;
+    n->out = out;
+    n->out1 = out1;
+    return (uint32_t)r->nnodes++;
+}
+
+static uint32_t* re_slot(ReParse *r, uint32_t slot) {
+    ReNode *n = &r->nodes[(slot - 1) >> 1];
+    return (slot - 1) & 1 ? &n->out1 : &n->out;
+}
+
+#define RE_OUT(n)  (((n) << 1) + 1)
+#define RE_OUT1(n) (((n) << 1) + 2)
+
+static void re_patch(ReParse *r, uint32_t outs, uint32_t to) {
+    while (outs) {
+        uint32_t *s = re_slot(r, outs);
+        outs = *s;
+        *s = to;
+    }
+}
+
+static uint32_t re_join(ReParse *r, uint32_t a, uint32_t b) {
+    if (!a) return b;
+    for (uint32_t x = a;;) {
+        uint32_t *s = re_slot(r, x);
+        if (!*s) {
+            *s = b;
+            return a;
+        }
+        x = *s;
+    }
+}
+
+// one node with a single unpatched out
+static int re_single(ReParse *r, int op, ReFrag *f) {
+    uint32_t n = re_node(r, op, 0, 0);
+    if (!n) return 0;
+    f->start = n;
+    f->outs = RE_OUT(n);
+    return 1;
+}
+
+static int re_bytes(ReParse *r, uint8_t lo, uint8_t hi, ReFrag *f) {
+    if (!re_single(r, RE_BYTES, f)) return 0;
+    r->nodes[f->start].lo = lo;
+    r->nodes[f->start].hi = hi;
+    return 1;
+}
+
+static void re_cat(ReParse *r, ReFrag *a, const ReFrag *b) {
+    re_patch(r, a->outs, b->start);
+    a->outs = b->outs;
+}
+
+static int re_alt2(ReParse *r, ReFrag *a, const ReFrag *b) {
+    uint32_t n = re_node(r, RE_SPLIT, a->start, b->start);
+    if (!n) return 0;
+    a->start = n;
+    a->outs = re_join(r, a->outs, b->outs);
+    return 1;
+}
+
+static int re_star(ReParse *r, ReFrag *f) {
+    uint32_t n = re_node(r, RE_SPLIT, f->start, 0);
+    if (!n) return 0;
+    re_patch(r, f->outs, n);
+    f->start = n;
+    f->outs = RE_OUT1(n);
+    return 1;
+}
+
+static int re_plus(ReParse *r, ReFrag *f) {
+    uint32_t n = re_node(r, RE_SPLIT, f->start, 0);
+    if (!n) return 0;
+    re_patch(r, f->outs, n);
+    f->outs = RE_OUT1(n);
+    return 1;
+}
+
+static int re_quest(ReParse *r, ReFrag *f) {
+    uint32_t n = re_node(r, RE_SPLIT, f->start, 0);
+    if (!n) return 0;
+    f->start = n;
+    f->outs = re_join(r, f->outs, RE_OUT1(n));
+    return 1;
+}
+
+// ---- code point sets ----
+
+static int re_set_add(ReParse *r, uint32_t lo, uint32_t hi) {
+    if (!grow_array((void**)&r->set, &r->set_cap, r->nset + 1, sizeof(CpRange))) {
+        r->oom = 1;
+        return 0;
+    }
+    r->set[r->nset].lo = lo;
+    r->set[r->nset].hi = hi;
+    r->nset++;
+    return 1;
+}
+
+// sorted, merged, closed under ASCII folding (unless exact_case); negated over all of Unicode
+static int re_set_finish(ReParse *r, int negate) {
+    size_t n = r->exact_case ? 0 : r->nset;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t lo = r->set[i].lo, hi = r->set[i].hi;
+        if (lo <= 'Z' && hi >= 'A' && !re_set_add(r, (lo > 'A' ? lo : 'A') | 0x20, (hi < 'Z' ? hi : 'Z') | 0x20)) return 0;
+        if (lo <= 'z' && hi >= 'a' && !re_set_add(r, (lo > 'a' ? lo : 'a') & ~0x20u, (hi < 'z' ? hi : 'z') & ~0x20u)) return 0;
+    }
+    for (size_t i = 1; i < r->nset; i++) {
+        CpRange v = r->set[i];
+        size_t j = i;
+        for (; j > 0 && r->set[j - 1].lo > v.lo; j--) r->set[j] = r->set[j - 1];
+        r->set[j] = v;
+    }
+    size_t m = 0;
+    for (size_t i = 0; i < r->nset; i++) {
+        if (m && r->set[i].lo <= r->set[m - 1].hi + 1) {
+            if (r->set[i].hi > r->set[m - 1].hi) r->set[m - 1].hi = r->set[i].hi;
+        } else {
+            r->set[m++] = r->set[i];
+        }
+    }
+    r->nset = m;
+    if (!negate) return 1;
+
+    uint32_t next = 0;
+    size_t k = r->nset;
+    for (size_t i = 0; i < k; i++) {
+        if (r->set[i].lo > next && !re_set_add(r, next, r->set[i].lo - 1)) return 0;
+        next = r->set[i].hi + 1;
+    }
+    if (next <= 0x10FFFF && !re_set_add(r, next, 0x10FFFF)) return 0;
+    memmove(r->set, r->set + k, (r->nset - k) * sizeof(CpRange));
+    r->nset -= k;
+    return 1;
+}
+
+static void re_utf8(uint32_t cp, uint8_t *b) {
+    wchar_t w[2];
+    size_t n = 0;
+#if WCHAR_MAX <= 0xFFFF
+    if (cp >= 0x10000) {
+        w[n++] = (wchar_t)(0xD800 + ((cp - 0x10000) >> 10));
+        w[n++] = (wchar_t)(0xDC00 + ((cp - 0x10000) & 0x3FF));
+    } else
+#endif
+    w[n++] = (wchar_t)cp;
+    utf8_encode((char*)b, w, n);
+}
+
+// [lo, hi] as alternatives of byte-range sequences, split until every byte
+// position of a sequence is one contiguous range (as in RE2's UTF-8 ranges)
+static int re_cp_range(ReParse *r, uint32_t lo, uint32_t hi, ReFrag *f, int *have) {
+    static const uint32_t last_of_len[3] = { 0x7F, 0x7FF, 0xFFFF };
+    for (int i = 0; i < 3; i++) {
+        if (lo <= last_of_len[i] && hi > last_of_len[i]) {
+            return re_cp_range(r, lo, last_of_len[i], f, have) && re_cp_range(r, last_of_len[i] + 1, hi, f, have);
+        }
+    }
+    int len = lo < 0x80 ? 1 : lo < 0x800 ? 2 : lo < 0x10000 ? 3 : 4;
+    for (int i = 1; i < len; i++) {
+        uint32_t m = (1u << (6 * i)) - 1;
+        if ((lo & ~m) == (hi & ~m)) continue;
+        if (lo & m) return re_cp_range(r, lo, lo | m, f, have) && re_cp_range(r, (lo | m) + 1, hi, f, have);
+        if ((hi & m) != m) return re_cp_range(r, lo, (hi & ~m) - 1, f, have) && re_cp_range(r, hi & ~m, hi, f, have);
+    }
+    uint8_t a[4], b[4];
+    re_utf8(lo, a);
+    re_utf8(hi, b);
+    ReFrag seq, x;
+    if (!re_bytes(r, a[0], b[0], &seq)) return 0;
+    for (int i = 1; i < len; i++) {
+        if (!re_bytes(r, a[i], b[i], &x)) return 0;
+        re_cat(r, &seq, &x);
+    }
+    if (!*have) {
+        *f = seq;
+        *have = 1;
+        return 1;
+    }
+    return re_alt2(r, f, &seq);
+}
+
+// The finished set as a fragment matching one character. A set with U+FFFD
+// (., negated classes) also takes any single byte from 0x80 up, so a byte
+// that does not start a valid sequence (a stray continuation, a lead byte
+// cut short, 0xC0/0xC1, 0xF5-0xFF) counts as one character and undecodable
+// names still match them. A valid sequence can then also be taken byte by
+// byte, so such a set may match more than one character of a name.
+static int re_set_frag(ReParse *r, ReFrag *f) {
+    int have = 0;
+    for (size_t i = 0; i < r->nset; i++) {
+        uint32_t lo = r->set[i].lo, hi = r->set[i].hi;
+        if (lo <= 0xFFFD && hi >= 0xFFFD) {
+            ReFrag x;
+            if (!re_bytes(r, 0x80, 0xFF, &x) || (have && !re_alt2(r, &x, f))) return 0;
+            *f = x;
+            have = 1;
+        }
+        // surrogates never occur in UTF-8
+        if (lo < 0xD800 && hi >= 0xD800 && !re_cp_range(r, lo, 0xD7FF, f, &have)) return 0;
+        if (lo < 0xD800 && hi >= 0xD800) lo = 0xD800;
+        if (lo <= 0xDFFF && hi >= 0xD800) lo = 0xE000;
+        if (lo <= hi && !re_cp_range(r, lo, hi, f, &have)) return 0;
+    }
+    r->nset = 0;
+    if (!have) return re_bytes(r, 1, 0, f);     // empty set: never matches
+    return 1;
+}
+
+static uint32_t re_next_cp(ReParse *r) {
+    uint32_t c = (uint32_t)*r->p++;
+#if WCHAR_MAX <= 0xFFFF
+    if (c >= 0xD800 && c <= 0xDBFF && (uint32_t)*r->p >= 0xDC00 && (uint32_t)*r->p <= 0xDFFF) {
+        c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)*r->p++ - 0xDC00);
+    }
+#endif
+    return c;
+}
+
+static int re_char(ReParse *r, uint32_t cp, ReFrag *f) {
+#if WCHAR_MAX > 0xFFFF
+    if (cp >= 0xDC80 && cp <= 0xDCFF) return re_bytes(r, (uint8_t)cp, (uint8_t)cp, f); // undecodable byte
+#endif
+    return re_set_add(r, cp, cp) && re_set_finish(r, 0) && re_set_frag(r, f);
+}
+
+static int re_any(ReParse *r, ReFrag *f) {
+    return re_set_add(r, 0, 0x10FFFF) && re_set_frag(r, f);
+}
+
+// ---- required literal ----
+
+static void re_run_end(ReParse *r) {
+    if (r->nrun > r->nbest) {
+        memcpy(r->best, r->run, r->nrun * sizeof(wchar_t));
+        r->nbest = r->nrun;
+    }
+    r->nrun = 0;
+}
+
+static void re_run_add(ReParse *r, uint32_t cp) {
+#if WCHAR_MAX <= 0xFFFF
+    if (cp >= 0x10000) {
+        r->run[r->nrun++] = (wchar_t)(0xD800 + ((cp - 0x10000) >> 10));
+        r->run[r->nrun++] = (wchar_t)(0xDC00 + ((cp - 0x10000) & 0x3FF));
+        return;
+    }
+#endif
+    r->run[r->nrun++] = (wchar_t)cp;
+}
+
+// ---- regex parser ----
+
+static int re_alt(ReParse *r, ReFrag *f);
+
+// \d \w \s and their negations into the set; 0 if k is none of them
+static int re_class_escape(ReParse *r, wchar_t k) {
+    static const CpRange digit[] = { { '0', '9' } };
+    static const CpRange word[] = { { '0', '9' }, { 'A', 'Z' }, { '_', '_' }, { 'a', 'z' } };
+    static const CpRange space[] = { { '\t', '\r' }, { ' ', ' ' } };
+    const CpRange *s;
+    size_t n;
+    switch (k | 0x20) {
+    case 'd': s = digit; n = ARRAYSIZE(digit); break;
+    case 'w': s = word; n = ARRAYSIZE(word); break;
+    case 's': s = space; n = ARRAYSIZE(space); break;
+    default: return 0;
+    }
+    if (k & 0x20) {
+        for (size_t i = 0; i < n; i++) {
+            if (!re_set_add(r, s[i].lo, s[i].hi)) return -1;
+        }
+        return 1;
+    }
+    uint32_t next = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i].lo > next && !re_set_add(r, next, s[i].lo - 1)) return -1;
+        next = s[i].hi + 1;
+    }
+    return re_set_add(r, next, 0x10FFFF) ? 1 : -1;
+}
+
+// escaped character in a regex, after the backslash
+static int re_escape_cp(ReParse *r, uint32_t *cp) {
+    wchar_t k = *r->p;
+    if (!k) return re_fail(r, L"trailing \\");
+    r->p++;
+    if (k == 't') *cp = '\t';
+    else if (k == 'n') *cp = '\n';
+    else if (k == 'r') *cp = '\r';
+    else if ((k >= '0' && k <= '9') || (k >= 'A' && k <= 'Z') || (k >= 'a' && k <= 'z')) return re_fail(r, L"unknown escape");
+    else {
+        r->p--;
+        *cp = re_next_cp(r);
+    }
+    return 1;
+}
+
+// [...] with the cursor on '['
+static int re_class(ReParse *r, ReFrag *f) {
+    r->p++;
+    int negate = 0;
+    if (*r->p == '^' || (r->glob && *r->p == '!')) {
+        negate = 1;
+        r->p++;
+    }
+    int first = 1;
+    while (*r->p != ']' || first) {
+        if (!*r->p) return re_fail(r, L"missing ]");
+        first = 0;
+        uint32_t lo;
+        if (*r->p == '\\') {
+            r->p++;
+            if (!r->glob) {
+                int k = re_class_escape(r, *r->p);
+                if (k < 0) return 0;
+                if (k) {
+                    r->p++;
+                    continue;
+                }
+            }
+            if (r->glob) {
+                if (!*r->p) return re_fail(r, L"trailing \\");
+                lo = re_next_cp(r);
+            } else if (!re_escape_cp(r, &lo)) {
+                return 0;
+            }
+        } else {
+            lo = re_next_cp(r);
+        }
+        uint32_t hi = lo;
+        if (r->p[0] == '-' && r->p[1] && r->p[1] != ']') {
+            r->p++;
+            if (*r->p == '\\') {
+                r->p++;
+                if (r->glob) {
+                    if (!*r->p) return re_fail(r, L"trailing \\");
+                    hi = re_next_cp(r);
+                } else if (!re_escape_cp(r, &hi)) {
+                    return 0;
+                }
+            } else {
+                hi = re_next_cp(r);
+            }
+            if (hi < lo) return re_fail(r, L"bad range");
+        }
+        if (!re_set_add(r, lo, hi)) return 0;
+    }
+    r->p++;
+    if (negate && r->path && !re_set_add(r, '/', '/')) return 0;
+    return re_set_finish(r, negate) && re_set_frag(r, f);
+}
+
+// one atom; *lit is its character if it is a plain one, else -1
+static int re_atom(ReParse *r, ReFrag *f, long *lit) {
+    *lit = -1;
+    wchar_t c = *r->p;
+    if (c == '(') {
+        r->p++;
+        r->depth++;
+        if (!re_alt(r, f)) return 0;
+        if (*r->p != ')') return re_fail(r, L"missing )");
+        r->p++;
+        r->depth--;
+        return 1;
+    }
+    if (c == '[') return re_class(r, f);
+    if (c == '.') {
+        r->p++;
+        return re_any(r, f);
+    }
+    if (c == '^' || c == '$') {
+        r->p++;
+        return re_single(r, c == '^' ? RE_BEGIN : RE_END, f);
+    }
+    if (c == '*' || c == '+' || c == '?') return re_fail(r, L"nothing to repeat");
+    uint32_t cp;
+    if (c == '\\') {
+        r->p++;
+        int k = re_class_escape(r, *r->p);
+        if (k < 0) return 0;
+        if (k) {
+            r->p++;
+            return re_set_finish(r, 0) && re_set_frag(r, f);
+        }
+        if (!re_escape_cp(r, &cp)) return 0;
+    } else {
+        cp = re_next_cp(r);
+    }
+    *lit = (long)cp;
+    return re_char(r, cp, f);
+}
+
+// {m}, {m,} or {m,n} at the cursor; anything else is a literal '{'
+static int re_counts(ReParse *r, int *m, int *n) {
+    const wchar_t *p = r->p + 1;
+    if (*p < '0' || *p > '9') return 0;
+    long a = 0, b;
+    while (*p >= '0' && *p <= '9') if ((a = a * 10 + (*p++ - '0')) > RE_MAX_REPEAT) return -1;
+    b = a;
+    if (*p == ',') {
+        p++;
+        b = -1;
+        if (*p >= '0' && *p <= '9') {
+            b = 0;
+            while (*p >= '0' && *p <= '9') if ((b = b * 10 + (*p++ - '0')) > RE_MAX_REPEAT) return -1;
+            if (b < a) return -1;
+        }
+    }
+    if (*p != '}') return 0;
+    r->p = p + 1;
+    *m = (int)a;
+    *n = (int)b;
+    return 1;
+}
+
+// a{m,n}: the atom at 'at' is parsed again for every copy
+static int re_repeat(ReParse *r, const wchar_t *at, int m, int n, ReFrag *f) {
+    const wchar_t *after = r->p;
+    int have = 0, copies = n < 0 ? (m ? m : 1) : (n ? n : 1);
+    ReFrag x;
+    long lit;
+    for (int i = 0; i < copies; i++) {
+        r->p = at;
+        if (!re_atom(r, &x, &lit)) return 0;
+        if (i >= m && n >= 0 && !re_quest(r, &x)) return 0;
+        if (n < 0 && i == copies - 1 && !(m ? re_plus(r, &x) : re_star(r, &x))) return 0;
+        if (!have) *f = x;
+        else re_cat(r, f, &x);
+        have = 1;
+    }
+    r->p = after;
+    if (!n) return re_single(r, RE_EMPTY, f);  // {0}: matches the empty string
+    return 1;
+}
+
+static int re_concat(ReParse *r, ReFrag *f) {
+    int have = 0;
+    while (*r->p && *r->p != '|' && *r->p != ')') {
+        ReFrag x;
+        long lit;
+        const wchar_t *at = r->p;
+        int quant = 0, min = 1;
+        if (at[0] == '.' && (at[1] == '*' || at[1] == '+')) {
+            // any run of characters is any run of bytes, which is one node
+            r->p += 2;
+            if (!re_bytes(r, 0, 255, &x) || !(at[1] == '*' ? re_star(r, &x) : re_plus(r, &x))) return 0;
+            lit = -1;
+            quant = 1;
+        } else if (!re_atom(r, &x, &lit)) {
+            return 0;
+        }
+        for (;;) {
+            wchar_t q = *r->p;
+            int m, n, k;
+            if (q == '*' || q == '+' || q == '?') {
+                r->p++;
+                if (!(q == '*' ? re_star(r, &x) : q == '+' ? re_plus(r, &x) : re_quest(r, &x))) return 0;
+                if (q != '+') min = 0;
+            } else if (q == '{' && (k = re_counts(r, &m, &n)) != 0) {
+                if (k < 0) return re_fail(r, L"bad repeat count");
+                if (quant) return re_fail(r, L"repeat of a repeat");
+                if (!re_repeat(r, at, m, n, &x)) return 0;
+                if (!m) min = 0;
+            } else {
+                break;
+            }
+            quant = 1;
+        }
+        if (!r->depth && (lit < 0 || quant)) r->special++;
+        if (!r->depth && r->nodes[x.start].op != RE_BEGIN && r->nodes[x.start].op != RE_END) {
+            if (lit >= 0 && min) re_run_add(r, (uint32_t)lit);
+            if (lit < 0 || quant) re_run_end(r);
+        }
+        if (!have) *f = x;
+        else re_cat(r, f, &x);
+        have = 1;
+    }
+    if (!r->depth) re_run_end(r);
+    return have || re_single(r, RE_EMPTY, f);
+}
+
+static int re_alt(ReParse *r, ReFrag *f) {
+    if (!re_concat(r, f)) return 0;
+    while (*r->p == '|') {
+        r->p++;
+        if (!r->depth) r->alt_top = 1;
+        ReFrag b;
+        if (!re_concat(r, &b) || !re_alt2(r, f, &b)) return 0;
+    }
+    return 1;
+}
+
+// ---- glob parser ----
+
+// any byte but '/' (UTF-8 never has one inside a character)
+static int re_not_slash(ReParse *r, ReFrag *f) {
+    ReFrag b;
+    return re_bytes(r, 0, '/' - 1, f) && re_bytes(r, '/' + 1, 255, &b) && re_alt2(r, f, &b);
+}
+
+static int re_glob(ReParse *r, ReFrag *f) {
+    if (!re_single(r, RE_BEGIN, f)) return 0;
+    while (*r->p) {
+        ReFrag x;
+        wchar_t c = *r->p;
+        if (c == '*' && r->path && r->p[1] == '*' && (r->p == r->s || r->p[-1] == '/') &&
+            (!r->p[2] || r->p[2] == '/')) {
+            // a whole "**": "**/" is any directories, a last "**" everything below
+            r->p += 2;
+            if (!re_bytes(r, 0, 255, &x) || !re_star(r, &x)) return 0;
+            if (*r->p == '/') {
+                ReFrag sep;
+                r->p++;
+                if (!re_bytes(r, '/', '/', &sep)) return 0;
+                re_cat(r, &x, &sep);
+                if (!re_quest(r, &x)) return 0;
+            }
+            re_run_end(r);
+            r->special++;
+        } else if (c == '*') {
+            int first = r->p == r->s;
+            while (*r->p == '*') r->p++;
+            if (!(r->path ? re_not_slash(r, &x) : re_bytes(r, 0, 255, &x)) || !re_star(r, &x)) return 0;
+            re_run_end(r);
+            r->star_ends += first + !*r->p;
+            if (!first && *r->p) r->special++;
+        } else if (c == '?') {
+            r->p++;
+            if (r->path ? !re_set_add(r, 0, '/' - 1) || !re_set_add(r, '/' + 1, 0x10FFFF) || !re_set_frag(r, &x)
+                        : !re_any(r, &x)) return 0;
+            re_run_end(r);
+            r->special++;
+        } else if (c == '[') {
+            if (!re_class(r, &x)) return 0;
+            re_run_end(r);
+            r->special++;
+        } else {
+            if (c == '\\') {
+                r->p++;
+                if (!*r->p) return re_fail(r, L"trailing \\");
+            }
+            uint32_t cp = re_next_cp(r);
+            if (!re_char(r, cp, &x)) return 0;
+            re_run_add(r, cp);
+        }
+        re_cat(r, f, &x);
+    }
+    re_run_end(r);
+    ReFrag e;
+    if (!re_single(r, RE_END, &e)) return 0;
+    re_cat(r, f, &e);
+    return 1;
+}
+
+// ---- DFA ----
+
+typedef struct {
+    uint32_t *ids;          // the sets, back to back
+    size_t nids, ids_cap;
+    size_t *off;            // state -> first id; off[nstates] ends the last
+    size_t off_cap;
+    uint32_t *table;        // open addressing, state + 1
+    uint32_t table_cap;
+    uint32_t *mark, gen;    // per NFA node
+    uint32_t *stack;
+    uint8_t *final;         // per state: PAT_ACCEPT, PAT_DEAD or 0
+} ReSets;
+
+static uint32_t re_hash(const uint32_t *s, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) h = (h ^ s[i]) * 16777619u;
+    return h;
+}
+
+// Epsilon closure of the nodes on the stack, keeping the ones that consume
+// a symbol or accept, sorted, appended to the pool as a tentative new set.
+// A set that accepts is reduced to the match node alone.
+static size_t re_closure(const ReParse *r, ReSets *z, size_t sp, uint32_t match) {
+    size_t base = z->nids, n = 0;
+    while (sp) {
+        uint32_t x = z->stack[--sp];
+        if (z->mark[x] == z->gen) continue;
+        z->mark[x] = z->gen;
+        const ReNode *e = &r->nodes[x];
+        if (e->op == RE_SPLIT) {
+            z->stack[sp++] = e->out1;
+            z->stack[sp++] = e->out;
+        } else if (e->op == RE_EMPTY) {
+            z->stack[sp++] = e->out;
+        } else {
+            z->ids[base + n++] = x;
+        }
+    }
+    if (++z->gen == 0) {
+        memset(z->mark, 0, r->nnodes * sizeof(uint32_t));
+        z->gen = 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (z->ids[base + i] == match) {
+            z->ids[base] = match;
+            return 1;
+        }
+    }
+    uint32_t *s = z->ids + base;
+    for (size_t i = 1; i < n; i++) {
+        uint32_t v = s[i], j = (uint32_t)i;
+        for (; j > 0 && s[j - 1] > v; j--) s[j] = s[j - 1];
+        s[j] = v;
+    }
+    return n;
+}
+
+// state for the n ids just closed at the end of the pool, adding it if new
+static uint32_t re_state(Pattern *p, ReSets *z, size_t n, uint32_t match) {
+    const uint32_t *s = z->ids + z->nids;
+    uint32_t h = re_hash(s, n) & (z->table_cap - 1);
+    for (;; h = (h + 1) & (z->table_cap - 1)) {
+        uint32_t t = z->table[h];
+        if (!t) break;
+        size_t a = z->off[t - 1], len = z->off[t] - a;
+        if (len == n && !memcmp(z->ids + a, s, n * sizeof(uint32_t))) return t - 1;
+    }
+    if (p->nstates >= RE_MAX_STATES) {
+        p->error = L"pattern needs too many DFA states";
+        return UINT32_MAX;
+    }
+    size_t row = (size_t)p->nstates * p->nsym, cap = z->off_cap;
+    if (!grow_array((void**)&z->off, &z->off_cap, p->nstates + 2, sizeof(size_t))) return UINT32_MAX;
+    if (!p->next || z->off_cap != cap) {
+        uint32_t *nx = (uint32_t*)realloc(p->next, z->off_cap * p->nsym * sizeof(uint32_t));
+        if (nx) p->next = nx;
+        uint8_t *fin = (uint8_t*)realloc(z->final, z->off_cap);
+        if (fin) z->final = fin;
+        if (!nx || !fin) return UINT32_MAX;
+    }
+    memset(p->next + row, 0, p->nsym * sizeof(uint32_t));
+    z->final[p->nstates] = !n ? PAT_DEAD : s[0] == match ? PAT_ACCEPT : 0;
+    z->table[h] = p->nstates + 1;
+    z->nids += n;
+    z->off[p->nstates + 1] = z->nids;
+    return p->nstates++;
+}
+
+static int re_prune(Pattern *p, const uint8_t *final, uint32_t begin) {
+    size_t nst = p->nstates, nsym = p->nsym;
+    uint32_t *off = (uint32_t*)calloc(nst + 1, sizeof(uint32_t));
+    uint32_t *from = (uint32_t*)malloc(nst * nsym * sizeof(uint32_t));
+    uint32_t *queue = (uint32_t*)malloc(nst * sizeof(uint32_t));
+    uint8_t *live = (uint8_t*)calloc(nst, 1);
+    int ok = off && from && queue && live;
+    if (ok) {
+        // edges reversed, bucketed by target
+        for (size_t s = 0; s < nst; s++) {
+            for (size_t c = 0; c < nsym; c++) if (c != begin) off[p->next[s * nsym + c] + 1]++;
+        }
+        for (size_t s = 0; s < nst; s++) off[s + 1] += off[s];
+        for (size_t s = 0; s < nst; s++) {
+            for (size_t c = 0; c < nsym; c++) if (c != begin) from[off[p->next[s * nsym + c]]++] = (uint32_t)s;
+        }
+        for (size_t s = nst; s > 0; s--) off[s] = off[s - 1];
+        off[0] = 0;
+
+        size_t head = 0, tail = 0;
+        for (size_t s = 0; s < nst; s++) {
+            if (final[s] == PAT_ACCEPT) {
+                live[s] = 1;
+                queue[tail++] = (uint32_t)s;
+            }
+        }
+        while (head < tail) {
+            uint32_t t = queue[head++];
+            for (uint32_t i = off[t]; i < off[t + 1]; i++) {
+                if (!live[from[i]]) {
+                    live[from[i]] = 1;
+                    queue[tail++] = from[i];
+                }
+            }
+        }
+        for (size_t i = 0; i < nst * nsym; i++) {
+            if (!live[p->next[i]]) p->next[i] = 0;
+        }
+    }
+    free(off);
+    free(from);
+    free(queue);
+    free(live);
+    return ok;
+}
+
+static int re_build_dfa(Pattern *p, const ReParse *r, uint32_t start, uint32_t match) {
+    uint8_t cut[257] = {0};
+    for (size_t i = 0; i < r->nnodes; i++) {
+        if (r->nodes[i].op != RE_BYTES || r->nodes[i].lo > r->nodes[i].hi) continue;
+        cut[r->nodes[i].lo] = 1;
+        cut[r->nodes[i].hi + 1] = 1;
+    }
+    uint8_t rep[256];
+    uint32_t nb = 0;
+    for (int b = 0; b < 256; b++) {
+        if (b && cut[b]) nb++;
+        p->cls[b] = (uint8_t)nb;
+        if (!b || cut[b]) rep[nb] = (uint8_t)b;
+    }
+    nb++;
+    p->nsym = nb + 2;
+
+    ReSets z;
+    memset(&z, 0, sizeof(z));
+    z.table_cap = RE_MAX_STATES * 2;
+    z.table = (uint32_t*)calloc(z.table_cap, sizeof(uint32_t));
+    z.mark = (uint32_t*)calloc(r->nnodes, sizeof(uint32_t));
+    z.stack = (uint32_t*)malloc(r->nnodes * 3 * sizeof(uint32_t));
+    z.gen = 1;
+    int ok = 0;
+    if (!z.table || !z.mark || !z.stack) goto done;
+
+    // state 0: dead, state 1: before the start symbol
+    if (!grow_array((void**)&z.ids, &z.ids_cap, z.nids + r->nnodes, sizeof(uint32_t)) ||
+        !grow_array((void**)&z.off, &z.off_cap, 1, sizeof(size_t))) goto done;
+    z.off[0] = 0;
+    if (re_state(p, &z, 0, match) != 0) goto done;
+    z.stack[0] = start;
+    if (re_state(p, &z, re_closure(r, &z, 1, match), match) != 1) goto done;
+
+    for (uint32_t s = 1; s < p->nstates; s++) {
+        uint32_t *row = p->next + (size_t)s * p->nsym;
+        if (z.final[s] == PAT_ACCEPT) {
+            for (uint32_t c = 0; c < p->nsym; c++) row[c] = s;
+            continue;
+        }
+        for (uint32_t c = 0; c < p->nsym; c++) {
+            size_t sp = 0;
+            for (size_t i = z.off[s]; i < z.off[s + 1]; i++) {
+                const ReNode *e = &r->nodes[z.ids[i]];
+                int step = e->op == RE_BYTES ? c < nb && rep[c] >= e->lo && rep[c] <= e->hi
+                         : e->op == RE_BEGIN ? c == nb
+                         : e->op == RE_END ? c == nb + 1 : 0;
+                if (step) z.stack[sp++] = e->out;
+            }
+            if (!grow_array((void**)&z.ids, &z.ids_cap, z.nids + r->nnodes, sizeof(uint32_t))) goto done;
+            uint32_t t = re_state(p, &z, sp ? re_closure(r, &z, sp, match) : 0, match);
+            if (t == UINT32_MAX) goto done;
+            p->next[(size_t)s * p->nsym + c] = t;
+        }
+    }
+
+    // States that cannot reach the accepting one go to the dead state, so a
+    // scan stops as soon as nothing can match (the unanchored prefix loop of
+    // a pattern starting with ^ stays alive without this). The start symbol
+    // never comes again, so its column is left out.
+    if (!re_prune(p, z.final, nb)) goto done;
+    uint32_t first = p->next[p->nsym + nb];
+    p->fails_fast = first == 0;
+    for (uint32_t c = 0; c < nb; c++) {
+        if (p->next[(size_t)first * p->nsym + c] == 0) p->fails_fast = 1;
+    }
+
+    // Renumber so the absorbing states come first, dead then accept, and
+    // store row offsets: a step is one add and one load, and "final" is one
+    // compare against stop.
+    uint32_t *perm = (uint32_t*)malloc(p->nstates * sizeof(uint32_t));
+    uint32_t *nx = (uint32_t*)malloc((size_t)p->nstates * p->nsym * sizeof(uint32_t));
+    if (!perm || !nx) {
+        free(perm);
+        free(nx);
+        goto done;
+    }
+    uint32_t k = 1;
+    perm[0] = 0;
+    p->accept = PAT_NONE;
+    for (uint32_t s = 1; s < p->nstates; s++) {
+        if (z.final[s] != PAT_ACCEPT) continue;
+        perm[s] = k++;
+        p->accept = p->nsym;
+    }
+    for (uint32_t s = 1; s < p->nstates; s++) {
+        if (z.final[s] != PAT_ACCEPT) perm[s] = k++;
+    }
+    for (uint32_t s = 0; s < p->nstates; s++) {
+        for (uint32_t c = 0; c < p->nsym; c++) {
+            nx[(size_t)perm[s] * p->nsym + c] = perm[p->next[(size_t)s * p->nsym + c]] * p->nsym;
+        }
+    }
+    p->start = nx[(size_t)perm[1] * p->nsym + nb];
+    p->stop = p->accept == PAT_NONE ? p->nsym : 2 * p->nsym;
+    free(p->next);
+    p->next = nx;
+    free(perm);
+    ok = 1;
+
+done:
+    free(z.final);
+    free(z.ids);
+    free(z.off);
+    free(z.table);
+    free(z.mark);
+    free(z.stack);
+    return ok;
+}
+
+static void pat_free(Pattern *p) {
+    free(p->next);
+    free(p->literal);
+    memset(p, 0, sizeof(*p));
+}
+
+// 0 on failure: p->error says why, or is NULL when out of memory
+static int pat_init(Pattern *p, const wchar_t *src, int glob) {
+    memset(p, 0, sizeof(*p));
+    ReParse r;
+    memset(&r, 0, sizeof(r));
+    r.s = r.p = src;
+    r.glob = glob;
+    size_t len = wcslen(src);
+    r.run = (wchar_t*)malloc((len + 1) * sizeof(wchar_t));
+    r.best = (wchar_t*)malloc((len + 1) * sizeof(wchar_t));
+    ReFrag f;
+    uint32_t match = 0, start = 0;
+    re_node(&r, RE_EMPTY, 0, 0);    // node 0: 0 is never a target, so it can end lists
+    int ok = r.run && r.best && r.nnodes == 1;
+    ok = ok && (glob ? re_glob(&r, &f) : re_alt(&r, &f));
+    if (ok && *r.p) ok = re_fail(&r, L"unmatched )");
+    if (ok) match = re_node(&r, RE_MATCH, 0, 0);
+    if (ok && match) {
+        re_patch(&r, f.outs, match);
+        start = f.start;
+        if (!glob) {
+            // unanchored: skip any prefix, including the start symbol
+            uint32_t loop = re_node(&r, RE_SPLIT, f.start, 0);
+            uint32_t any = re_node(&r, RE_BYTES, loop, 0);
+            uint32_t begin = re_node(&r, RE_BEGIN, loop, 0);
+            uint32_t skip = re_node(&r, RE_SPLIT, any, begin);
+            if (loop && any && begin && skip) {
+                r.nodes[any].hi = 255;
+                r.nodes[loop].out1 = skip;
+                start = loop;
+            }
+        }
+    }
+    ok = ok && !r.oom && !r.error && start && re_build_dfa(p, &r, start, match);
+    p->exact = ok && !r.alt_top && !r.special && (!glob || r.star_ends == 2);
+    if (ok && r.nbest && !r.alt_top) {
+        p->literal = (wchar_t*)malloc((r.nbest + 1) * sizeof(wchar_t));
+        if (p->literal) {
+            memcpy(p->literal, r.best, r.nbest * sizeof(wchar_t));
+            p->literal[r.nbest] = 0;
+        }
+        ok = p->literal != NULL;
+    }
+    if (!ok) {
+        const wchar_t *err = r.oom ? NULL : r.error ? r.error : p->error;
+        pat_free(p);
+        p->error = err;
+        p->error_at = (size_t)(r.p - r.s);
+    }
+    free(r.nodes);
+    free(r.set);
+    free(r.run);
+    free(r.best);
+    return ok;
+}
+
+// Several globs as one DFA that accepts a name matching any of them; path
+// and exact_case as in ReParse. On failure *bad is the glob at fault, or n
+// when the DFA as a whole is too large; p->error and error_at are as for
+// pat_init.
+static int pat_init_set(Pattern *p, const wchar_t *const *srcs, size_t n, int path, int exact_case,
+                        size_t *bad) {
+    memset(p, 0, sizeof(*p));
+    ReParse r;
+    memset(&r, 0, sizeof(r));
+    r.glob = 1;
+    r.path = path;
+    r.exact_case = exact_case;
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t k = wcslen(srcs[i]);
+        if (k > len) len = k;
+    }
+    r.run = (wchar_t*)malloc((len + 1) * sizeof(wchar_t));
+    r.best = (wchar_t*)malloc((len + 1) * sizeof(wchar_t));
+    ReFrag all, f;
+    uint32_t match = 0;
+    re_node(&r, RE_EMPTY, 0, 0);
+    int ok = n && r.run && r.best && r.nnodes == 1;
+    for (size_t i = 0; ok && i < n; i++) {
+        *bad = i;
+        r.s = r.p = srcs[i];
+        ok = re_glob(&r, i ? &f : &all) && (!i || re_alt2(&r, &all, &f));
+    }
+    if (ok) match = re_node(&r, RE_MATCH, 0, 0);
+    if (ok && match) {
+        re_patch(&r, all.outs, match);
+        *bad = n;
+    }
+    ok = ok && match && !r.oom && !r.error && re_build_dfa(p, &r, all.start, match);
+    if (!ok) {
+        const wchar_t *err = r.oom ? NULL : r.error ? r.error : p->error;
+        pat_free(p);
+        p->error = err;
+        p->error_at = r.s ? (size_t)(r.p - r.s) : 0;
+    }
+    free(r.nodes);
+    free(r.set);
+    free(r.run);
+    free(r.best);
+    return ok;
+}
+
+#define PAT_STEP(p, s, b) ((s) = (p)->next[(s) + (p)->cls[(uint8_t)(b)]])
+
+static int pat_end(const Pattern *p, uint32_t s) {
+    if (s >= p->stop) s = p->next[s + p->nsym - 1];
+    return s == p->accept;
+}
+
+#ifdef _WIN32
+static int pat_match(const Pattern *p, const wchar_t *s, size_t n) {
+    uint32_t st = p->start;
+    for (size_t i = 0; i < n && st >= p->stop; i++) {
+        if ((uint32_t)s[i] < 0x80) {
+            PAT_STEP(p, st, s[i]);
+            continue;
+        }
+        size_t k = 1;
+#if WCHAR_BITS == 16
+        if (s[i] >= 0xD800 && s[i] <= 0xDBFF && i + 1 < n) k = 2;
+#endif
+        char u[8] = {0};
+        size_t m = utf8_encode(u, s + i, k);
+        for (size_t j = 0; j < m; j++) PAT_STEP(p, st, u[j]);
+        i += k - 1;
+    }
+    return pat_end(p, st);
+}
+#endif
+
+static int pat_match8(const Pattern *p, const char *s, size_t n) {
+    uint32_t st = p->start;
+    for (size_t i = 0; i < n && st >= p->stop; i++) PAT_STEP(p, st, s[i]);
+    return pat_end(p, st);
+}
+
+// ---- pattern sets (--exclude-dir, ignore files) ----
+//
+// The union of many globs, matched in one pass per name. Plain
+// names and prefix/suffix globs share one DFA however many there are;
+// several *x* globs can multiply its states, so a set that does not fit is
+// split in halves until each part does.
+
+typedef struct {
+    Pattern *pats;
+    size_t n, cap;
+    const wchar_t *error;   // as Pattern's, for srcs[bad]
+    size_t error_at, bad;
+} PatSet;
+
+static void pat_set_free(PatSet *g) {
+    for (size_t i = 0; i < g->n; i++) pat_free(&g->pats[i]);
+    free(g->pats);
+    memset(g, 0, sizeof(*g));
+}
+
+static int pat_set_add(PatSet *g, const wchar_t *const *srcs, size_t lo, size_t hi, int path, int exact_case) {
+    Pattern p;
+    size_t bad = 0;
+    if (pat_init_set(&p, srcs + lo, hi - lo, path, exact_case, &bad)) {
+        if (!grow_array((void**)&g->pats, &g->cap, g->n + 1, sizeof(Pattern))) {
+            pat_free(&p);
+            return 0;
+        }
+        g->pats[g->n++] = p;
+        return 1;
+    }
+    if (p.error && bad == hi - lo && bad > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        return pat_set_add(g, srcs, lo, mid, path, exact_case) && pat_set_add(g, srcs, mid, hi, path, exact_case);
+    }
+    g->error = p.error;
+    g->error_at = p.error_at;
+    g->bad = lo + (bad < hi - lo ? bad : 0);
+    return 0;
+}
+
+// 0 on failure: g->error says why, or is NULL when out of memory
+static int pat_set_init(PatSet *g, const wchar_t *const *srcs, size_t n, int path, int exact_case) {
+    memset(g, 0, sizeof(*g));
+    if (pat_set_add(g, srcs, 0, n, path, exact_case)) return 1;
+    const wchar_t *err = g->error;
+    size_t at = g->error_at, bad = g->bad;
+    pat_set_free(g);
+    g->error = err;
+    g->error_at = at;
+    g->bad = bad;
+    return 0;
+}
+
+#ifdef _WIN32
+static int pat_set_match(const PatSet *g, const wchar_t *s, size_t n) {
+    for (size_t i = 0; i < g->n; i++) {
+        if (pat_match(&g->pats[i], s, n)) return 1;
+    }
+    return 0;
+}
+#endif
+
+static int pat_set_match8(const PatSet *g, const char *s, size_t n) {
+    for (size_t i = 0; i < g->n; i++) {
+        if (pat_match8(&g->pats[i], s, n)) return 1;
+    }
+    return 0;
+}
+
+// ---- ignore files (--respect-ignore) ----
+//
+// A directory's .gitignore and .ignore (later, so it wins) compile once into
+// an Ignore, which its subdirectories' Nodes share by reference along with
+// the Ignores above it. The syntax is git's: "*" and "?" stop at '/', a rule
+// with no '/' matches the name at any depth, others the path below the
+// file's directory, a trailing '/' only matches directories, "**" spans
+// them. Consecutive rules alike in "!" and trailing '/' form a group; the
+// last group that matches decides, innermost file first, as in git.
+//
+// Most rules are plain names, paths or "*.ext": those are compared as
+// strings, and only the rest compile to a DFA (one for names, one for paths)
+// so that a directory with a .gitignore costs little more than reading it.
+// Matching is case-sensitive except on Windows.
+
+#define IGNORE_FILE_MAX (1 << 20)
+
+enum { IGN_NAME, IGN_PATH, IGN_SUFFIX };
+
+typedef struct {
+    char *s;                // UTF-8
+    size_t len;
+    int kind;               // IGN_*
+} IgnoreLit;
+
+typedef struct {
+    IgnoreLit *lits;
+    size_t nlits;
+    PatSet name, path;      // the other rules, on the name or the path
+    int negate, dir_only;
+} IgnoreGroup;
+
+typedef struct Ignore {
+    struct Ignore *up;      // the enclosing directories' rules (referenced)
+    volatile LONG refs;     // one per Node and Ignore holding it, one per lister
+    size_t base;            // bytes of the directory's path below the root, with its '/'
+    IgnoreGroup *groups;
+    size_t ngroups;
+} Ignore;
+
+static Ignore* ignore_retain(Ignore *ig) {
+    if (ig) InterlockedIncrement(&ig->refs);
+    return ig;
+}
+
+static void ignore_group_free(IgnoreGroup *g) {
+    for (size_t i = 0; i < g->nlits; i++) free(g->lits[i].s);
+    free(g->lits);
+    pat_set_free(&g->name);
+    pat_set_free(&g->path);
+}
+
+static void ignore_release(Ignore *ig) {
+    while (ig && InterlockedDecrement(&ig->refs) == 0) {
+        Ignore *up = ig->up;
+        for (size_t i = 0; i < ig->ngroups; i++) ignore_group_free(&ig->groups[i]);
+        free(ig->groups);
+        free(ig);
+        ig = up;
+    }
+}
+
+static int ignore_eq(const char *a, const char *b, size_t n) {
+#ifdef _WIN32
+    for (size_t i = 0; i < n; i++) {
+        if (FOLD_ASCII((uint8_t)a[i]) != FOLD_ASCII((uint8_t)b[i])) return 0;
+    }
+    return 1;
+#else
+    return memcmp(a, b, n) == 0;
+#endif
+}
+
+static int ignore_group_match(const IgnoreGroup *g, const char *path, size_t plen, const char *name, size_t nlen) {
+    for (size_t i = 0; i < g->nlits; i++) {
+        const IgnoreLit *l = &g->lits[i];
+        if (l->kind == IGN_NAME ? l->len == nlen && ignore_eq(l->s, name, nlen)
+            : l->kind == IGN_SUFFIX ? l->len <= nlen && ignore_eq(l->s, name + nlen - l->len, l->len)
+            : l->len == plen && ignore_eq(l->s, path, plen)) return 1;
+    }
+    return pat_set_match8(&g->name, name, nlen) || pat_set_match8(&g->path, path, plen);
+}
+
+// One line of an ignore file, cut down to its glob (in place); 0 for blank
+// lines and comments.
+static size_t ignore_rule(wchar_t *s, size_t n, int *negate, int *dir_only, int *anchored) {
+    while (n && s[n - 1] == ' ' && !(n >= 2 && s[n - 2] == '\\')) n--;
+    if (!n || s[0] == '#') return 0;
+    size_t from = 0;
+    *negate = s[0] == '!';
+    from += *negate;
+    *dir_only = n > from && s[n - 1] == '/';
+    n -= *dir_only;
+    *anchored = 0;
+    for (size_t i = from; i < n; i++) *anchored |= s[i] == '/';
+    if (n > from && s[from] == '/') from++;
+    if (n <= from) return 0;
+    memmove(s, s + from, (n - from) * sizeof(wchar_t));
+    s[n - from] = 0;
+    return n - from;
+}
+
+// Files a rule under the group's literals, or returns 0 if it needs the DFA
+static int ignore_lit(IgnoreGroup *g, size_t *cap, const wchar_t *s, size_t n, int anchored) {
+    int suffix = !anchored && s[0] == '*';
+    for (size_t i = suffix; i < n; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') return 0;
+    }
+    if (n == (size_t)suffix || !grow_array((void**)&g->lits, cap, g->nlits + 1, sizeof(IgnoreLit))) return 0;
+    IgnoreLit *l = &g->lits[g->nlits];
+    l->s = (char*)malloc(n * 4 + 1);
+    if (!l->s) return 0;
+    l->len = utf8_encode(l->s, s + suffix, n - suffix);
+    l->kind = anchored ? IGN_PATH : suffix ? IGN_SUFFIX : IGN_NAME;
+    g->nlits++;
+    return 1;
+}
+
+// The DFA half of a group. A rule that does not compile is left out, as
+// git would never match it either. 0 when out of memory.
+static int ignore_pats(PatSet *set, wchar_t **srcs, size_t n) {
+#ifdef _WIN32
+    const int exact_case = 0;
+#else
+    const int exact_case = 1;
+#endif
+    int ok = 1;
+    while (n && !pat_set_init(set, (const wchar_t *const*)srcs, n, 1, exact_case)) {
+        if (!set->error) {
+            ok = 0;
+            break;
+        }
+        size_t bad = set->bad;
+        free(srcs[bad]);
+        memmove(srcs + bad, srcs + bad + 1, (n - bad - 1) * sizeof(*srcs));
+        n--;
+    }
+    for (size_t i = 0; i < n; i++) free(srcs[i]);
+    return ok;
+}
+
+// A run of alike rules as one group. srcs[0..nsrcs) are the globs, anchored
+// ones flagged by a leading '/' kept for the purpose; all are freed.
+static int ignore_flush(Ignore *ig, size_t *cap, wchar_t **srcs, size_t *nsrcs, int flags) {
+    IgnoreGroup g;
+    memset(&g, 0, sizeof(g));
+    g.negate = flags >> 1;
+    g.dir_only = flags & 1;
+    size_t lits_cap = 0, nname = 0, npath = 0;
+    wchar_t **name = (wchar_t**)malloc(*nsrcs * sizeof(wchar_t*));
+    wchar_t **path = (wchar_t**)malloc(*nsrcs * sizeof(wchar_t*));
+    int ok = name && path;
+    for (size_t i = 0; i < *nsrcs; i++) {
+        int anchored = srcs[i][0] == '/';
+        if (ok && ignore_lit(&g, &lits_cap, srcs[i] + anchored, wcslen(srcs[i] + anchored), anchored)) {
+            free(srcs[i]);
+        } else if (ok) {
+            if (anchored) memmove(srcs[i], srcs[i] + 1, wcslen(srcs[i]) * sizeof(wchar_t));
+            if (anchored) path[npath++] = srcs[i];
+            else name[nname++] = srcs[i];
+        } else {
+            free(srcs[i]);
+        }
+    }
+    *nsrcs = 0;
+    // both are called so that both free their globs
+    ok = ignore_pats(&g.name, name, nname) && ok;
+    ok = ignore_pats(&g.path, path, npath) && ok;
+    free(name);
+    free(path);
+    if (ok && (g.nlits || g.name.n || g.path.n)) {
+        ok = grow_array((void**)&ig->groups, cap, ig->ngroups + 1, sizeof(IgnoreGroup));
+        if (ok) {
+            ig->groups[ig->ngroups++] = g;
+            return 1;
+        }
+    }
+    ignore_group_free(&g);
+    return ok;
+}
+
+// The rules in text (one directory's ignore files, back to back) below up;
+// NULL if there are none, or out of memory.
+static Ignore* ignore_new(Ignore *up, char *text, size_t len, size_t base) {
+    Ignore *ig = (Ignore*)calloc(1, sizeof(Ignore));
+    wchar_t *line = (wchar_t*)malloc((len + 2) * sizeof(wchar_t));
+    wchar_t **srcs = NULL;
+    size_t nsrcs = 0, srcs_cap = 0, groups_cap = 0;
+    int flags = 0, ok = ig && line;
+
+    text[len] = 0;
+    for (char *p = text; ok && *p; ) {
+        char *eol = strchr(p, '\n');
+        char *next = eol ? eol + 1 : p + strlen(p);
+        if (eol) *eol = 0;
+        size_t k = strlen(p);
+        if (k && p[k - 1] == '\r') p[--k] = 0;
+        if (k >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3;
+        int negate = 0, dir_only = 0, anchored = 0;
+        // line + 1: room for the '/' that marks an anchored rule
+        size_t n = utf8_to_wide(line + 1, len + 1, p);
+        p = next;
+        if (!n || !(n = ignore_rule(line + 1, n, &negate, &dir_only, &anchored))) continue;
+        int f = negate * 2 + dir_only;
+        if (nsrcs && f != flags) ok = ignore_flush(ig, &groups_cap, srcs, &nsrcs, flags);
+        flags = f;
+        line[0] = '/';
+        if (ok && grow_array((void**)&srcs, &srcs_cap, nsrcs + 1, sizeof(*srcs)) &&
+            (srcs[nsrcs] = wcsdup_heap(line + !anchored)) != NULL) {
+            nsrcs++;
+        } else {
+            ok = 0;
+        }
+    }
+    if (ok && nsrcs) ok = ignore_flush(ig, &groups_cap, srcs, &nsrcs, flags);
+    for (size_t i = 0; i < nsrcs; i++) free(srcs[i]);
+    free(srcs);
+    free(line);
+    if (!ig) return NULL;
+    ig->refs = 1;
+    if (!ok || !ig->ngroups) {
+        ignore_release(ig);
+        return NULL;
+    }
+    ig->up = ignore_retain(up);
+    ig->base = base;
+    return ig;
+}
+
+// -------------------- work queue --------------------
+//
+// One Chase-Lev deque per worker: the owner pushes and pops at the bottom (LIFO,
+// depth-first, cache-warm), idle workers steal from the top (FIFO, the largest
+// remaining subtrees). Nothing here takes a lock.
+//
+// Termination: q->pending counts queued + in-flight nodes. Workers reserve units
+// in batches (WqLocal.credit) so a push or a finished dir is usually a local
+// decrement/increment; credit is handed back before a worker looks for an empty
+// system, so pending == 0 means no node exists anywhere and nobody can make one.
+//
+// With -c a second deque per worker holds files whose contents are to be
+// searched. A worker takes a file only when no directory is left to take or
+// steal, so listing is never held up behind reading; both kinds count in
+// pending alike.
+
+// A directory waiting to be listed. Nodes hold only their own name and a
+// reference to their parent; full paths are built when something needs one.
+typedef struct Node {
+    struct Node *up;     // parent directory (referenced), NULL for the root
+    volatile LONG refs;  // one for the queue/lister, one per child Node
+    uint32_t id;         // directory id while building an index
+    uint32_t prev;       // same directory in the index being refreshed, IDX_NONE if none
+    uint32_t len;        // name length
+#ifndef _WIN32
+    DirFd *parent;       // open parent dir (referenced) until this one is opened
+    int fd;              // already opened (io_uring), -1 if not
+#endif
+    int file;            // -c: a file to search, in the directory up
+    Ignore *ign;         // --respect-ignore: the rules over this directory (referenced)
+    volatile LONG64 du_bytes; // --du: bytes under this directory so far; children add theirs as they are freed
+    pchar name[];        // not terminated; the root's is the whole root path
+} Node;
+
+static size_t node_size(size_t len) {
+    return sizeof(Node) + len * sizeof(pchar);
+}
+
+static Node* node_new(Arena *a, Node *up, const pchar *name, size_t len, uint32_t id, uint32_t prev) {
+    Node *n = (Node*)arena_alloc(a, node_size(len));
+    if (!n) return NULL;
+    n->up = up;
+    n->refs = 1;
+    n->id = id;
+    n->prev = prev;
+    n->len = (uint32_t)len;
+#ifndef _WIN32
+    n->parent = NULL;
+    n->fd = -1;
+#endif
+    n->file = 0;
+    n->ign = NULL;
+    n->du_bytes = 0;
+    memcpy(n->name, name, len * sizeof(pchar));
+    if (up) InterlockedIncrement(&up->refs);
+    return n;
+}
+
+// Frees n, whose last reference is gone, but not yet its reference to its
+// parent, to which its --du total is added. n may come from another
+// worker's arena: the block joins a's free list, which is fine because no
+// arena is destroyed before all workers are joined.
+static void node_free(Arena *a, Node *n) {
+    if (n->up && n->du_bytes) ATOMIC_ADD64(&n->up->du_bytes, n->du_bytes);
+#ifndef _WIN32
+    dirfd_release(n->parent);
+    if (n->fd >= 0) {
+        close(n->fd);
+        InterlockedDecrement(&g_fds_retained);
+    }
+#endif
+    ignore_release(n->ign);
+    arena_free(a, n, node_size(n->len));
+}
+
+// Drops one reference; the last one frees n and drops its parent's.
+static void node_release(Arena *a, Node *n) {
+    while (n && InterlockedDecrement(&n->refs) == 0) {
+        Node *up = n->up;
+        node_free(a, n);
+        n = up;
+    }
+}
+
+static int node_ends_with_sep(const Node *n) {
+    return n->len > 0 && (n->name[n->len - 1] == PATH_SEP || n->name[n->len - 1] == '/');
+}
+
+typedef struct DequeBuf {
+    LONG64 mask;
+    struct DequeBuf *prev;  // outgrown buffers: thieves may still read them
+    Node *volatile slots[];
+} DequeBuf;
+
+typedef struct {
+    volatile LONG64 top;    // thieves
+    char pad0[64 - sizeof(LONG64)];
+    volatile LONG64 bottom; // owner
+    DequeBuf *volatile buf;
+    char pad1[64 - sizeof(LONG64) - sizeof(void*)];
+} Deque;
+
+#define DEQUE_INITIAL_CAP 256
+#define WQ_CREDIT_BATCH 64
+
+static DequeBuf* dqbuf_new(LONG64 cap, DequeBuf *prev) {
+    DequeBuf *a = (DequeBuf*)malloc(sizeof(DequeBuf) + (size_t)cap * sizeof(Node*));
+    if (!a) return NULL;
+    a->mask = cap - 1;
+    a->prev = prev;
+    return a;
+}
+
+static int deque_push(Deque *d, Node *x) {
+    LONG64 b = ATOMIC_LOAD_RLX(&d->bottom);
+    LONG64 t = ATOMIC_LOAD_ACQ(&d->top);
+    DequeBuf *a = ATOMIC_LOAD_RLX(&d->buf);
+    if (b - t > a->mask) {
+        DequeBuf *g = dqbuf_new((a->mask + 1) * 2, a);
+        if (!g) return 0;
+        for (LONG64 i = t; i < b; i++) g->slots[i & g->mask] = a->slots[i & a->mask];
+        ATOMIC_STORE_REL(&d->buf, g);
+        a = g;
+    }
+    ATOMIC_STORE_RLX(&a->slots[b & a->mask], x);
+    ATOMIC_STORE_REL(&d->bottom, b + 1);
+    return 1;
+}
+
+// owner only
+static Node* deque_take(Deque *d) {
+    LONG64 b = ATOMIC_LOAD_RLX(&d->bottom) - 1;
+    DequeBuf *a = ATOMIC_LOAD_RLX(&d->buf);
+    ATOMIC_STORE_RLX(&d->bottom, b);
+    ATOMIC_FENCE();
+    LONG64 t = ATOMIC_LOAD_RLX(&d->top);
+    Node *x = NULL;
+    if (t <= b) {
+        x = ATOMIC_LOAD_RLX(&a->slots[b & a->mask]);
+        if (t == b) {
+            // last element: race the thieves for it
+            if (!ATOMIC_CAS64(&d->top, t, t + 1)) x = NULL;
+            ATOMIC_STORE_RLX(&d->bottom, b + 1);
+        }
+    } else {
+        ATOMIC_STORE_RLX(&d->bottom, b + 1);
+    }
+    return x;
+}
+
+// any thread; *lost is set when another thief won the race (worth retrying)
+static Node* deque_steal(Deque *d, int *lost) {
+    LONG64 t = ATOMIC_LOAD_ACQ(&d->top);
+    ATOMIC_FENCE();
+    LONG64 b = ATOMIC_LOAD_ACQ(&d->bottom);
+    if (t >= b) return NULL;
+    DequeBuf *a = ATOMIC_LOAD_ACQ(&d->buf);
+    Node *x = ATOMIC_LOAD_RLX(&a->slots[t & a->mask]);
+    if (!ATOMIC_CAS64(&d->top, t, t + 1)) {
+        *lost = 1;
+        return NULL;
+    }
+    return x;
+}
+
+typedef struct {
+    Deque *dq;              // one per worker
+    Deque *files;           // -c: one per worker, NULL without it
+    int nworkers;
+    volatile LONG64 pending; // queued + in-flight nodes, plus unspent worker credit
+    volatile LONG stop;     // set to abandon remaining work
+} WorkQ;
+
+// per-worker view of the queue; only touched by its owner
+typedef struct {
+    int id;
+    uint32_t rng;
+    LONG64 credit;
+} WqLocal;
+
+static Deque* deques_new(int n) {
+    Deque *dq = (Deque*)calloc((size_t)n, sizeof(Deque));
+    if (!dq) return NULL;
+    for (int i = 0; i < n; i++) {
+        dq[i].buf = dqbuf_new(DEQUE_INITIAL_CAP, NULL);
+        if (!dq[i].buf) return dq;  // wq_destroy frees what was made
+    }
+    return dq;
+}
+
+static void deques_free(Deque *dq, int n) {
+    if (!dq) return;
+    for (int i = 0; i < n; i++) {
+        DequeBuf *a = dq[i].buf;
+        // nodes still queued belong to the workers' arenas
+        while (a) {
+            DequeBuf *prev = a->prev;
+            free(a);
+            a = prev;
+        }
+    }
+    free(dq);
+}
+
+// files: also make the -c file deques
+static int wq_init(WorkQ *q, int nworkers, int files) {
+    q->nworkers = nworkers;
+    q->pending = 0;
+    q->stop = 0;
+    q->dq = deques_new(nworkers);
+    q->files = files && q->dq ? deques_new(nworkers) : NULL;
+    if (!q->dq || (files && !q->files)) return 0;
+    for (int i = 0; i < nworkers; i++) {
+        if (!q->dq[i].buf || (files && !q->files[i].buf)) return 0;
+    }
+    return 1;
+}
+
+static void wq_destroy(WorkQ *q) {
+    deques_free(q->dq, q->nworkers);
+    deques_free(q->files, q->nworkers);
+    q->dq = q->files = NULL;
+}
+
+static void wq_local_init(WqLocal *me, int id) {
+    me->id = id;
+    me->rng = 0x9E3779B9u * (uint32_t)(id + 1);
+    me->credit = 0;
+}
+
+// Counts a node that will be pushed later with wq_push_reserved; until then
+// it keeps the walk from finishing.
+static void wq_reserve(WorkQ *q, WqLocal *me) {
+    if (me->credit == 0) {
+        ATOMIC_ADD64(&q->pending, WQ_CREDIT_BATCH);
+        me->credit = WQ_CREDIT_BATCH;
+    }
+    me->credit--;
+}
+
+// 0 if out of memory: the reservation is given back and the caller keeps n
+static int wq_push_reserved(WorkQ *q, WqLocal *me, Node *n) {
+    if (!deque_push(&q->dq[me->id], n)) {
+        me->credit++;
+        return 0;
+    }
+    return 1;
+}
+
+// push node onto the caller's deque; 0 if out of memory (the caller keeps n)
+static int wq_push(WorkQ *q, WqLocal *me, Node *n) {
+    wq_reserve(q, me);
+    return wq_push_reserved(q, me, n);
+}
+
+// the same for a -c file, onto the caller's file deque
+static int wq_push_file(WorkQ *q, WqLocal *me, Node *n) {
+    wq_reserve(q, me);
+    if (!deque_push(&q->files[me->id], n)) {
+        me->credit++;
+        return 0;
+    }
+    return 1;
+}
+
+static void wq_backoff(unsigned round) {
+    if (round < 64) {
+        CPU_RELAX();
+    } else if (round < 80) {
+        thread_yield();
+    } else {
+        unsigned shift = round - 80 < 5 ? round - 80 : 5;
+        sleep_us(32u << shift); // 32us .. 1ms
+    }
+}
+
+// one pass over the other workers' deques in dq from a random start
+static Node* wq_steal(WorkQ *q, Deque *dq, WqLocal *me, int *lost) {
+    me->rng = me->rng * 1664525u + 1013904223u;
+    int start = (int)((me->rng >> 8) % (uint32_t)q->nworkers);
+    for (int i = 0; i < q->nworkers; i++) {
+        int victim = (start + i) % q->nworkers;
+        if (victim == me->id) continue;
+        Node *n = deque_steal(&dq[victim], lost);
+        if (n) return n;
+    }
+    return NULL;
+}
+
+// -c: a file, for when no directory could be had
+static Node* wq_take_file(WorkQ *q, WqLocal *me, int *lost) {
+    if (!q->files) return NULL;
+    Node *n = deque_take(&q->files[me->id]);
+    return n ? n : wq_steal(q, q->files, me, lost);
+}
+
+// pop node (caller owns it) or NULL once all work is finished or q->stop is set
+static Node* wq_pop(WorkQ *q, WqLocal *me) {
+    if (q->stop) return NULL;
+    Node *n = deque_take(&q->dq[me->id]);
+    if (n) return n;
+
+    for (unsigned round = 0;; round++) {
+        if (q->stop) return NULL;
+
+        int lost = 0;
+        n = wq_steal(q, q->dq, me, &lost);
+        if (n) return n;
+        if (lost) continue;
+        n = wq_take_file(q, me, &lost);
+        if (n) return n;
+        if (lost) continue;
+
+        // nothing visible: hand back our credit so the last idle worker can see zero
+        if (me->credit) {
+            ATOMIC_ADD64(&q->pending, -me->credit);
+            me->credit = 0;
+        }
+        if (ATOMIC_LOAD_ACQ(&q->pending) == 0) return NULL;
+        wq_backoff(round);
+    }
+}
+
+// wq_pop without waiting: NULL if nothing is there right now
+static Node* wq_try_pop(WorkQ *q, WqLocal *me) {
+    if (q->stop) return NULL;
+    Node *n = deque_take(&q->dq[me->id]);
+    if (n) return n;
+    int lost = 0;
+    n = wq_steal(q, q->dq, me, &lost);
+    return n ? n : wq_take_file(q, me, &lost);
+}
+
+// abandon the remaining work; workers return from wq_pop as they come back to it
+static void wq_stop(WorkQ *q) {
+    ATOMIC_STORE_REL(&q->stop, 1);
+}
+
+// After the workers are joined: release the nodes a stop left queued, which
+// still hold their parents and (on Linux) open directory fds.
+static void deques_drain(Deque *dq, int n, Arena *a) {
+    for (int i = 0; dq && i < n; i++) {
+        Deque *d = &dq[i];
+        for (LONG64 t = d->top; t < d->bottom; t++) node_release(a, d->buf->slots[t & d->buf->mask]);
+        d->top = d->bottom;
+    }
+}
+
+static void wq_drain(WorkQ *q, Arena *a) {
+    deques_drain(q->dq, q->nworkers, a);
+    deques_drain(q->files, q->nworkers, a);
+}
+
+// mark worker finished a dir: its pending unit becomes our credit
+static void wq_done_one(WorkQ *q, WqLocal *me) {
+    (void)q;
+    me->credit++;
+}
+
+// -------------------- timing --------------------
+
+static double now_seconds(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq = {0};
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+// -------------------- trace --------------------
+//
+// --trace: each worker records a span per directory into its own ring, with
+// the path packed into a second ring of bytes. Nothing is shared while the
+// walk runs; the rings are written out as Chrome trace events after the join.
+// On overflow the oldest spans go first.
+
+#define TRACE_SPANS      (1u << 16)     // per worker
+#define TRACE_NAME_BYTES (4u << 20)
+
+typedef struct {
+    double t0, t1;
+    uint64_t name_pos;      // where the name starts, counted over all bytes ever written
+    uint32_t name_len;
+    uint32_t entries;
+} TraceSpan;
+
+typedef struct {
+    TraceSpan *spans;       // NULL when not tracing
+    uint64_t nspans;        // recorded so far, including overwritten ones
+    char *names;
+    uint64_t name_pos;
+} TraceRing;
+
+static int trace_init(TraceRing *r) {
+    memset(r, 0, sizeof(*r));
+    r->spans = (TraceSpan*)malloc(TRACE_SPANS * sizeof(TraceSpan));
+    r->names = (char*)malloc(TRACE_NAME_BYTES);
+    return r->spans && r->names;
+}
+
+static void trace_free(TraceRing *r) {
+    free(r->spans);
+    free(r->names);
+    r->spans = NULL;
+    r->names = NULL;
+}
+
+static void trace_span(TraceRing *r, double t0, double t1, const char *name, size_t len, uint32_t entries) {
+    if (len > TRACE_NAME_BYTES / 2) len = TRACE_NAME_BYTES / 2;
+    // names never wrap around the end: skip to the start instead
+    uint64_t off = r->name_pos % TRACE_NAME_BYTES;
+    if (off + len > TRACE_NAME_BYTES) {
+        r->name_pos += TRACE_NAME_BYTES - off;
+        off = 0;
+    }
+    memcpy(r->names + off, name, len);
+
+    TraceSpan *s = &r->spans[r->nspans++ % TRACE_SPANS];
+    s->t0 = t0;
+    s->t1 = t1;
+    s->name_pos = r->name_pos;
+    s->name_len = (uint32_t)len;
+    s->entries = entries;
+    r->name_pos += len;
+}
+
+// s as the contents of a JSON string; bytes that are not valid UTF-8 become U+FFFD
+static void json_str8(FILE *f, const char *s, size_t n) {
+    const unsigned char *p = (const unsigned char*)s;
+    size_t i = 0;
+    while (i < n) {
+        unsigned c = p[i];
+        if (c < 0x80) {
+            if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+            else if (c < 0x20) fprintf(f, "\\u%04x", c);
+            else fputc((int)c, f);
+            i++;
+            continue;
+        }
+        size_t k = c >= 0xC2 && c <= 0xDF ? 2 : c >= 0xE0 && c <= 0xEF ? 3 : c >= 0xF0 && c <= 0xF4 ? 4 : 0;
+        int ok = k && i + k <= n;
+        for (size_t j = 1; ok && j < k; j++) ok = (p[i + j] & 0xC0) == 0x80;
+        // overlong forms, surrogates, past U+10FFFF
+        if (ok && k > 2) {
+            unsigned d = p[i + 1];
+            ok = !(c == 0xE0 && d < 0xA0) && !(c == 0xED && d >= 0xA0) &&
+                 !(c == 0xF0 && d < 0x90) && !(c == 0xF4 && d >= 0x90);
+        }
+        if (ok) {
+            fwrite(p + i, 1, k, f);
+            i += k;
+        } else {
+            fputs("\\ufffd", f);
+            i++;
+        }
+    }
+}
+
+// One worker's spans as trace events, times in microseconds since base.
+// Returns how many spans had been overwritten.
+static uint64_t trace_write_ring(FILE *f, const TraceRing *r, int tid, double base) {
+    fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+               "\"args\": {\"name\": \"worker %d\"}}", tid, tid);
+    uint64_t first = r->nspans > TRACE_SPANS ? r->nspans - TRACE_SPANS : 0;
+    for (uint64_t k = first; k < r->nspans; k++) {
+        const TraceSpan *s = &r->spans[k % TRACE_SPANS];
+        fputs(",\n{\"name\": \"", f);
+        if (r->name_pos - s->name_pos <= TRACE_NAME_BYTES) {
+            json_str8(f, r->names + s->name_pos % TRACE_NAME_BYTES, s->name_len);
+        } else {
+            fputs("?", f);  // its name was overwritten by later ones
+        }
+        fprintf(f, "\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"args\": {\"entries\": %u}}",
+            tid, (s->t0 - base) * 1e6, (s->t1 - s->t0) * 1e6, s->entries);
+    }
+    return first;
+}
+
+// -------------------- output --------------------
+//
+// Each worker encodes matches into a private buffer and writes it with a single
+// call per flush; out_mu is held only around that write so lines from different
+// workers never interleave. Output is UTF-8, except a Windows console, which
+// gets UTF-16 through WriteConsoleW; Linux names go out as the bytes they are.
+
+#define OUT_BUF_SIZE (256 * 1024)
+
+#ifdef _WIN32
+#define OUT_EOL "\r\n"
+#else
+#define OUT_EOL "\n"
+#endif
+
+typedef struct {
+    char *data;
+    size_t len;
+    int timed;          // --stats=json: add up the time spent in flushes
+    double secs;
+} OutBuf;
+
+static int g_out_console;
+
+// stdout is interactive: default to flushing after every directory
+static int out_is_terminal(void) {
+#ifdef _WIN32
+    HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode;
+    g_out_console = GetFileType(h) == FILE_TYPE_CHAR && GetConsoleMode(h, &mode);
+    return g_out_console;
+#else
+    return isatty(1);
+#endif
+}
+
+static void out_write_all(const char *p, size_t n) {
+#ifdef _WIN32
+    HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
+    while (n) {
+        DWORD done = 0;
+        if (g_out_console) {
+            DWORD chars = (DWORD)((n > 32768 ? 32768 : n) / sizeof(wchar_t));
+            if (!WriteConsoleW(h, p, chars, &done, NULL) || !done) return;
+            done *= sizeof(wchar_t);
+        } else {
+            DWORD chunk = n > (1u << 30) ? (1u << 30) : (DWORD)n;
+            if (!WriteFile(h, p, chunk, &done, NULL) || !done) return;
+        }
+        p += done;
+        n -= done;
+    }
+#else
+    while (n) {
+        ssize_t w = write(1, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+#endif
+}
+
+static int out_init(OutBuf *ob) {
+    ob->len = 0;
+    ob->data = (char*)malloc(OUT_BUF_SIZE);
+    return ob->data != NULL;
+}
+
+static void out_flush(OutBuf *ob, CRITICAL_SECTION *mu) {
+    if (!ob->len) return;
+    double t0 = ob->timed ? now_seconds() : 0;
+    EnterCriticalSection(mu);
+    out_write_all(ob->data, ob->len);
+    LeaveCriticalSection(mu);
+    ob->len = 0;
+    if (ob->timed) ob->secs += now_seconds() - t0;
+}
+
+static void out_free(OutBuf *ob, CRITICAL_SECTION *mu) {
+    if (!ob->data) return;
+    out_flush(ob, mu);
+    free(ob->data);
+    ob->data = NULL;
+}
+
+#ifdef _WIN32
+// append one line (s is NUL-terminated, n characters); flushes first if full
+static void out_line(OutBuf *ob, CRITICAL_SECTION *mu, const wchar_t *s, size_t n) {
+    size_t need = n * (g_out_console ? sizeof(wchar_t) : 4) + 8;
+    if (need > OUT_BUF_SIZE) return;
+    if (ob->len + need > OUT_BUF_SIZE) out_flush(ob, mu);
+
+    char *dst = ob->data + ob->len;
+    if (g_out_console) {
+        memcpy(dst, s, n * sizeof(wchar_t));
+        memcpy(dst + n * sizeof(wchar_t), L"\n", sizeof(wchar_t));
+        ob->len += (n + 1) * sizeof(wchar_t);
+        return;
+    }
+    size_t w = utf8_encode(dst, s, n);
+    memcpy(dst + w, OUT_EOL, sizeof(OUT_EOL) - 1);
+    ob->len += w + sizeof(OUT_EOL) - 1;
+}
+#endif
+
+// same, for a UTF-8 line (Linux scans, index queries)
+static void out_line_utf8(OutBuf *ob, CRITICAL_SECTION *mu, const char *s, size_t n) {
+    size_t need = (n + 2) * (g_out_console ? sizeof(wchar_t) : 1) + 8;
+    if (need > OUT_BUF_SIZE) return;
+    if (ob->len + need > OUT_BUF_SIZE) out_flush(ob, mu);
+
+    char *dst = ob->data + ob->len;
+#ifdef _WIN32
+    if (g_out_console) {
+        int k = n ? MultiByteToWideChar(CP_UTF8, 0, s, (int)n, (wchar_t*)dst, (int)n) : 0;
+        ((wchar_t*)dst)[k] = L'\n';
+        ob->len += (size_t)(k + 1) * sizeof(wchar_t);
+        return;
+    }
+#endif
+    memcpy(dst, s, n);
+    memcpy(dst + n, OUT_EOL, sizeof(OUT_EOL) - 1);
+    ob->len += n + sizeof(OUT_EOL) - 1;
+}
+
+// -------------------- io_uring --------------------
+//
+// Minimal raw-syscall ring (no liburing), used to open directories ahead of
+// the workers. Mainline io_uring has no getdents, so listing itself stays a
+// blocking call; the opens (an inode read each on a cold cache) are what
+// goes through the ring.
+
+#ifdef HAVE_IO_URING
+
+#define URING_NAME_MAX 256      // NAME_MAX + NUL
+
+typedef struct {
+    Node *node;
+    char name[URING_NAME_MAX];  // read by the kernel when the open is issued
+} UringSlot;
+
+typedef struct {
+    int fd;                     // -1: no ring
+    unsigned depth;             // opens in flight at most
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+    unsigned to_submit;         // sqes queued since the last io_uring_enter
+    UringSlot *slots;
+    unsigned *free_slots;
+    unsigned nfree;             // depth - nfree opens are in flight
+} Uring;
+
+static void uring_free(Uring *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_len);
+    if (r->sq_map) munmap(r->sq_map, r->sq_map_len);
+    if (r->fd >= 0) close(r->fd);
+    free(r->slots);
+    free(r->free_slots);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static int uring_init(Uring *r, unsigned depth) {
+    memset(r, 0, sizeof(*r));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        return 0;
+    }
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        uring_free(r);
+        return 0;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            r->cq_map = NULL;
+            uring_free(r);
+            return 0;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_free(r);
+        return 0;
+    }
+
+    char *sq = (char*)r->sq_map, *cq = (char*)r->cq_map;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // the kernel may round up; never have more in flight than the SQ holds
+    r->depth = depth < p.sq_entries ? depth : p.sq_entries;
+    r->slots = (UringSlot*)calloc(r->depth, sizeof(UringSlot));
+    r->free_slots = (unsigned*)malloc(r->depth * sizeof(unsigned));
+    if (!r->slots || !r->free_slots) {
+        uring_free(r);
+        return 0;
+    }
+    for (unsigned i = 0; i < r->depth; i++) r->free_slots[i] = r->depth - 1 - i;
+    r->nfree = r->depth;
+    return 1;
+}
+
+// next free sqe, zeroed; the SQ never fills since at most depth are in flight
+static struct io_uring_sqe* uring_sqe(Uring *r) {
+    unsigned tail = *r->sq_tail;
+    struct io_uring_sqe *e = &r->sqes[tail & r->sq_mask];
+    memset(e, 0, sizeof(*e));
+    return e;
+}
+
+static void uring_queue(Uring *r) {
+    unsigned tail = *r->sq_tail;
+    r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+    ATOMIC_STORE_REL(r->sq_tail, tail + 1);
+    r->to_submit++;
+}
+
+// submits what is queued; with wait, also blocks until one completion is
+// there. 0 if the ring failed.
+static int uring_enter(Uring *r, int wait) {
+    for (;;) {
+        long got = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait ? 1 : 0,
+                           wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (got >= 0) {
+            r->to_submit -= (unsigned)got;
+            if (!r->to_submit || wait) return 1;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return 0;
+        }
+    }
+}
+
+static struct io_uring_cqe* uring_cqe(Uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == ATOMIC_LOAD_ACQ(r->cq_tail)) return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+static void uring_cqe_seen(Uring *r) {
+    ATOMIC_STORE_REL(r->cq_head, *r->cq_head + 1);
+}
+
+#endif
+
+// -------------------- shared settings/stats --------------------
+
+// names collected by one worker while building an index
+typedef struct {
+    uint32_t id, parent;
+    uint32_t name_len;
+    uint64_t name_off;  // into dnames
+} IdxDirEnt;
+
+typedef struct {
+    uint32_t dir, nfiles;
+    uint64_t off;       // into bytes: nfiles x (uint16_t len, name)
+    uint64_t mtime, file_id;
+} IdxRun;
+
+typedef struct {
+    IdxDirEnt *dirs;
+    size_t ndirs, dirs_cap;
+    IdxRun *runs;
+    size_t nruns, runs_cap;
+    char *bytes;        // file names
+    size_t nbytes, bytes_cap;
+    char *dnames;       // directory names
+    size_t ndnames, dnames_cap;
+    int oom;
+} IdxLocal;
+
+struct Index;
+
+// --dupes: a file the walk recorded
+typedef struct {
+    uint64_t size;          // 0 once the file turned out unreadable
+    uint64_t dev, id;       // Linux: device and inode, so hard links count once; 0 on Win32
+    uint64_t hash;          // XXH64 of the first and last bytes, later of all of it
+    const pchar *path;      // NUL-terminated; set once the walk is over
+    size_t path_off;        // ... until then, into the recording worker's paths
+    uint32_t path_len;
+} DupeFile;
+
+typedef struct {
+    DupeFile *files;
+    size_t nfiles, files_cap;
+    pchar *paths;
+    size_t npaths, paths_cap;
+    int oom;
+} DupeLocal;
+
+// --du: a directory and the bytes under it
+typedef struct {
+    uint64_t bytes;
+    char *path;             // UTF-8, owned
+} DuEntry;
+
+typedef struct {
+    uint64_t dir_bytes;     // files of the directory being listed, so far
+    LONG64 files;
+    DuEntry *top;           // the heaviest directories this worker finished: a min-heap
+    size_t ntop;
+} DuLocal;
+
+// one hashing pass over files, shared by the threads that run it
+typedef struct {
+    DupeFile *files;
+    size_t n;
+    int full;               // whole files, else the first and last DUPE_EDGE bytes
+    volatile LONG64 next;
+} DupePass;
+
+// what an entry is, for --type; without it everything but directories
+#define KIND_FILE    1
+#define KIND_DIR     2
+#define KIND_LINK    4
+#define KIND_OTHER   8      // fifos, sockets, devices
+#define KIND_DEFAULT (KIND_FILE | KIND_LINK | KIND_OTHER)
+
+// --size, --newer: checked after everything else about a name matched,
+// with one statx on Linux and from the listing itself on Win32
+typedef struct {
+    int size_op;            // 0 = none, '+' larger than size, '-' smaller, '=' exactly
+    uint64_t size;
+    int newer;              // modified at or after mtime_min
+    int64_t mtime_min;      // ns since 1970 (Linux), FILETIME ticks (Win32)
+} MetaFilter;
+
+typedef struct {
+    Needle needle;
+    const AcAuto *ac;        // several needles, NULL for one
+    const Pattern *pat;      // -g, -r; needle then holds its required literal
+    ExtFilter ext;           // -e, -E
+    unsigned kinds;          // --type: KIND_* bits to report
+    MetaFilter meta;
+    const PatSet *prune;     // --exclude-dir: directory names never entered
+    int ignore;              // --respect-ignore
+    const ContentText *content; // -c: search the matched files for this, NULL without it
+    int dupes;               // --dupes: matched files are recorded, then grouped by contents
+    DupePass *dupe_pass;     // ... the hashing pass under way
+    size_t du_top;           // --du: how many of the heaviest directories to print, 0 = off
+    uint64_t du_total;       // ... bytes under the root
+    int match_full_path;
+    int flush_per_dir;
+    int build_index;         // collect names for an index instead of matching
+    volatile LONG64 next_dir_id;
+    const struct Index *ix;  // index being queried
+    const uint64_t *cand;    // files the trigrams allow, NULL = all
+    const struct Index *prev; // index being refreshed
+    volatile LONG64 dirs_reused;
+    volatile LONG64 next_block;
+    volatile LONG64 found;
+    LONG64 max_matches;      // -m: stop after this many, 0 = no limit
+    int io_depth;            // -q: io_uring opens in flight per worker, 0 = off
+    volatile LONG io_rings;  // workers that got a ring
+    double first_match;      // now_seconds() of the first match, 0 if none
+    int stats;               // --stats=json: time the workers' phases too
+    int trace;               // --trace: a span per directory
+    LONG64 dirs_scanned;     // the workers' counters, summed after the join
+    LONG64 files_scanned;
+    LONG64 stat_calls;
+    LONG64 dirs_pruned;
+    LONG64 ignored;
+    LONG64 ignore_files;
+    LONG64 content_files;
+    LONG64 content_bytes;
+    LONG64 hash_bytes;
+    LONG64 dupe_candidates;  // --dupes: files the walk recorded to compare
+    LONG64 dupe_groups;      // ... groups of files with the same contents
+    LONG64 dupe_files;       // ... files in them
+    uint64_t dupe_bytes;     // ... bytes all but one of each group take up
+    CRITICAL_SECTION out_mu; // serialize output
+    WorkQ *q;
+} Ctx;
+
+// One worker's counters. Plain fields, written only by their worker and read
+// after the join. Times are in seconds and only taken with --stats=json:
+// wait is spent in the queue, list in open/getdents64 (FindFirstFile/
+// FindNextFile), out in flushes; match is the rest of the worker's time.
+typedef struct {
+    LONG64 dirs, entries, files;
+    LONG64 name_bytes;      // of every entry, as the system returned them
+    LONG64 stat_calls;      // for --size, --newer
+    LONG64 pruned;          // subdirectories --exclude-dir kept out of the queue
+    LONG64 ignored;         // entries --respect-ignore dropped, directories unread
+    LONG64 ignore_files;    // ... ignore files read
+    LONG64 content_files;   // -c: files searched
+    LONG64 content_bytes;   // ... bytes read or mapped from them
+    LONG64 hash_bytes;      // --dupes: bytes read to hash
+    double wait, list, match;
+} WorkerStats;
+
+struct Worker;
+typedef void (*visit_fn)(struct Worker *w, const Node *n, const pchar *name, size_t nlen);
+
+typedef struct Worker {
+    Ctx *ctx;
+    visit_fn visit;         // per-file work for this run's options
+    WqLocal wq;
+    OutBuf out;
+    IdxLocal ix;
+    DupeLocal dup;          // --dupes
+    DuLocal du;             // --du
+    AcHits hits;            // needles found in the current name (-a, -n)
+    WorkerStats st;
+    TraceRing trace;        // --trace
+    double span_t0;         // ... when the current directory was taken
+    LONG64 span_entries;    // ... st.entries then
+#ifdef HAVE_IO_URING
+    Uring ring;             // directory opens in flight (-q)
+#endif
+    Arena arena;            // this worker's Nodes
+    uint8_t *cbuf;          // -c, --dupes: CONTENT_BUF_SIZE bytes for reading files
+    // the entry being visited, for --size and --newer
+#ifdef _WIN32
+    const WIN32_FIND_DATAW *ent;
+#else
+    int ent_dirfd;
+    const char *ent_raw;
+    DirFd *ent_share;       // ent_dirfd as held by what is queued from it
+    int ent_share_tried;    // ... made once, on first need
+#endif
+    Ignore *ign;            // --respect-ignore: rules for the directory being listed (referenced)
+    size_t ign_len;         // ... its path below the root in ign_path, SIZE_MAX if too long
+    char ign_path[PATH_CAP];
+    const Node *path_of;    // directory whose path is in path
+    size_t path_len;        // ... up to and including the trailing separator
+    size_t path_dir_len;    // ... without it
+    pchar path[PATH_CAP];
+} Worker;
+
+static int worker_match8(Worker *w, const char *s, size_t n) {
+    const Ctx *ctx = w->ctx;
+    if (ctx->pat) return needle_match8(&ctx->needle, s, n) && pat_match8(ctx->pat, s, n);
+    return ctx->ac ? ac_match8(ctx->ac, &w->hits, s, n) > 0 : needle_match8(&ctx->needle, s, n);
+}
+
+#define VISIT_FULL    1     // -f
+#define VISIT_EXT     2     // -e or -E
+#define VISIT_KIND    12    // what a name is matched with:
+#define VISIT_ONE     0     //   one needle
+#define VISIT_MULTI   4     //   several needles
+#define VISIT_ALL     8     //   one empty needle: every name is a hit
+#define VISIT_PATTERN 12    //   -g or -r
+#define VISIT_META    16    // --size or --newer
+#define VISIT_HANDOFF 32    // -c, --dupes, --du: a match is handed on, not printed
+#define VISIT_VARIANTS 64
+
+static unsigned visit_flags(const Ctx *ctx) {
+    unsigned f = 0;
+    if (ctx->match_full_path) f |= VISIT_FULL;
+    if (ctx->ext.only.count || ctx->ext.skip.count) f |= VISIT_EXT;
+    if (ctx->meta.size_op || ctx->meta.newer) f |= VISIT_META;
+    if (ctx->content || ctx->dupes || ctx->du_top) f |= VISIT_HANDOFF;
+    if (ctx->pat) f |= VISIT_PATTERN;
+    else if (ctx->ac) f |= VISIT_MULTI;
+    else if (!ctx->needle.len) f |= VISIT_ALL;
+    return f;
+}
+
+// Counts a match about to be printed; 0 if -m's limit was reached by other
+// workers first. The one that reaches it stops the walk.
+static int take_match(Ctx *ctx) {
+    LONG64 k = InterlockedIncrement64(&ctx->found);
+    if (k == 1) ctx->first_match = now_seconds();
+    if (!ctx->max_matches || k < ctx->max_matches) return 1;
+    if (k == ctx->max_matches) wq_stop(ctx->q);
+    return k == ctx->max_matches;
+}
+
+// whatever of the worker's time was not spent waiting, listing or writing
+static void worker_stats_end(Worker *w, double t_begin) {
+    double busy = now_seconds() - t_begin - w->st.wait - w->st.list - w->out.secs;
+    w->st.match = busy > 0 ? busy : 0;
+}
+
+// --trace: a span opens when a directory is taken
+static void trace_dir_begin(Worker *w) {
+    w->span_t0 = now_seconds();
+    w->span_entries = w->st.entries;
+}
+
+// -------------------- index: collection --------------------
+
+static void idx_dir_begin(Worker *w, uint32_t dir, uint64_t mtime, uint64_t file_id) {
+    IdxLocal *ix = &w->ix;
+    if (!grow_array((void**)&ix->runs, &ix->runs_cap, ix->nruns + 1, sizeof(IdxRun))) {
+        ix->oom = 1;
+        return;
+    }
+    IdxRun *r = &ix->runs[ix->nruns++];
+    r->dir = dir;
+    r->nfiles = 0;
+    r->off = ix->nbytes;
+    r->mtime = mtime;
+    r->file_id = file_id;
+}
+
+static void idx_add_file(Worker *w, const char *name, size_t len) {
+    IdxLocal *ix = &w->ix;
+    if (ix->oom || !ix->nruns || len > 0xFFFF) return;
+    if (!grow_array((void**)&ix->bytes, &ix->bytes_cap, ix->nbytes + len + 2, 1)) {
+        ix->oom = 1;
+        return;
+    }
+    uint16_t l16 = (uint16_t)len;
+    memcpy(ix->bytes + ix->nbytes, &l16, 2);
+    memcpy(ix->bytes + ix->nbytes + 2, name, len);
+    ix->nbytes += len + 2;
+    ix->runs[ix->nruns - 1].nfiles++;
+}
+
+// records a subdirectory of parent and returns its new id
+static uint32_t idx_add_dir(Worker *w, uint32_t parent, const char *name, size_t len) {
+    IdxLocal *ix = &w->ix;
+    uint32_t id = (uint32_t)ATOMIC_ADD64(&w->ctx->next_dir_id, 1);
+    if (ix->oom) return id;
+    if (!grow_array((void**)&ix->dirs, &ix->dirs_cap, ix->ndirs + 1, sizeof(IdxDirEnt)) ||
+        !grow_array((void**)&ix->dnames, &ix->dnames_cap, ix->ndnames + len, 1)) {
+        ix->oom = 1;
+        return id;
+    }
+    IdxDirEnt *d = &ix->dirs[ix->ndirs++];
+    d->id = id;
+    d->parent = parent;
+    d->name_len = (uint32_t)len;
+    d->name_off = ix->ndnames;
+    memcpy(ix->dnames + ix->ndnames, name, len);
+    ix->ndnames += len;
+    return id;
+}
+
+#ifdef _WIN32
+static void idx_add_file_w(Worker *w, const wchar_t *name, size_t nlen) {
+    char buf[MAX_PATH * 4];
+    if (nlen > MAX_PATH) return;
+    idx_add_file(w, buf, utf8_encode(buf, name, nlen));
+}
+#endif
+
+static void idx_local_free(IdxLocal *ix) {
+    free(ix->dirs);
+    free(ix->runs);
+    free(ix->bytes);
+    free(ix->dnames);
+    memset(ix, 0, sizeof(*ix));
+}
+
+// -------------------- index --------------------
+//
+// On-disk layout (little-endian, every section 8-byte aligned):
+//
+//   IdxHeader
+//   root path      UTF-8, as given to --build-index
+//   IdxDir[ndirs]  breadth-first, root first, so each directory's children are
+//                  contiguous and sorted by name; parent pointers rebuild any
+//                  path; mtime and file id let --update-index skip unchanged
+//                  directories
+//   dir names      UTF-8 pool referenced by IdxDir.name_off
+//   blocks         uint64_t[nblocks]: start of every IDX_BLOCK-th file name
+//   file names     grouped by directory (in IdxDir order), sorted within a
+//                  directory, front-coded: varint shared-prefix length,
+//                  varint suffix length, suffix bytes; the prefix restarts at 0
+//                  at each block so blocks decode independently
+//   file trigrams  IdxTri[], sorted: ASCII-folded byte trigrams of file names
+//   dir trigrams   IdxTri[], sorted: the same for directory names
+//   postings       ascending file/dir ids per trigram, delta + varint
+//
+// A query maps the file once, narrows the needle to candidate files with the
+// trigram postings, and decodes only the blocks holding candidates.
+
+#define IDX_MAGIC "FFINDIDX"
+#define IDX_VERSION 3
+#define IDX_BLOCK 64        // file names per front-coding restart
+#define IDX_CHUNK 64        // blocks claimed by a query worker at a time
+#define IDX_NAME_MAX 1024
+#define IDX_NONE UINT32_MAX
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block;
+    uint64_t ndirs, nfiles, nblocks;
+    uint64_t root_off, root_len;
+    uint64_t dirs_off;
+    uint64_t dirnames_off, dirnames_len;
+    uint64_t blocks_off;
+    uint64_t names_off, names_len;
+    uint64_t ftris_off, nftris;
+    uint64_t dtris_off, ndtris;
+    uint64_t post_off, post_len;
+    uint32_t sep;           // path separator of the system that built it
+    uint32_t reserved[7];
+} IdxHeader;
+
+typedef struct {
+    uint32_t parent;        // root is its own parent
+    uint32_t first_child;
+    uint32_t nchildren;
+    uint32_t first_file;
+    uint32_t nfiles;
+    uint32_t name_len;
+    uint64_t name_off;      // into dir names
+    uint64_t mtime;         // st_mtim in ns / ftLastWriteTime; 0 if unknown
+    uint64_t file_id;       // inode; 0 on Windows
+} IdxDir;
+
+typedef struct {
+    uint32_t tri;           // folded bytes b0 << 16 | b1 << 8 | b2
+    uint32_t count;
+    uint64_t off;           // into postings
+} IdxTri;
+
+#define IDX_TRI(a, b, c) ((uint32_t)(uint8_t)FOLD_ASCII(a) << 16 | \
+                          (uint32_t)(uint8_t)FOLD_ASCII(b) << 8 | (uint8_t)FOLD_ASCII(c))
+
+typedef struct Index {
+    const uint8_t *base;
+    size_t size;
+    const IdxHeader *h;
+    const IdxDir *dirs;
+    const char *dirnames;
+    const uint64_t *blocks;
+    const uint8_t *names;
+    const IdxTri *ftris, *dtris;
+    const uint8_t *post;
+#ifdef _WIN32
+    HANDLE file, map;
+#endif
+} Index;
+
+static FILE* fopen_write(const wchar_t *path) {
+#ifdef _WIN32
+    return _wfopen(path, L"wb");
+#else
+    char p[PATH_CAP * 4];
+    if (!wide_to_utf8(p, sizeof(p), path)) return NULL;
+    return fopen(p, "wb");
+#endif
+}
+
+static FILE* fopen_read(const wchar_t *path) {
+#ifdef _WIN32
+    return _wfopen(path, L"rb");
+#else
+    char p[PATH_CAP * 4];
+    if (!wide_to_utf8(p, sizeof(p), path)) return NULL;
+    return fopen(p, "rb");
+#endif
+}
+
+static int replace_file(const wchar_t *from, const wchar_t *to) {
+#ifdef _WIN32
+    return MoveFileExW(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    char f[PATH_CAP * 4], t[PATH_CAP * 4];
+    if (!wide_to_utf8(f, sizeof(f), from) || !wide_to_utf8(t, sizeof(t), to)) return 0;
+    return rename(f, t) == 0;
+#endif
+}
+
+static void remove_file(const wchar_t *path) {
+#ifdef _WIN32
+    DeleteFileW(path);
+#else
+    char p[PATH_CAP * 4];
+    if (wide_to_utf8(p, sizeof(p), path)) unlink(p);
+#endif
+}
+
+static int bytes_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c) return c;
+    return alen < blen ? -1 : alen > blen;
+}
+
+static size_t put_varint(uint8_t *p, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+static int get_varint(const uint8_t **pp, const uint8_t *end, uint32_t *out) {
+    const uint8_t *p = *pp;
+    uint32_t v = 0;
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (p >= end) return 0;
+        uint8_t b = *p++;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *pp = p;
+            *out = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int u32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// distinct trigrams of s into out (room for n entries), sorted; returns how many
+static size_t name_trigrams(const char *s, size_t n, uint32_t *out) {
+    if (n < 3) return 0;
+    size_t k = 0;
+    for (size_t i = 0; i + 2 < n; i++) out[k++] = IDX_TRI(s[i], s[i + 1], s[i + 2]);
+    if (k > 32) {
+        qsort(out, k, sizeof(uint32_t), u32_cmp);
+    } else {
+        for (size_t i = 1; i < k; i++) {
+            uint32_t t = out[i];
+            size_t j = i;
+            for (; j > 0 && out[j - 1] > t; j--) out[j] = out[j - 1];
+            out[j] = t;
+        }
+    }
+    size_t u = 1;
+    for (size_t i = 1; i < k; i++) {
+        if (out[i] != out[u - 1]) out[u++] = out[i];
+    }
+    return u;
+}
+
+// ---- build ----
+
+typedef struct {
+    const char *s;
+    uint32_t len;
+    uint32_t id;
+} NameRef;
+
+static int nameref_cmp(const void *a, const void *b) {
+    const NameRef *x = (const NameRef*)a, *y = (const NameRef*)b;
+    return bytes_cmp(x->s, x->len, y->s, y->len);
+}
+
+typedef struct {
+    const char *name;
+    uint32_t name_len;
+    uint32_t parent;
+    const char *files;  // packed (uint16_t len, name) x nfiles
+    uint32_t nfiles;
+    uint64_t mtime, file_id;
+} BuildDir;
+
+typedef struct {
+    uint8_t *p;
+    size_t len, cap;
+} ByteVec;
+
+static int bv_put(ByteVec *v, const void *src, size_t n) {
+    if (!n) return 1;
+    if (!grow_array((void**)&v->p, &v->cap, v->len + n, 1)) return 0;
+    memcpy(v->p + v->len, src, n);
+    v->len += n;
+    return 1;
+}
+
+// Posting lists for v[0..n): appends the sorted IdxTri table to tab and the
+// delta-coded ids to post. Counting sort into a 2^24-entry slot array (only
+// the pages of trigrams that occur get touched), so every list comes out in
+// id order.
+static int build_trigrams(const NameRef *v, size_t n, ByteVec *tab, ByteVec *post, uint64_t *ntris) {
+    uint32_t *slot = (uint32_t*)calloc((size_t)1 << 24, sizeof(uint32_t));
+    uint32_t *tris = NULL, *ids = NULL, *present = NULL;
+    size_t tris_cap = 0, present_cap = 0, npresent = 0, total = 0;
+    int ok = 0;
+    *ntris = 0;
+    if (!slot) goto done;
+
+    for (size_t i = 0; i < n; i++) {
+        if (!grow_array((void**)&tris, &tris_cap, v[i].len, sizeof(uint32_t))) goto done;
+        size_t k = name_trigrams(v[i].s, v[i].len, tris);
+        for (size_t j = 0; j < k; j++) {
+            if (slot[tris[j]]++ == 0) {
+                if (!grow_array((void**)&present, &present_cap, npresent + 1, sizeof(uint32_t))) goto done;
+                present[npresent++] = tris[j];
+            }
+        }
+        total += k;
+    }
+    if (npresent) qsort(present, npresent, sizeof(uint32_t), u32_cmp);
+
+    // table entries; slot[] becomes each trigram's start in ids[]
+    uint64_t start = 0;
+    for (size_t k = 0; k < npresent; k++) {
+        uint32_t t = present[k];
+        IdxTri e = { t, slot[t], 0 };
+        if (!bv_put(tab, &e, sizeof(e))) goto done;
+        slot[t] = (uint32_t)start;
+        start += e.count;
+    }
+    *ntris = npresent;
+
+    ids = (uint32_t*)malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!ids) goto done;
+    for (size_t i = 0; i < n; i++) {
+        size_t k = name_trigrams(v[i].s, v[i].len, tris);
+        for (size_t j = 0; j < k; j++) ids[slot[tris[j]]++] = v[i].id;
+    }
+
+    IdxTri *e = (IdxTri*)tab->p + (tab->len / sizeof(IdxTri) - *ntris);
+    size_t at = 0;
+    for (uint64_t k = 0; k < *ntris; k++, e++) {
+        e->off = post->len;
+        uint32_t last = 0;
+        for (uint32_t j = 0; j < e->count; j++, at++) {
+            uint8_t buf[5];
+            if (!bv_put(post, buf, put_varint(buf, ids[at] - last))) goto done;
+            last = ids[at];
+        }
+    }
+    ok = 1;
+
+done:
+    free(slot);
+    free(tris);
+    free(ids);
+    free(present);
+    return ok;
+}
+
+static int fwrite_section(FILE *f, uint64_t *pos, uint64_t *off, const void *p, size_t n) {
+    static const char zeros[8] = {0};
+    size_t pad = (size_t)((8 - (*pos & 7)) & 7);
+    if (pad && fwrite(zeros, 1, pad, f) != pad) return 0;
+    *pos += pad;
+    if (off) *off = *pos;
+    if (n && fwrite(p, 1, n, f) != n) return 0;
+    *pos += n;
+    return 1;
+}
+
+// Lays out what the workers collected and writes it to path (via path.tmp, so a
+// reader never sees a partial index). Returns bytes written, 0 on error.
+static uint64_t idx_write(Ctx *ctx, Worker *ws, int nw, const wchar_t *root, const wchar_t *path) {
+    uint32_t nd = (uint32_t)ctx->next_dir_id;
+    uint64_t written = 0;
+    BuildDir *bd = (BuildDir*)calloc(nd, sizeof(BuildDir));
+    uint32_t *kid_start = (uint32_t*)calloc((size_t)nd + 1, sizeof(uint32_t));
+    uint32_t *kids = (uint32_t*)malloc((size_t)nd * sizeof(uint32_t));
+    uint32_t *order = (uint32_t*)malloc((size_t)nd * sizeof(uint32_t));
+    uint32_t *newid = (uint32_t*)malloc((size_t)nd * sizeof(uint32_t));
+    IdxDir *out = (IdxDir*)calloc(nd, sizeof(IdxDir));
+    uint64_t *blocks = NULL;
+    NameRef *refs = NULL, *files = NULL, *dirrefs = NULL;
+    size_t refs_cap = 0, blocks_cap = 0, total_files = 0;
+    ByteVec dirnames = {0}, names = {0}, ftris = {0}, dtris = {0}, post = {0};
+    char *root8 = utf8_dup(root);
+    size_t plen = wcslen(path);
+    wchar_t *tmp = (wchar_t*)malloc((plen + 5) * sizeof(wchar_t));
+    FILE *f = NULL;
+    int created = 0;
+
+    if (!bd || !kid_start || !kids || !order || !newid || !out || !root8 || !tmp) goto done;
+    memcpy(tmp, path, plen * sizeof(wchar_t));
+    memcpy(tmp + plen, L".tmp", 5 * sizeof(wchar_t));
+    for (int i = 0; i < nw; i++) {
+        if (ws[i].ix.oom) goto done;
+        for (size_t k = 0; k < ws[i].ix.ndirs; k++) {
+            const IdxDirEnt *e = &ws[i].ix.dirs[k];
+            bd[e->id].name = ws[i].ix.dnames + e->name_off;
+            bd[e->id].name_len = e->name_len;
+            bd[e->id].parent = e->parent;
+        }
+        for (size_t k = 0; k < ws[i].ix.nruns; k++) {
+            const IdxRun *r = &ws[i].ix.runs[k];
+            bd[r->dir].files = ws[i].ix.bytes + r->off;
+            bd[r->dir].nfiles = r->nfiles;
+            bd[r->dir].mtime = r->mtime;
+            bd[r->dir].file_id = r->file_id;
+            total_files += r->nfiles;
+        }
+    }
+    files = (NameRef*)malloc((total_files ? total_files : 1) * sizeof(NameRef));
+    dirrefs = (NameRef*)malloc((size_t)nd * sizeof(NameRef));
+    if (!files || !dirrefs) goto done;
+
+    // children of each directory, sorted by name
+    for (uint32_t id = 1; id < nd; id++) kid_start[bd[id].parent + 1]++;
+    for (uint32_t id = 0; id < nd; id++) kid_start[id + 1] += kid_start[id];
+    {
+        uint32_t *fill = (uint32_t*)malloc((size_t)nd * sizeof(uint32_t));
+        if (!fill) goto done;
+        memcpy(fill, kid_start, (size_t)nd * sizeof(uint32_t));
+        for (uint32_t id = 1; id < nd; id++) kids[fill[bd[id].parent]++] = id;
+        free(fill);
+    }
+    for (uint32_t id = 0; id < nd; id++) {
+        uint32_t k0 = kid_start[id], k1 = kid_start[id + 1];
+        if (k1 - k0 < 2) continue;
+        if (!grow_array((void**)&refs, &refs_cap, k1 - k0, sizeof(NameRef))) goto done;
+        for (uint32_t k = k0; k < k1; k++) {
+            refs[k - k0].s = bd[kids[k]].name;
+            refs[k - k0].len = bd[kids[k]].name_len;
+            refs[k - k0].id = kids[k];
+        }
+        qsort(refs, k1 - k0, sizeof(NameRef), nameref_cmp);
+        for (uint32_t k = k0; k < k1; k++) kids[k] = refs[k - k0].id;
+    }
+
+    // breadth-first renumbering
+    uint32_t head = 0, tail = 0;
+    order[tail++] = 0;
+    while (head < tail) {
+        uint32_t id = order[head++];
+        for (uint32_t k = kid_start[id]; k < kid_start[id + 1]; k++) order[tail++] = kids[k];
+    }
+    for (uint32_t i = 0; i < tail; i++) newid[order[i]] = i;
+
+    // directory table, dir names and front-coded file names
+    uint64_t nfiles = 0;
+    for (uint32_t i = 0; i < tail; i++) {
+        uint32_t id = order[i];
+        IdxDir *o = &out[i];
+        o->parent = newid[bd[id].parent];
+        o->nchildren = kid_start[id + 1] - kid_start[id];
+        o->first_child = o->nchildren ? newid[kids[kid_start[id]]] : 0;
+        o->name_off = dirnames.len;
+        o->name_len = bd[id].name_len;
+        o->mtime = bd[id].mtime;
+        o->file_id = bd[id].file_id;
+        if (!bv_put(&dirnames, bd[id].name, bd[id].name_len)) goto done;
+
+        o->first_file = (uint32_t)nfiles;
+        o->nfiles = bd[id].nfiles;
+        if (!o->nfiles) continue;
+
+        NameRef *fr = files + nfiles;
+        const char *p = bd[id].files;
+        for (uint32_t k = 0; k < o->nfiles; k++) {
+            uint16_t l16;
+            memcpy(&l16, p, 2);
+            fr[k].s = p + 2;
+            fr[k].len = l16;
+            p += 2 + l16;
+        }
+        qsort(fr, o->nfiles, sizeof(NameRef), nameref_cmp);
+
+        for (uint32_t k = 0; k < o->nfiles; k++, nfiles++) {
+            NameRef *cur = &files[nfiles];
+            uint32_t pre = 0;
+            cur->id = (uint32_t)nfiles;
+            if (nfiles % IDX_BLOCK == 0) {
+                if (!grow_array((void**)&blocks, &blocks_cap, nfiles / IDX_BLOCK + 1, sizeof(uint64_t))) goto done;
+                blocks[nfiles / IDX_BLOCK] = names.len;
+            } else {
+                const NameRef *prev = cur - 1;
+                uint32_t lim = prev->len < cur->len ? prev->len : cur->len;
+                while (pre < lim && prev->s[pre] == cur->s[pre]) pre++;
+            }
+            uint8_t hdr[10];
+            size_t hn = put_varint(hdr, pre);
+            hn += put_varint(hdr + hn, cur->len - pre);
+            if (!bv_put(&names, hdr, hn) || !bv_put(&names, cur->s + pre, cur->len - pre)) goto done;
+        }
+    }
+
+    for (uint32_t i = 0; i < tail; i++) {
+        dirrefs[i].s = (const char*)dirnames.p + out[i].name_off;
+        dirrefs[i].len = out[i].name_len;
+        dirrefs[i].id = i;
+    }
+    uint64_t nftris, ndtris;
+    if (!build_trigrams(files, (size_t)nfiles, &ftris, &post, &nftris)) goto done;
+    if (!build_trigrams(dirrefs, tail, &dtris, &post, &ndtris)) goto done;
+
+    IdxHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IDX_MAGIC, 8);
+    h.version = IDX_VERSION;
+    h.block = IDX_BLOCK;
+    h.ndirs = tail;
+    h.nfiles = nfiles;
+    h.nblocks = (nfiles + IDX_BLOCK - 1) / IDX_BLOCK;
+    h.root_len = strlen(root8);
+    h.dirnames_len = dirnames.len;
+    h.names_len = names.len;
+    h.nftris = nftris;
+    h.ndtris = ndtris;
+    h.post_len = post.len;
+    h.sep = (uint32_t)PATH_SEP;
+
+    f = fopen_write(tmp);
+    if (!f) goto done;
+    created = 1;
+    uint64_t pos = 0;
+    if (!fwrite_section(f, &pos, NULL, &h, sizeof(h)) ||
+        !fwrite_section(f, &pos, &h.root_off, root8, (size_t)h.root_len) ||
+        !fwrite_section(f, &pos, &h.dirs_off, out, (size_t)tail * sizeof(IdxDir)) ||
+        !fwrite_section(f, &pos, &h.dirnames_off, dirnames.p, dirnames.len) ||
+        !fwrite_section(f, &pos, &h.blocks_off, blocks, (size_t)h.nblocks * sizeof(uint64_t)) ||
+        !fwrite_section(f, &pos, &h.names_off, names.p, names.len) ||
+        !fwrite_section(f, &pos, &h.ftris_off, ftris.p, ftris.len) ||
+        !fwrite_section(f, &pos, &h.dtris_off, dtris.p, dtris.len) ||
+        !fwrite_section(f, &pos, &h.post_off, post.p, post.len)) goto done;
+    if (fseek(f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, f) != 1) goto done;
+    int closed = fclose(f) == 0;
+    f = NULL;
+    if (closed && replace_file(tmp, path)) written = pos;
+
+done:
+    if (f) fclose(f);
+    if (created && !written) remove_file(tmp);
+    free(tmp);
+    free(bd);
+    free(kid_start);
+    free(kids);
+    free(order);
+    free(newid);
+    free(out);
+    free(blocks);
+    free(refs);
+    free(files);
+    free(dirrefs);
+    free(dirnames.p);
+    free(names.p);
+    free(ftris.p);
+    free(dtris.p);
+    free(post.p);
+    free(root8);
+    return written;
+}
+
+// ---- query ----
+
+static int idx_section_ok(const Index *ix, uint64_t off, uint64_t len) {
+    return off <= ix->size && len <= ix->size - off;
+}
+
+static int idx_open(Index *ix, const wchar_t *path) {
+    memset(ix, 0, sizeof(*ix));
+#ifdef _WIN32
+    ix->file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (ix->file == INVALID_HANDLE_VALUE) return 0;
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(ix->file, &sz) || sz.QuadPart < (LONGLONG)sizeof(IdxHeader)) return 0;
+    ix->map = CreateFileMappingW(ix->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!ix->map) return 0;
+    ix->base = (const uint8_t*)MapViewOfFile(ix->map, FILE_MAP_READ, 0, 0, 0);
+    if (!ix->base) return 0;
+    ix->size = (size_t)sz.QuadPart;
+#else
+    char p[PATH_CAP * 4];
+    if (!wide_to_utf8(p, sizeof(p), path)) return 0;
+    int fd = open(p, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(IdxHeader)) {
+        close(fd);
+        return 0;
+    }
+    void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return 0;
+    ix->base = (const uint8_t*)m;
+    ix->size = (size_t)st.st_size;
+#endif
+
+    const IdxHeader *h = ix->h = (const IdxHeader*)ix->base;
+    if (memcmp(h->magic, IDX_MAGIC, 8) != 0 || h->version != IDX_VERSION || h->block != IDX_BLOCK) return 0;
+    if (h->ndirs == 0 || h->ndirs > UINT32_MAX || h->nfiles > UINT32_MAX) return 0;
+    if (h->nblocks != (h->nfiles + IDX_BLOCK - 1) / IDX_BLOCK || h->nftris > ix->size || h->ndtris > ix->size) return 0;
+    if (!idx_section_ok(ix, h->root_off, h->root_len) ||
+        !idx_section_ok(ix, h->dirs_off, h->ndirs * sizeof(IdxDir)) ||
+        !idx_section_ok(ix, h->dirnames_off, h->dirnames_len) ||
+        !idx_section_ok(ix, h->blocks_off, h->nblocks * sizeof(uint64_t)) ||
+        !idx_section_ok(ix, h->names_off, h->names_len) ||
+        !idx_section_ok(ix, h->ftris_off, h->nftris * sizeof(IdxTri)) ||
+        !idx_section_ok(ix, h->dtris_off, h->ndtris * sizeof(IdxTri)) ||
+        !idx_section_ok(ix, h->post_off, h->post_len)) return 0;
+    ix->dirs = (const IdxDir*)(ix->base + h->dirs_off);
+    ix->dirnames = (const char*)(ix->base + h->dirnames_off);
+    ix->blocks = (const uint64_t*)(ix->base + h->blocks_off);
+    ix->names = ix->base + h->names_off;
+    ix->ftris = (const IdxTri*)(ix->base + h->ftris_off);
+    ix->dtris = (const IdxTri*)(ix->base + h->dtris_off);
+    ix->post = ix->base + h->post_off;
+    return 1;
+}
+
+static void idx_close(Index *ix) {
+#ifdef _WIN32
+    if (ix->base) UnmapViewOfFile(ix->base);
+    if (ix->map) CloseHandle(ix->map);
+    if (ix->file && ix->file != INVALID_HANDLE_VALUE) CloseHandle(ix->file);
+#else
+    if (ix->base) munmap((void*)ix->base, ix->size);
+#endif
+    memset(ix, 0, sizeof(*ix));
+}
+
+// Sequential decoder over the file names, starting anywhere.
+typedef struct {
+    const Index *ix;
+    const uint8_t *q, *end;
+    uint64_t fid;           // file the next call decodes
+    size_t len;
+    char name[IDX_NAME_MAX + 1];
+} IdxCursor;
+
+// decodes file c->fid into c->name; 0 past the last file or on corrupt data
+static int idx_cursor_next(IdxCursor *c) {
+    const IdxHeader *h = c->ix->h;
+    if (c->fid >= h->nfiles) return 0;
+    if (c->fid % IDX_BLOCK == 0) {
+        uint64_t b = c->fid / IDX_BLOCK;
+        uint64_t start = c->ix->blocks[b];
+        uint64_t end = b + 1 < h->nblocks ? c->ix->blocks[b + 1] : h->names_len;
+        if (start > end || end > h->names_len) return 0;
+        c->q = c->ix->names + start;
+        c->end = c->ix->names + end;
+        c->len = 0;
+    }
+    uint32_t pre, suf;
+    if (!get_varint(&c->q, c->end, &pre) || !get_varint(&c->q, c->end, &suf) ||
+        pre > c->len || pre + suf > IDX_NAME_MAX || suf > (size_t)(c->end - c->q)) return 0;
+    memcpy(c->name + pre, c->q, suf);
+    c->q += suf;
+    c->len = pre + suf;
+    c->name[c->len] = 0;
+    c->fid++;
+    return 1;
+}
+
+// positions c so the next call decodes file fid
+static int idx_cursor_seek(IdxCursor *c, const Index *ix, uint64_t fid) {
+    c->ix = ix;
+    c->fid = fid - fid % IDX_BLOCK;
+    c->len = 0;
+    while (c->fid < fid) {
+        if (!idx_cursor_next(c)) return 0;
+    }
+    return 1;
+}
+
+// name of directory d, NUL-terminated; returns its length, 0 if bad or too long
+static size_t idx_dir_name(const Index *ix, uint32_t d, char *out, size_t cap) {
+    const IdxDir *e = &ix->dirs[d];
+    if (!idx_section_ok(ix, ix->h->dirnames_off + e->name_off, e->name_len) || e->name_len + 1 > cap) return 0;
+    memcpy(out, ix->dirnames + e->name_off, e->name_len);
+    out[e->name_len] = 0;
+    return e->name_len;
+}
+
+// subdirectory of d called name, IDX_NONE if there is none
+static uint32_t idx_find_child(const Index *ix, uint32_t d, const char *name, size_t len) {
+    const IdxDir *e = &ix->dirs[d];
+    if (e->first_child > ix->h->ndirs || e->nchildren > ix->h->ndirs - e->first_child) return IDX_NONE;
+    uint32_t lo = e->first_child, hi = e->first_child + e->nchildren;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const IdxDir *m = &ix->dirs[mid];
+        if (!idx_section_ok(ix, ix->h->dirnames_off + m->name_off, m->name_len)) return IDX_NONE;
+        int c = bytes_cmp(ix->dirnames + m->name_off, m->name_len, name, len);
+        if (c == 0) return mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return IDX_NONE;
+}
+
+// Adding or removing an entry bumps a directory's mtime, so a directory with
+// the same mtime and file id still has the names recorded for it. Changes
+// further down show up in the subdirectories' own mtimes.
+static int idx_dir_unchanged(const Index *ix, uint32_t d, uint64_t mtime, uint64_t file_id) {
+    const IdxDir *e = &ix->dirs[d];
+    return mtime != 0 && e->mtime == mtime && e->file_id == file_id &&
+        e->first_child <= ix->h->ndirs && e->nchildren <= ix->h->ndirs - e->first_child;
+}
+
+// copies the files of directory d in the old index into this worker's collection
+static void idx_reuse_files(Worker *w, const Index *ix, uint32_t d) {
+    const IdxDir *e = &ix->dirs[d];
+    IdxCursor c;
+    if (!e->nfiles || !idx_cursor_seek(&c, ix, e->first_file)) return;
+    for (uint32_t k = 0; k < e->nfiles && idx_cursor_next(&c); k++) {
+        w->st.files++;
+        idx_add_file(w, c.name, c.len);
+    }
+}
+
+static wchar_t* idx_root_dup(const Index *ix) {
+    size_t n = (size_t)ix->h->root_len;
+    char *r = (char*)malloc(n + 1);
+    wchar_t *out = (wchar_t*)malloc((n + 1) * sizeof(wchar_t));
+    if (r && out) {
+        memcpy(r, ix->base + ix->h->root_off, n);
+        r[n] = 0;
+        if (utf8_to_wide(out, n + 1, r)) {
+            free(r);
+            return out;
+        }
+    }
+    free(r);
+    free(out);
+    return NULL;
+}
+
+// full path of directory d into out; returns its length, 0 if it does not fit
+static size_t idx_dir_path(const Index *ix, uint32_t d, char *out, size_t cap) {
+    uint32_t chain[1024];
+    size_t depth = 0;
+    while (d != 0) {
+        if (depth == ARRAYSIZE(chain) || d >= ix->h->ndirs) return 0;
+        chain[depth++] = d;
+        d = ix->dirs[d].parent;
+    }
+    size_t n = (size_t)ix->h->root_len;
+    if (n + 1 > cap) return 0;
+    memcpy(out, ix->base + ix->h->root_off, n);
+    while (depth) {
+        const IdxDir *e = &ix->dirs[chain[--depth]];
+        int needs_sep = n > 0 && out[n - 1] != (char)ix->h->sep && out[n - 1] != '/';
+        if (!idx_section_ok(ix, ix->h->dirnames_off + e->name_off, e->name_len) ||
+            n + needs_sep + e->name_len + 1 > cap) return 0;
+        if (needs_sep) out[n++] = (char)ix->h->sep;
+        memcpy(out + n, ix->dirnames + e->name_off, e->name_len);
+        n += e->name_len;
+    }
+    out[n] = 0;
+    return n;
+}
+
+// directory holding file id f (files are stored in directory order)
+static uint32_t idx_dir_of(const Index *ix, uint64_t f) {
+    uint32_t lo = 0, hi = (uint32_t)ix->h->ndirs;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ix->dirs[mid].first_file <= f) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// decodes file fid into c->name, moving forward within a block when it can
+static int idx_cursor_goto(IdxCursor *c, uint64_t fid) {
+    if (c->fid > fid || c->fid / IDX_BLOCK != fid / IDX_BLOCK) {
+        if (!idx_cursor_seek(c, c->ix, fid)) return 0;
+    }
+    while (c->fid < fid) {
+        if (!idx_cursor_next(c)) return 0;
+    }
+    return idx_cursor_next(c);
+}
+
+static const IdxTri* idx_tri_find(const IdxTri *tab, uint64_t n, uint32_t t) {
+    uint64_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (tab[mid].tri < t) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n && tab[lo].tri == t ? &tab[lo] : NULL;
+}
+
+// sets the bit of every id (below limit) in e's posting list
+static void idx_post_or(const Index *ix, const IdxTri *e, uint64_t *bits, uint64_t limit) {
+    if (!e || e->off > ix->h->post_len) return;
+    const uint8_t *p = ix->post + e->off, *end = ix->post + ix->h->post_len;
+    uint64_t id = 0;
+    for (uint32_t k = 0; k < e->count; k++) {
+        uint32_t delta;
+        if (!get_varint(&p, end, &delta)) return;
+        id += delta;
+        if (id >= limit) return;
+        bits[id >> 6] |= 1ull << (id & 63);
+    }
+}
+
+static void bits_set_range(uint64_t *bits, uint64_t lo, uint64_t hi) {
+    for (; lo < hi && (lo & 63); lo++) bits[lo >> 6] |= 1ull << (lo & 63);
+    for (; lo + 64 <= hi; lo += 64) bits[lo >> 6] = ~0ull;
+    for (; lo < hi; lo++) bits[lo >> 6] |= 1ull << (lo & 63);
+}
+
+static int has_trigram(const char *s, size_t n, uint32_t t) {
+    for (size_t i = 0; i + 2 < n; i++) {
+        if (IDX_TRI(s[i], s[i + 1], s[i + 2]) == t) return 1;
+    }
+    return 0;
+}
+
+// Bitmap of the files whose name (or, with full_path, whose path) holds every
+// trigram of the needle; only these can match. NULL when the needle has no
+// trigram to filter on, or on allocation failure: then every file is a candidate.
+//
+// A path's trigrams that do not span a separator lie within the root, a
+// directory name on the way down, or the file name. Directory hits are
+// inherited by subdirectories in one breadth-first pass (parents precede
+// children) and then cover each directory's contiguous range of files.
+static uint64_t* idx_candidates(const Index *ix, const Needle *nd, int full_path) {
+    const IdxHeader *h = ix->h;
+    size_t fwords = (size_t)(h->nfiles + 63) / 64 + 1;
+    size_t dwords = (size_t)(h->ndirs + 63) / 64;
+    const char *root = (const char*)ix->base + h->root_off;
+    uint32_t *tris = (uint32_t*)malloc((nd->len8 + 1) * sizeof(uint32_t));
+    uint64_t *cand = NULL, *cur = NULL, *dirs = NULL;
+    if (!tris) return NULL;
+
+    size_t ntris = name_trigrams((const char*)nd->folded8, nd->len8, tris);
+    for (size_t i = 0; i < ntris; i++) {
+        uint32_t t = tris[i];
+        if (full_path) {
+            uint8_t a = (uint8_t)(t >> 16), b = (uint8_t)(t >> 8), c = (uint8_t)t;
+            if (a == '/' || b == '/' || c == '/' || a == '\\' || b == '\\' || c == '\\') continue;
+            if (has_trigram(root, (size_t)h->root_len, t)) continue;
+        }
+
+        if (!cur) {
+            cur = (uint64_t*)malloc(fwords * sizeof(uint64_t));
+            if (full_path && !dirs) dirs = (uint64_t*)malloc(dwords * sizeof(uint64_t));
+            if (!cur || (full_path && !dirs)) {
+                free(cand);
+                cand = NULL;
+                break;
+            }
+        }
+        memset(cur, 0, fwords * sizeof(uint64_t));
+        idx_post_or(ix, idx_tri_find(ix->ftris, h->nftris, t), cur, h->nfiles);
+
+        if (full_path) {
+            memset(dirs, 0, dwords * sizeof(uint64_t));
+            idx_post_or(ix, idx_tri_find(ix->dtris, h->ndtris, t), dirs, h->ndirs);
+            for (uint64_t d = 1; d < h->ndirs; d++) {
+                uint64_t par = ix->dirs[d].parent;
+                if (par < d && (dirs[par >> 6] >> (par & 63) & 1)) dirs[d >> 6] |= 1ull << (d & 63);
+            }
+            for (uint64_t d = 0; d < h->ndirs; d++) {
+                const IdxDir *e = &ix->dirs[d];
+                if (!(dirs[d >> 6] >> (d & 63) & 1) || e->first_file > h->nfiles ||
+                    e->nfiles > h->nfiles - e->first_file) continue;
+                bits_set_range(cur, e->first_file, (uint64_t)e->first_file + e->nfiles);
+            }
+        }
+
+        if (!cand) {
+            cand = cur;
+            cur = NULL;
+        } else {
+            for (size_t k = 0; k < fwords; k++) cand[k] &= cur[k];
+        }
+    }
+
+    free(tris);
+    free(cur);
+    free(dirs);
+    return cand;
+}
+
+// several needles: the union of their candidates, NULL = all
+static uint64_t* idx_candidates_ac(const Index *ix, const AcAuto *ac, int full_path) {
+    size_t fwords = (size_t)(ix->h->nfiles + 63) / 64 + 1;
+    uint64_t *any = NULL;
+    for (uint32_t i = 0; i < ac->nneedles; i++) {
+        Needle nd;
+        uint64_t *c = needle_init(&nd, ac->text[i]) ? idx_candidates(ix, &nd, full_path) : NULL;
+        needle_free(&nd);
+        if (!c) {
+            free(any);
+            return NULL;
+        }
+        if (!any) {
+            any = c;
+            continue;
+        }
+        for (size_t k = 0; k < fwords; k++) any[k] |= c[k];
+        free(c);
+    }
+    return any;
+}
+
+// first candidate in [f, end), end if none
+static uint64_t idx_next_candidate(const uint64_t *cand, uint64_t f, uint64_t end) {
+    if (!cand) return f;
+    while (f < end) {
+        uint64_t bits = cand[f >> 6] >> (f & 63);
+        if (bits) {
+            f += ctz64(bits);
+            return f < end ? f : end;
+        }
+        f = (f | 63) + 1;
+    }
+    return end;
+}
+
+static THREAD_PROC idx_query_thread(void *p) {
+    Worker *w = (Worker*)p;
+    Ctx *ctx = w->ctx;
+    const Index *ix = ctx->ix;
+    const IdxHeader *h = ix->h;
+
+    IdxCursor c;
+    c.ix = ix;
+    c.fid = UINT64_MAX;
+    char full[PATH_CAP * 4];
+    size_t dlen = 0;
+    uint32_t dpath_of = IDX_NONE;   // directory currently in full[0..dlen)
+    double t_begin = ctx->stats ? now_seconds() : 0;
+
+    for (;;) {
+        if (ctx->q->stop) break;
+        uint64_t b0 = (uint64_t)ATOMIC_ADD64(&ctx->next_block, IDX_CHUNK);
+        if (b0 >= h->nblocks) break;
+        uint64_t f0 = b0 * IDX_BLOCK;
+        uint64_t f1 = (b0 + IDX_CHUNK) * IDX_BLOCK < h->nfiles ? (b0 + IDX_CHUNK) * IDX_BLOCK : h->nfiles;
+        uint32_t d = idx_dir_of(ix, f0);
+        if (ctx->trace) trace_dir_begin(w);
+
+        for (uint64_t fid = idx_next_candidate(ctx->cand, f0, f1); fid < f1;
+             fid = idx_next_candidate(ctx->cand, fid + 1, f1)) {
+            if (!idx_cursor_goto(&c, fid)) break;
+            const char *name = c.name;
+            size_t len = c.len;
+            while (d + 1 < h->ndirs && fid >= (uint64_t)ix->dirs[d].first_file + ix->dirs[d].nfiles) d++;
+            w->st.files++;
+            w->st.entries++;
+            w->st.name_bytes += (LONG64)len;
+
+            if (!ext_allowed8(&ctx->ext, name, len)) continue;
+            if (!ctx->match_full_path && !worker_match8(w, name, len)) continue;
+
+            if (dpath_of != d) {
+                dlen = idx_dir_path(ix, d, full, sizeof(full) - IDX_NAME_MAX - 2);
+                if (dlen && full[dlen - 1] != (char)h->sep && full[dlen - 1] != '/') full[dlen++] = (char)h->sep;
+                dpath_of = d;
+            }
+            if (!dlen) continue;
+            memcpy(full + dlen, name, len + 1);
+
+            if (ctx->match_full_path && !worker_match8(w, full, dlen + len)) continue;
+            if (!take_match(ctx)) break;
+            size_t flen = dlen + len;
+            if (ctx->ac) flen = ac_tag8(ctx->ac, &w->hits, full, flen, sizeof(full));
+            out_line_utf8(&w->out, &ctx->out_mu, full, flen);
+        }
+        if (ctx->flush_per_dir) out_flush(&w->out, &ctx->out_mu);
+        if (ctx->trace) {
+            // a span per chunk of file ids rather than per directory
+            char label[64];
+            int len = snprintf(label, sizeof(label), "files %llu..%llu",
+                               (unsigned long long)f0, (unsigned long long)f1 - 1);
+            trace_span(&w->trace, w->span_t0, now_seconds(), label, (size_t)len,
+                       (uint32_t)(w->st.entries - w->span_entries));
+        }
+    }
+
+    out_flush(&w->out, &ctx->out_mu);
+    if (ctx->stats) worker_stats_end(w, t_begin);
+    return 0;
+}
+
+// -------------------- worker --------------------
+
+// Full path of directory n into w->path with a trailing separator, built at
+// most once per directory and only when something needs it. Returns the
+// prefix length, 0 if the path does not fit.
+static size_t dir_prefix(Worker *w, const Node *n) {
+    if (w->path_of == n) return w->path_len;
+    w->path_of = n;
+    w->path_len = w->path_dir_len = 0;
+
+    size_t total = 0;
+    for (const Node *p = n; p; p = p->up) total += p->len + (p->up && !node_ends_with_sep(p->up));
+    if (total + 2 > PATH_CAP) return 0;
+
+    size_t at = total;
+    for (const Node *p = n; p; p = p->up) {
+        at -= p->len;
+        memcpy(w->path + at, p->name, p->len * sizeof(pchar));
+        if (p->up && !node_ends_with_sep(p->up)) w->path[--at] = PATH_SEP;
+    }
+    w->path_dir_len = total;
+    if (total > 0 && !node_ends_with_sep(n)) w->path[total++] = PATH_SEP;
+    w->path[total] = 0;
+    w->path_len = total;
+    return total;
+}
+
+// n's path below the root into w->ign_path, UTF-8 with a trailing '/' (empty
+// for the root), which ignore rules match against; SIZE_MAX if too long.
+static size_t ignore_dir_path(Worker *w, const Node *n) {
+    char name[1024];
+    size_t at = sizeof(w->ign_path);
+    for (const Node *p = n; p->up; p = p->up) {
+        if (p->len * 4 > sizeof(name)) return SIZE_MAX;
+        size_t k = pchar_utf8(name, p->name, p->len);
+        if (k + 1 > at) return SIZE_MAX;
+        w->ign_path[--at] = '/';
+        at -= k;
+        memcpy(w->ign_path + at, name, k);
+    }
+    size_t len = sizeof(w->ign_path) - at;
+    memmove(w->ign_path, w->ign_path + at, len);
+    return len;
+}
+
+// The rules for listing n: its own ignore files (text, read from files of
+// them; text needs a byte to spare) over the ones it was queued with.
+static void ignore_set(Worker *w, Node *n, char *text, size_t len, int files) {
+    w->ign = NULL;
+    w->ign_len = files || n->ign ? ignore_dir_path(w, n) : SIZE_MAX;
+    if (files && w->ign_len != SIZE_MAX) {
+        w->st.ignore_files += files;
+        w->ign = ignore_new(n->ign, text, len, w->ign_len);
+    }
+    if (!w->ign) w->ign = ignore_retain(n->ign);
+}
+
+// 1 if the entry called name (UTF-8) in the directory being listed is
+// ignored. ".git" always is.
+static int ignore_skip(Worker *w, const char *name, size_t len, int is_dir) {
+    if (len == 4 && memcmp(name, ".git", 4) == 0) return 1;
+    if (!w->ign || w->ign_len == SIZE_MAX || len > sizeof(w->ign_path) - w->ign_len) return 0;
+    memcpy(w->ign_path + w->ign_len, name, len);
+    size_t total = w->ign_len + len;
+    for (const Ignore *ig = w->ign; ig; ig = ig->up) {
+        for (size_t g = ig->ngroups; g-- > 0; ) {
+            const IgnoreGroup *e = &ig->groups[g];
+            if (e->dir_only && !is_dir) continue;
+            if (ignore_group_match(e, w->ign_path + ig->base, total - ig->base, name, len)) return !e->negate;
+        }
+    }
+    return 0;
+}
+
+static int meta_check(const MetaFilter *m, uint64_t size, int64_t mtime) {
+    if (m->size_op == '+' && size <= m->size) return 0;
+    if (m->size_op == '-' && size >= m->size) return 0;
+    if (m->size_op == '=' && size != m->size) return 0;
+    return !m->newer || mtime >= m->mtime_min;
+}
+
+#ifdef _WIN32
+
+// the listing already has size and time
+static int meta_allowed(Worker *w) {
+    const WIN32_FIND_DATAW *fd = w->ent;
+    uint64_t size = ((uint64_t)fd->nFileSizeHigh << 32) | fd->nFileSizeLow;
+    int64_t mtime = (int64_t)(((uint64_t)fd->ftLastWriteTime.dwHighDateTime << 32) | fd->ftLastWriteTime.dwLowDateTime);
+    return meta_check(&w->ctx->meta, size, mtime);
+}
+
+// --dupes, --du: the size; the listing has no file id, so hard links are not known
+static int entry_identity(Worker *w, uint64_t *size, uint64_t *dev, uint64_t *id) {
+    *size = ((uint64_t)w->ent->nFileSizeHigh << 32) | w->ent->nFileSizeLow;
+    *dev = *id = 0;
+    return 1;
+}
+
+#else
+
+static int g_no_statx;      // kernel without statx: fstatat instead
+
+// one statx asking for only what the filters need; symlinks are not followed
+static int meta_allowed(Worker *w) {
+    const MetaFilter *m = &w->ctx->meta;
+    uint64_t size;
+    int64_t mtime;
+    w->st.stat_calls++;
+#ifdef STATX_SIZE
+    if (!g_no_statx) {
+        struct statx sx;
+        unsigned mask = (m->size_op ? STATX_SIZE : 0) | (m->newer ? STATX_MTIME : 0);
+        if (statx(w->ent_dirfd, w->ent_raw, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, &sx) == 0) {
+            size = sx.stx_size;
+            mtime = (int64_t)sx.stx_mtime.tv_sec * 1000000000 + sx.stx_mtime.tv_nsec;
+            return meta_check(m, size, mtime);
+        }
+        if (errno != ENOSYS) return 0;
+        g_no_statx = 1;
+    }
+#endif
+    struct stat st;
+    if (fstatat(w->ent_dirfd, w->ent_raw, &st, AT_SYMLINK_NOFOLLOW) != 0) return 0;
+    size = (uint64_t)st.st_size;
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return meta_check(m, size, mtime);
+}
+
+// --dupes, --du: size, device and inode of the entry being visited; 0 if it is gone
+static int entry_identity(Worker *w, uint64_t *size, uint64_t *dev, uint64_t *id) {
+    w->st.stat_calls++;
+#ifdef STATX_SIZE
+    if (!g_no_statx) {
+        struct statx sx;
+        if (statx(w->ent_dirfd, w->ent_raw, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                  STATX_SIZE | STATX_INO, &sx) == 0) {
+            *size = sx.stx_size;
+            *dev = ((uint64_t)sx.stx_dev_major << 32) | sx.stx_dev_minor;
+            *id = sx.stx_ino;
+            return 1;
+        }
+        if (errno != ENOSYS) return 0;
+        g_no_statx = 1;
+    }
+#endif
+    struct stat st;
+    if (fstatat(w->ent_dirfd, w->ent_raw, &st, AT_SYMLINK_NOFOLLOW) != 0) return 0;
+    *size = (uint64_t)st.st_size;
+    *dev = (uint64_t)st.st_dev;
+    *id = (uint64_t)st.st_ino;
+    return 1;
+}
+
+#endif
+
+// The matchers and the line writer for pchar names: UTF-16 on Windows, the
+// bytes getdents64 returned on Linux, which are never converted.
+#ifdef _WIN32
+#define PNAME_EXT_ALLOWED ext_allowed
+#define PNAME_NEEDLE      needle_match
+#define PNAME_AC          ac_match
+#define PNAME_PAT         pat_match
+#define PNAME_AC_TAG      ac_tag
+#define PNAME_OUT_LINE    out_line
+#else
+#define PNAME_EXT_ALLOWED ext_allowed8
+#define PNAME_NEEDLE      needle_match8
+#define PNAME_AC          ac_match8
+#define PNAME_PAT         pat_match8
+#define PNAME_AC_TAG      ac_tag8
+#define PNAME_OUT_LINE    out_line_utf8
+#endif
+
+#ifndef _WIN32
+// the directory being listed as a DirFd for what is queued from it; made
+// once, on first need
+static DirFd* ent_dir_share(Worker *w) {
+    if (!w->ent_share_tried) {
+        w->ent_share = dirfd_share(w->ent_dirfd);
+        w->ent_share_tried = 1;
+    }
+    return w->ent_share;
+}
+#endif
+
+// -c: a file whose name matched waits on the file side of the queue for
+// its contents to be searched
+static void content_queue(Worker *w, const Node *n, const pchar *name, size_t nlen) {
+    Node *f = node_new(&w->arena, (Node*)n, name, nlen, 0, IDX_NONE);
+    if (!f) return;
+    f->file = 1;
+#ifndef _WIN32
+    f->parent = ent_dir_share(w);
+    if (f->parent) InterlockedIncrement(&f->parent->refs);
+#endif
+    if (!wq_push_file(w->ctx->q, &w->wq, f)) node_release(&w->arena, f);
+}
+
+// --dupes: records the file visited, whose path is w->path[0..flen);
+// empty files are left out
+static void dupe_add(Worker *w, size_t flen) {
+    DupeLocal *d = &w->dup;
+    DupeFile f;
+    if (d->oom || !entry_identity(w, &f.size, &f.dev, &f.id) || !f.size) return;
+    if (!grow_array((void**)&d->files, &d->files_cap, d->nfiles + 1, sizeof(DupeFile)) ||
+        !grow_array((void**)&d->paths, &d->paths_cap, d->npaths + flen + 1, sizeof(pchar))) {
+        d->oom = 1;
+        return;
+    }
+    f.hash = 0;
+    f.path = NULL;
+    f.path_off = d->npaths;
+    f.path_len = (uint32_t)flen;
+    memcpy(d->paths + d->npaths, w->path, flen * sizeof(pchar));
+    d->paths[d->npaths + flen] = 0;
+    d->npaths += flen + 1;
+    d->files[d->nfiles++] = f;
+}
+
+// --du: the size of the file visited counts toward its directory
+static void du_add(Worker *w) {
+    uint64_t size, dev, id;
+    if (!entry_identity(w, &size, &dev, &id)) return;
+    w->du.dir_bytes += size;
+    w->du.files++;
+}
+
+// where a match goes with -c, --dupes or --du
+static void visit_handoff(Worker *w, const Node *n, const pchar *name, size_t nlen, size_t flen) {
+    if (w->ctx->dupes) dupe_add(w, flen);
+    else if (w->ctx->du_top) du_add(w);
+    else content_queue(w, n, name, nlen);
+}
+
+// Per-file work, instantiated for every combination of options so the
+// checks for options not in use compile away. The directory's path is only
+// built for a hit, or for every file with -f. n is the name's directory.
+#define VISIT_MATCH(F, w, s, len) \
+    (((F) & VISIT_KIND) == VISIT_MULTI ? PNAME_AC((w)->ctx->ac, &(w)->hits, (s), (len)) > 0 : \
+     ((F) & VISIT_KIND) == VISIT_PATTERN ? PNAME_NEEDLE(&(w)->ctx->needle, (s), (len)) && \
+                                           PNAME_PAT((w)->ctx->pat, (s), (len)) : \
+     PNAME_NEEDLE(&(w)->ctx->needle, (s), (len)))
+
+#define DEFINE_VISIT(NAME, F) \
+static void NAME(Worker *w, const Node *n, const pchar *name, size_t nlen) { \
+    Ctx *ctx = w->ctx; \
+    if (((F) & VISIT_EXT) && !PNAME_EXT_ALLOWED(&ctx->ext, name, nlen)) return; \
+    if (!((F) & VISIT_FULL) && ((F) & VISIT_KIND) != VISIT_ALL && !VISIT_MATCH(F, w, name, nlen)) return; \
+    size_t dlen = dir_prefix(w, n); \
+    if (!dlen || dlen + nlen + 1 > PATH_CAP) return; \
+    memcpy(w->path + dlen, name, nlen * sizeof(pchar)); \
+    size_t flen = dlen + nlen; \
+    if (((F) & VISIT_FULL) && ((F) & VISIT_KIND) != VISIT_ALL && !VISIT_MATCH(F, w, w->path, flen)) return; \
+    if (((F) & VISIT_META) && !meta_allowed(w)) return; \
+    if ((F) & VISIT_HANDOFF) { \
+        visit_handoff(w, n, name, nlen, flen); \
+        return; \
+    } \
+    if (!take_match(ctx)) return; \
+    if (((F) & VISIT_KIND) == VISIT_MULTI) flen = PNAME_AC_TAG(ctx->ac, &w->hits, w->path, flen, PATH_CAP); \
+    PNAME_OUT_LINE(&w->out, &ctx->out_mu, w->path, flen); \
+}
+
+DEFINE_VISIT(visit_0, 0)    DEFINE_VISIT(visit_1, 1)    DEFINE_VISIT(visit_2, 2)    DEFINE_VISIT(visit_3, 3)
+DEFINE_VISIT(visit_4, 4)    DEFINE_VISIT(visit_5, 5)    DEFINE_VISIT(visit_6, 6)    DEFINE_VISIT(visit_7, 7)
+DEFINE_VISIT(visit_8, 8)    DEFINE_VISIT(visit_9, 9)    DEFINE_VISIT(visit_10, 10)  DEFINE_VISIT(visit_11, 11)
+DEFINE_VISIT(visit_12, 12)  DEFINE_VISIT(visit_13, 13)  DEFINE_VISIT(visit_14, 14)  DEFINE_VISIT(visit_15, 15)
+DEFINE_VISIT(visit_16, 16)  DEFINE_VISIT(visit_17, 17)  DEFINE_VISIT(visit_18, 18)  DEFINE_VISIT(visit_19, 19)
+DEFINE_VISIT(visit_20, 20)  DEFINE_VISIT(visit_21, 21)  DEFINE_VISIT(visit_22, 22)  DEFINE_VISIT(visit_23, 23)
+DEFINE_VISIT(visit_24, 24)  DEFINE_VISIT(visit_25, 25)  DEFINE_VISIT(visit_26, 26)  DEFINE_VISIT(visit_27, 27)
+DEFINE_VISIT(visit_28, 28)  DEFINE_VISIT(visit_29, 29)  DEFINE_VISIT(visit_30, 30)  DEFINE_VISIT(visit_31, 31)
+DEFINE_VISIT(visit_32, 32)  DEFINE_VISIT(visit_33, 33)  DEFINE_VISIT(visit_34, 34)  DEFINE_VISIT(visit_35, 35)
+DEFINE_VISIT(visit_36, 36)  DEFINE_VISIT(visit_37, 37)  DEFINE_VISIT(visit_38, 38)  DEFINE_VISIT(visit_39, 39)
+DEFINE_VISIT(visit_40, 40)  DEFINE_VISIT(visit_41, 41)  DEFINE_VISIT(visit_42, 42)  DEFINE_VISIT(visit_43, 43)
+DEFINE_VISIT(visit_44, 44)  DEFINE_VISIT(visit_45, 45)  DEFINE_VISIT(visit_46, 46)  DEFINE_VISIT(visit_47, 47)
+DEFINE_VISIT(visit_48, 48)  DEFINE_VISIT(visit_49, 49)  DEFINE_VISIT(visit_50, 50)  DEFINE_VISIT(visit_51, 51)
+DEFINE_VISIT(visit_52, 52)  DEFINE_VISIT(visit_53, 53)  DEFINE_VISIT(visit_54, 54)  DEFINE_VISIT(visit_55, 55)
+DEFINE_VISIT(visit_56, 56)  DEFINE_VISIT(visit_57, 57)  DEFINE_VISIT(visit_58, 58)  DEFINE_VISIT(visit_59, 59)
+DEFINE_VISIT(visit_60, 60)  DEFINE_VISIT(visit_61, 61)  DEFINE_VISIT(visit_62, 62)  DEFINE_VISIT(visit_63, 63)
+
+static const visit_fn k_visit[VISIT_VARIANTS] = {
+    visit_0, visit_1, visit_2, visit_3, visit_4, visit_5, visit_6, visit_7,
+    visit_8, visit_9, visit_10, visit_11, visit_12, visit_13, visit_14, visit_15,
+    visit_16, visit_17, visit_18, visit_19, visit_20, visit_21, visit_22, visit_23,
+    visit_24, visit_25, visit_26, visit_27, visit_28, visit_29, visit_30, visit_31,
+    visit_32, visit_33, visit_34, visit_35, visit_36, visit_37, visit_38, visit_39,
+    visit_40, visit_41, visit_42, visit_43, visit_44, visit_45, visit_46, visit_47,
+    visit_48, visit_49, visit_50, visit_51, visit_52, visit_53, visit_54, visit_55,
+    visit_56, visit_57, visit_58, visit_59, visit_60, visit_61, visit_62, visit_63,
+};
+
+static void push_node(Worker *w, Node *c) {
+    if (c && !wq_push(w->ctx->q, &w->wq, c)) node_release(&w->arena, c);
+}
+
+static void trace_dir_end(Worker *w, const Node *n) {
+    char path[PATH_CAP * 4];
+    size_t len = dir_prefix(w, n) ? pchar_utf8(path, w->path, w->path_dir_len) : 0;
+    trace_span(&w->trace, w->span_t0, now_seconds(), path, len, (uint32_t)(w->st.entries - w->span_entries));
+}
+
+static void du_sift_up(DuEntry *h, size_t i) {
+    for (; i && h[(i - 1) / 2].bytes > h[i].bytes; i = (i - 1) / 2) {
+        DuEntry t = h[i];
+        h[i] = h[(i - 1) / 2];
+        h[(i - 1) / 2] = t;
+    }
+}
+
+static void du_sift_down(DuEntry *h, size_t n, size_t i) {
+    for (;;) {
+        size_t m = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && h[l].bytes < h[m].bytes) m = l;
+        if (r < n && h[r].bytes < h[m].bytes) m = r;
+        if (m == i) return;
+        DuEntry t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+// --du: n and everything under it are done, so its total is final. It is
+// kept if it is among the heaviest this worker has seen; only then is its
+// path built.
+static void du_finished(Worker *w, const Node *n) {
+    DuLocal *d = &w->du;
+    uint64_t bytes = (uint64_t)n->du_bytes;
+    if (!n->up) w->ctx->du_total = bytes;
+    if (d->ntop == w->ctx->du_top && bytes <= d->top[0].bytes) return;
+
+    char path[PATH_CAP * 4];
+    w->path_of = NULL;
+    size_t len = dir_prefix(w, n) ? pchar_utf8(path, w->path, w->path_dir_len) : 0;
+    w->path_of = NULL;      // n is about to be freed
+    char *copy = len ? (char*)malloc(len + 1) : NULL;
+    if (!copy) return;
+    memcpy(copy, path, len);
+    copy[len] = 0;
+    if (d->ntop == w->ctx->du_top) {
+        free(d->top[0].path);
+        d->top[0].bytes = bytes;
+        d->top[0].path = copy;
+        du_sift_down(d->top, d->ntop, 0);
+    } else {
+        d->top[d->ntop].bytes = bytes;
+        d->top[d->ntop].path = copy;
+        du_sift_up(d->top, d->ntop++);
+    }
+}
+
+// node_release for a directory node; with --du each directory it frees is
+// ranked first
+static void dir_release(Worker *w, Node *n) {
+    if (!w->ctx->du_top) {
+        node_release(&w->arena, n);
+        return;
+    }
+    while (n && InterlockedDecrement(&n->refs) == 0) {
+        Node *up = n->up;
+        du_finished(w, n);
+        node_free(&w->arena, n);
+        n = up;
+    }
+}
+
+// end of one directory: in low-latency mode its matches go out now
+static void dir_finished(Worker *w, Node *n) {
+    if (w->ctx->trace) trace_dir_end(w, n);
+    ignore_release(w->ign);
+    w->ign = NULL;
+    if (w->du.dir_bytes) {
+        ATOMIC_ADD64(&n->du_bytes, (LONG64)w->du.dir_bytes);
+        w->du.dir_bytes = 0;
+    }
+    dir_release(w, n);
+    if (w->ctx->flush_per_dir) out_flush(&w->out, &w->ctx->out_mu);
+    wq_done_one(w->ctx->q, &w->wq);
+}
+
+#define CONTENT_BUF_SIZE (256 * 1024)
+
+#ifdef _WIN32
+
+// -c: 1 if file f holds the text. Read in buffers that keep the text's
+// length less one byte across each boundary; a mapping would turn a file
+// cut short under us into an exception plain C cannot catch.
+static int content_file(Worker *w, const Node *f) {
+    size_t dlen = dir_prefix(w, f->up);
+    if (!dlen || dlen + f->len + 1 > PATH_CAP) return 0;
+    memcpy(w->path + dlen, f->name, f->len * sizeof(pchar));
+    w->path[dlen + f->len] = 0;
+    HANDLE h = CreateFileW(w->path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (h == INVALID_HANDLE_VALUE) return 0;
+    const ContentText *c = w->ctx->content;
+    size_t keep = 0;
+    int hit = 0;
+    DWORD got;
+    while (!hit && ReadFile(h, w->cbuf + keep, (DWORD)(CONTENT_BUF_SIZE - keep), &got, NULL) && got) {
+        size_t have = keep + got;
+        w->st.content_bytes += got;
+        hit = c->find(c, w->cbuf, have);
+        keep = have < c->len - 1 ? have : c->len - 1;
+        memmove(w->cbuf, w->cbuf + have - keep, keep);
+    }
+    CloseHandle(h);
+    w->st.content_files++;
+    return hit;
+}
+
+#else
+
+#define CONTENT_OPEN_FLAGS (O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY | O_NONBLOCK)
+
+// A mapped file cut short under us raises SIGBUS on the pages past its new
+// end; the thread reading it jumps back out and the file counts as no match.
+static __thread sigjmp_buf *t_map_jmp;
+
+static void on_sigbus(int sig) {
+    if (t_map_jmp) siglongjmp(*t_map_jmp, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void content_catch_sigbus(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigbus;
+    sa.sa_flags = SA_NODEFER;
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+// The rest of a file that filled the first read: mapped and searched from
+// the text's length less one byte before where the read stopped. A file that
+// cannot be mapped is read on in buffers keeping the same overlap.
+static int content_rest(Worker *w, int fd, const ContentText *c) {
+    struct stat st;
+    size_t keep = c->len - 1, from = CONTENT_BUF_SIZE - keep;
+    if (fstat(fd, &st) != 0 || st.st_size <= CONTENT_BUF_SIZE) return 0;
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+        volatile int hit = 0;
+        sigjmp_buf jb;
+        madvise(map, size, MADV_SEQUENTIAL);
+        if (sigsetjmp(jb, 0) == 0) {
+            t_map_jmp = &jb;
+            hit = c->find(c, (const uint8_t*)map + from, size - from);
+        }
+        t_map_jmp = NULL;
+        munmap(map, size);
+        w->st.content_bytes += (LONG64)(size - CONTENT_BUF_SIZE);
+        return hit;
+    }
+    memmove(w->cbuf, w->cbuf + from, keep);
+    for (off_t off = CONTENT_BUF_SIZE;;) {
+        ssize_t got = pread(fd, w->cbuf + keep, CONTENT_BUF_SIZE - keep, off);
+        if (got <= 0) return 0;
+        off += got;
+        w->st.content_bytes += got;
+        size_t have = keep + (size_t)got;
+        if (c->find(c, w->cbuf, have)) return 1;
+        memmove(w->cbuf, w->cbuf + have - keep, keep);
+    }
+}
+
+// -c: 1 if file f holds the text. The first read takes in the whole of
+// nearly every file, so most cost an open, a read and a close.
+static int content_file(Worker *w, const Node *f) {
+    char path[PATH_CAP];
+    int fd;
+    if (f->parent) {
+        if (f->len + 1 > sizeof(path)) return 0;
+        memcpy(path, f->name, f->len);
+        path[f->len] = 0;
+        fd = openat(f->parent->fd, path, CONTENT_OPEN_FLAGS);
+    } else {
+        size_t dlen = dir_prefix(w, f->up);
+        if (!dlen || dlen + f->len + 1 > sizeof(path)) return 0;
+        memcpy(path, w->path, dlen);
+        memcpy(path + dlen, f->name, f->len);
+        path[dlen + f->len] = 0;
+        fd = open(path, CONTENT_OPEN_FLAGS);
+    }
+    if (fd < 0) return 0;
+    const ContentText *c = w->ctx->content;
+    ssize_t got = pread(fd, w->cbuf, CONTENT_BUF_SIZE, 0);
+    int hit = 0;
+    if (got > 0) {
+        w->st.content_bytes += got;
+        hit = c->find(c, w->cbuf, (size_t)got) || (got == CONTENT_BUF_SIZE && content_rest(w, fd, c));
+    }
+    close(fd);
+    w->st.content_files++;
+    return hit;
+}
+
+#endif
+
+// -c: a queued file's turn; printed if it holds the text
+static void content_search(Worker *w, Node *f) {
+    w->path_of = NULL;
+    if (!content_file(w, f) || !take_match(w->ctx)) return;
+    size_t dlen = dir_prefix(w, f->up);
+    if (!dlen || dlen + f->len + 1 > PATH_CAP) return;
+    memcpy(w->path + dlen, f->name, f->len * sizeof(pchar));
+    PNAME_OUT_LINE(&w->out, &w->ctx->out_mu, w->path, dlen + f->len);
+}
+
+static void file_finished(Worker *w, Node *f) {
+    node_release(&w->arena, f);
+    if (w->ctx->flush_per_dir) out_flush(&w->out, &w->ctx->out_mu);
+    wq_done_one(w->ctx->q, &w->wq);
+}
+
+#ifdef _WIN32
+
+static uint64_t dir_mtime(const wchar_t *dir) {
+    WIN32_FILE_ATTRIBUTE_DATA a;
+    if (!GetFileAttributesExW(dir, GetFileExInfoStandard, &a)) return 0;
+    return ((uint64_t)a.ftLastWriteTime.dwHighDateTime << 32) | a.ftLastWriteTime.dwLowDateTime;
+}
+
+// Directory unchanged since the previous index: take its files and
+// subdirectories from there instead of listing it.
+static void reuse_dir(Worker *w, Node *n, uint64_t mtime) {
+    Ctx *ctx = w->ctx;
+    const Index *ix = ctx->prev;
+    const IdxDir *e = &ix->dirs[n->prev];
+    wchar_t name[IDX_NAME_MAX + 1];
+    char raw[IDX_NAME_MAX + 1];
+
+    idx_dir_begin(w, n->id, mtime, 0);
+    idx_reuse_files(w, ix, n->prev);
+    for (uint32_t k = 0; k < e->nchildren; k++) {
+        uint32_t c = e->first_child + k;
+        size_t rawlen = idx_dir_name(ix, c, raw, sizeof(raw));
+        size_t nlen = rawlen ? utf8_to_wide(name, ARRAYSIZE(name), raw) : 0;
+        if (!nlen) continue;
+        if (ctx->prune && pat_set_match8(ctx->prune, raw, rawlen)) {
+            w->st.pruned++;
+            continue;
+        }
+        uint32_t id = idx_add_dir(w, n->id, raw, rawlen);
+        push_node(w, node_new(&w->arena, n, name, nlen, id, c));
+    }
+    InterlockedIncrement64(&ctx->dirs_reused);
+}
+
+// Appends the file at path to *buf, then a newline; 1 if it was there.
+static int ignore_read(const wchar_t *path, char **buf, size_t *len, size_t *cap) {
+    FILE *f = fopen_read(path);
+    if (!f) return 0;
+    int ok = grow_array((void**)buf, cap, *len + 2, 1);
+    while (ok && *len < IGNORE_FILE_MAX && grow_array((void**)buf, cap, *len + 4096 + 2, 1)) {
+        size_t got = fread(*buf + *len, 1, 4096, f);
+        *len += got;
+        if (got < 4096) break;
+    }
+    fclose(f);
+    if (ok) (*buf)[(*len)++] = '\n';
+    return ok;
+}
+
+// --respect-ignore: the rules for listing n
+static void ignore_enter(Worker *w, Node *n) {
+    static const wchar_t *const k_files[] = { L".gitignore", L".ignore" };
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    int files = 0;
+    size_t dlen = dir_prefix(w, n);
+    for (size_t i = 0; dlen && i < ARRAYSIZE(k_files); i++) {
+        wchar_t keep = w->path[dlen];
+        if (dlen + wcslen(k_files[i]) + 1 > PATH_CAP) break;
+        wcscpy(w->path + dlen, k_files[i]);
+        files += ignore_read(w->path, &buf, &len, &cap);
+        w->path[dlen] = keep;
+    }
+    ignore_set(w, n, buf, len, files);
+    free(buf);
+}
+
+static BOOL find_next(Worker *w, HANDLE h, WIN32_FIND_DATAW *fd) {
+    if (!w->ctx->stats) return FindNextFileW(h, fd);
+    double t0 = now_seconds();
+    BOOL ok = FindNextFileW(h, fd);
+    w->st.list += now_seconds() - t0;
+    return ok;
+}
+
+static THREAD_PROC worker_thread(void *p) {
+    Worker *w = (Worker*)p;
+    Ctx *ctx = w->ctx;
+
+    wchar_t glob[PATH_CAP];
+    double t_begin = ctx->stats ? now_seconds() : 0;
+
+    for (;;) {
+        double t0 = ctx->stats ? now_seconds() : 0;
+        Node *n = wq_pop(ctx->q, &w->wq);
+        if (ctx->stats) w->st.wait += now_seconds() - t0;
+        if (!n) break;
+        if (n->file) {
+            content_search(w, n);
+            file_finished(w, n);
+            continue;
+        }
+
+        w->st.dirs++;
+        if (ctx->trace) trace_dir_begin(w);
+
+        w->path_of = NULL;
+        size_t dlen = dir_prefix(w, n);
+        if (!dlen) {
+            // path too long for our buffer: skip (upgrade later with dynamic buffers/\\?\)
+            dir_finished(w, n);
+            continue;
+        }
+
+        // Win32 has no file id in the listing; mtime alone decides
+        uint64_t mtime = 0;
+        if (ctx->build_index) {
+            wchar_t keep = w->path[w->path_dir_len];
+            w->path[w->path_dir_len] = 0;
+            mtime = dir_mtime(w->path);
+            w->path[w->path_dir_len] = keep;
+        }
+        if (n->prev != IDX_NONE && idx_dir_unchanged(ctx->prev, n->prev, mtime, 0)) {
+            reuse_dir(w, n, mtime);
+            dir_finished(w, n);
+            continue;
+        }
+
+        // dir + "*" pattern
+        memcpy(glob, w->path, dlen * sizeof(wchar_t));
+        glob[dlen] = L'*';
+        glob[dlen + 1] = 0;
+
+        WIN32_FIND_DATAW fd;
+        if (ctx->stats) t0 = now_seconds();
+        HANDLE h = FindFirstFileW(glob, &fd);
+        if (ctx->stats) w->st.list += now_seconds() - t0;
+        if (h == INVALID_HANDLE_VALUE) {
+            dir_finished(w, n);
+            continue;
+        }
+        if (ctx->build_index) idx_dir_begin(w, n->id, mtime, 0);
+        if (ctx->ignore) ignore_enter(w, n);
+        w->ent = &fd;
+
+        do {
+            const wchar_t *name = fd.cFileName;
+            if (is_dot_or_dotdot(name)) continue;
+            size_t nlen = wcslen(name);
+            w->st.entries++;
+            w->st.name_bytes += (LONG64)(nlen * sizeof(wchar_t));
+            int is_dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+            // --exclude-dir: the name alone decides, before any allocation
+            if (is_dir && ctx->prune && pat_set_match(ctx->prune, name, nlen)) {
+                w->st.pruned++;
+                continue;
+            }
+            if (ctx->ignore) {
+                char u8[MAX_PATH * 4];
+                if (ignore_skip(w, u8, utf8_encode(u8, name, nlen), is_dir)) {
+                    w->st.ignored++;
+                    continue;
+                }
+            }
+
+            if (is_dir) {
+                // avoid cycles via junctions/symlinks
+                if (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+                    w->st.files++;
+                    if ((ctx->kinds & KIND_LINK) && !ctx->build_index) w->visit(w, n, name, nlen);
+                    continue;
+                }
+
+                // enqueue subdir
+                uint32_t id = 0, prev = IDX_NONE;
+                if (ctx->build_index) {
+                    char u8[MAX_PATH * 4];
+                    size_t u8len = utf8_encode(u8, name, nlen);
+                    id = idx_add_dir(w, n->id, u8, u8len);
+                    if (n->prev != IDX_NONE) prev = idx_find_child(ctx->prev, n->prev, u8, u8len);
+                }
+                Node *c = node_new(&w->arena, n, name, nlen, id, prev);
+                if (c) c->ign = ignore_retain(w->ign);
+                push_node(w, c);
+                if (ctx->kinds & KIND_DIR) w->visit(w, n, name, nlen);
+            } else {
+                // counted whatever --type asks for, so runs compare
+                w->st.files++;
+                if (ctx->build_index) {
+                    idx_add_file_w(w, name, nlen);
+                } else if (ctx->kinds & (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT ? KIND_LINK : KIND_FILE)) {
+                    w->visit(w, n, name, nlen);
+                }
+            }
+
+        } while (!ctx->q->stop && find_next(w, h, &fd));
+
+        FindClose(h);
+        dir_finished(w, n);
+    }
+
+    out_flush(&w->out, &ctx->out_mu);
+    if (ctx->stats) worker_stats_end(w, t_begin);
+    return 0;
+}
+
+#else
+
+#define DENTS_BUF_SIZE (256 * 1024)
+#define DIR_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int open_node_dir(Worker *w, const Node *n) {
+    char path[PATH_CAP];
+    if (n->parent) {
+        if (n->len + 1 > sizeof(path)) return -1;
+        memcpy(path, n->name, n->len);
+        path[n->len] = 0;
+        return openat(n->parent->fd, path, DIR_OPEN_FLAGS);
+    }
+
+    if (!dir_prefix(w, n)) return -1;
+    memcpy(path, w->path, w->path_dir_len);
+    path[w->path_dir_len] = 0;
+    return open(path, DIR_OPEN_FLAGS);
+}
+
+#ifdef HAVE_IO_URING
+
+// With -q, a child directory is opened through the worker's ring and only
+// queued once its fd is there: up to depth opens per worker are outstanding
+// while the thread goes on listing and matching. The node counts as pending
+// from the start, so the walk cannot finish under it.
+
+// an open is over: the node is queued with its fd, or without to be retried
+static void prefetch_done(Worker *w, Node *c, int res) {
+    if (res >= 0) {
+        c->fd = res;
+        dirfd_release(c->parent);
+        c->parent = NULL;
+    } else {
+        // not counted after all; the worker retries with openat and skips it
+        InterlockedDecrement(&g_fds_retained);
+    }
+    if (!wq_push_reserved(w->ctx->q, &w->wq, c)) dir_release(w, c);
+}
+
+// The ring failed: the opens still in flight are queued as failed, to be
+// retried with openat, and the worker goes on without the ring.
+static void prefetch_off(Worker *w) {
+    Uring *r = &w->ring;
+    for (unsigned s = 0; s < r->depth; s++) {
+        if (r->slots[s].node) prefetch_done(w, r->slots[s].node, -1);
+    }
+    uring_free(r);
+}
+
+static void prefetch_reap(Worker *w, int wait) {
+    Uring *r = &w->ring;
+    int ok = !(r->to_submit || wait) || uring_enter(r, wait);
+
+    struct io_uring_cqe *e;
+    while ((e = uring_cqe(r)) != NULL) {
+        unsigned s = (unsigned)e->user_data;
+        int res = e->res;
+        uring_cqe_seen(r);
+        Node *c = r->slots[s].node;
+        r->slots[s].node = NULL;
+        r->free_slots[r->nfree++] = s;
+        prefetch_done(w, c, res);
+    }
+    if (!ok) prefetch_off(w);
+}
+
+static int prefetch_open(Worker *w, Node *c, const char *raw, size_t rawlen) {
+    Uring *r = &w->ring;
+    if (r->fd < 0 || !c->parent || rawlen >= URING_NAME_MAX) return 0;
+    if (ATOMIC_LOAD_RLX(&g_fds_retained) >= g_fd_budget) return 0;
+    if (!r->nfree) prefetch_reap(w, 1);
+    if (!r->nfree) return 0;
+
+    unsigned s = r->free_slots[--r->nfree];
+    r->slots[s].node = c;
+    memcpy(r->slots[s].name, raw, rawlen);
+    r->slots[s].name[rawlen] = 0;
+
+    struct io_uring_sqe *e = uring_sqe(r);
+    e->opcode = IORING_OP_OPENAT;
+    e->fd = c->parent->fd;
+    e->addr = (uint64_t)(uintptr_t)r->slots[s].name;
+    e->open_flags = DIR_OPEN_FLAGS;
+    e->user_data = s;
+    uring_queue(r);
+    wq_reserve(w->ctx->q, &w->wq);
+    InterlockedIncrement(&g_fds_retained);
+    return 1;
+}
+
+static void prefetch_submit(Worker *w) {
+    if (w->ring.to_submit && !uring_enter(&w->ring, 0)) prefetch_off(w);
+}
+
+// Next directory. With opens in flight the worker must not wait in wq_pop:
+// only it can turn them into queued nodes. A failed ring ends the loop, as
+// prefetch_off leaves depth 0.
+static Node* worker_pop(Worker *w) {
+    Uring *r = &w->ring;
+    while (r->nfree < r->depth) {
+        prefetch_reap(w, 0);
+        Node *n = wq_try_pop(w->ctx->q, &w->wq);
+        if (n) return n;
+        if (r->nfree < r->depth) prefetch_reap(w, 1);
+    }
+    return wq_pop(w->ctx->q, &w->wq);
+}
+
+#else
+
+static int prefetch_open(Worker *w, Node *c, const char *raw, size_t rawlen) {
+    (void)w; (void)c; (void)raw; (void)rawlen;
+    return 0;
+}
+
+static void prefetch_submit(Worker *w) {
+    (void)w;
+}
+
+static Node* worker_pop(Worker *w) {
+    return wq_pop(w->ctx->q, &w->wq);
+}
+
+#endif
+
+static void push_child(Worker *w, Node *up, DirFd *fd, const char *raw, size_t rawlen,
+                       uint32_t id, uint32_t prev) {
+    Node *c = node_new(&w->arena, up, raw, rawlen, id, prev);
+    if (!c) return;
+    c->ign = ignore_retain(w->ign);
+    if (fd) {
+        c->parent = fd;
+        InterlockedIncrement(&fd->refs);
+    }
+    if (!prefetch_open(w, c, raw, rawlen)) push_node(w, c);
+}
+
+// Appends dirfd's file called name to *buf, then a newline; 1 if it was there.
+static int ignore_read_at(int dirfd, const char *name, char **buf, size_t *len, size_t *cap) {
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return 0;
+    int ok = grow_array((void**)buf, cap, *len + 2, 1);
+    while (ok && *len < IGNORE_FILE_MAX && grow_array((void**)buf, cap, *len + 4096 + 2, 1)) {
+        ssize_t got = read(fd, *buf + *len, 4096);
+        if (got <= 0) break;
+        *len += (size_t)got;
+    }
+    close(fd);
+    if (ok) (*buf)[(*len)++] = '\n';
+    return ok;
+}
+
+// --respect-ignore: the rules for listing n. The first getdents64 batch
+// nearly always holds the whole directory, so its ignore files are looked
+// for there and only opened when present; a batch that may be followed by
+// more means trying both.
+static void ignore_enter(Worker *w, Node *n, int fd, const char *dents, long got) {
+    int want_git = DENTS_BUF_SIZE - got < 4096, want_ign = want_git;
+    for (long off = 0; off < got && !(want_git && want_ign); ) {
+        const struct linux_dirent64 *d = (const struct linux_dirent64*)(dents + off);
+        off += d->d_reclen;
+        if (d->d_name[0] != '.') continue;
+        if (strcmp(d->d_name, ".gitignore") == 0) want_git = 1;
+        else if (strcmp(d->d_name, ".ignore") == 0) want_ign = 1;
+    }
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    int files = 0;
+    if (want_git) files += ignore_read_at(fd, ".gitignore", &buf, &len, &cap);
+    if (want_ign) files += ignore_read_at(fd, ".ignore", &buf, &len, &cap);
+    ignore_set(w, n, buf, len, files);
+    free(buf);
+}
+
+// Directory unchanged since the previous index: take its files and
+// subdirectories from there instead of reading it. Returns the DirFd the
+// queued children hold, if any.
+static DirFd* reuse_dir(Worker *w, Node *n, int fd, uint64_t mtime, uint64_t file_id) {
+    Ctx *ctx = w->ctx;
+    const Index *ix = ctx->prev;
+    const IdxDir *e = &ix->dirs[n->prev];
+    DirFd *self = e->nchildren ? dirfd_share(fd) : NULL;
+    char raw[IDX_NAME_MAX + 1];
+
+    idx_dir_begin(w, n->id, mtime, file_id);
+    idx_reuse_files(w, ix, n->prev);
+    for (uint32_t k = 0; k < e->nchildren; k++) {
+        uint32_t c = e->first_child + k;
+        size_t rawlen = idx_dir_name(ix, c, raw, sizeof(raw));
+        if (!rawlen) continue;
+        if (ctx->prune && pat_set_match8(ctx->prune, raw, rawlen)) {
+            w->st.pruned++;
+            continue;
+        }
+        uint32_t id = idx_add_dir(w, n->id, raw, rawlen);
+        push_child(w, n, self, raw, rawlen, id, c);
+    }
+    InterlockedIncrement64(&ctx->dirs_reused);
+    return self;
+}
+
+static THREAD_PROC worker_thread(void *p) {
+    Worker *w = (Worker*)p;
+    Ctx *ctx = w->ctx;
+
+    char *dents = (char*)malloc(DENTS_BUF_SIZE);
+    if (!dents) return 0;
+#ifdef HAVE_IO_URING
+    w->ring.fd = -1;
+    if (ctx->io_depth > 0 && uring_init(&w->ring, (unsigned)ctx->io_depth)) InterlockedIncrement(&ctx->io_rings);
+#endif
+    double t_begin = ctx->stats ? now_seconds() : 0;
+
+    for (;;) {
+        double t0 = ctx->stats ? now_seconds() : 0;
+        Node *n = worker_pop(w);
+        if (ctx->stats) w->st.wait += now_seconds() - t0;
+        if (!n) break;
+        if (n->file) {
+            content_search(w, n);
+            file_finished(w, n);
+            continue;
+        }
+
+        w->st.dirs++;
+        if (ctx->trace) trace_dir_begin(w);
+
+        w->path_of = NULL;
+        int fd = n->fd;
+        if (fd >= 0) {
+            // opened through the ring; from here on it is ours like any other
+            n->fd = -1;
+            InterlockedDecrement(&g_fds_retained);
+        } else {
+            if (ctx->stats) t0 = now_seconds();
+            fd = open_node_dir(w, n);
+            if (ctx->stats) w->st.list += now_seconds() - t0;
+        }
+        // the parent's fd is only needed to open this one
+        dirfd_release(n->parent);
+        n->parent = NULL;
+        if (fd < 0) {
+            dir_finished(w, n);
+            continue;
+        }
+
+        // what is queued from here references this fd; shared on first need
+        w->ent_dirfd = fd;
+        w->ent_share = NULL;
+        w->ent_share_tried = 0;
+        int ign_read = 0;
+
+        int reused = 0;
+        if (ctx->build_index) {
+            struct stat st;
+            uint64_t mtime = 0, file_id = 0;
+            if (fstat(fd, &st) == 0) {
+                mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+                file_id = (uint64_t)st.st_ino;
+            }
+            if (n->prev != IDX_NONE && idx_dir_unchanged(ctx->prev, n->prev, mtime, file_id)) {
+                w->ent_share = reuse_dir(w, n, fd, mtime, file_id);
+                w->ent_share_tried = 1;
+                reused = 1;
+            } else {
+                idx_dir_begin(w, n->id, mtime, file_id);
+            }
+        }
+
+        while (!reused && !ctx->q->stop) {
+            if (ctx->stats) t0 = now_seconds();
+            long got = syscall(SYS_getdents64, fd, dents, DENTS_BUF_SIZE);
+            if (ctx->stats) w->st.list += now_seconds() - t0;
+            if (got <= 0) break;
+            if (ctx->ignore && !ign_read) {
+                ignore_enter(w, n, fd, dents, got);
+                ign_read = 1;
+            }
+
+            for (long off = 0; off < got; ) {
+                struct linux_dirent64 *d = (struct linux_dirent64*)(dents + off);
+                off += d->d_reclen;
+
+                const char *raw = d->d_name;
+                if (is_dot_or_dotdot_u8(raw)) continue;
+                size_t rawlen = strlen(raw);
+                w->st.entries++;
+                w->st.name_bytes += (LONG64)rawlen;
+
+                unsigned char type = d->d_type;
+                if (type == DT_UNKNOWN) {
+                    // some filesystems do not fill d_type
+                    struct stat st;
+                    if (fstatat(fd, raw, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                    type = IFTODT(st.st_mode);
+                }
+                w->ent_raw = raw;
+
+                // --exclude-dir: the name alone decides, before any allocation
+                if (type == DT_DIR && ctx->prune && pat_set_match8(ctx->prune, raw, rawlen)) {
+                    w->st.pruned++;
+                    continue;
+                }
+                if (ctx->ignore && ignore_skip(w, raw, rawlen, type == DT_DIR)) {
+                    w->st.ignored++;
+                    continue;
+                }
+
+                // symlinks are never followed (DT_LNK is reported as a file)
+                if (type == DT_DIR) {
+                    uint32_t id = 0, prev = IDX_NONE;
+                    if (ctx->build_index) {
+                        id = idx_add_dir(w, n->id, raw, rawlen);
+                        if (n->prev != IDX_NONE) prev = idx_find_child(ctx->prev, n->prev, raw, rawlen);
+                    }
+                    push_child(w, n, ent_dir_share(w), raw, rawlen, id, prev);
+                    if (ctx->kinds & KIND_DIR) w->visit(w, n, raw, rawlen);
+                } else {
+                    // counted whatever --type asks for, so runs compare
+                    w->st.files++;
+                    if (ctx->build_index) {
+                        idx_add_file(w, raw, rawlen);
+                    } else if (ctx->kinds & (type == DT_REG ? KIND_FILE : type == DT_LNK ? KIND_LINK : KIND_OTHER)) {
+                        w->visit(w, n, raw, rawlen);
+                    }
+                }
+            }
+            prefetch_submit(w);
+        }
+        prefetch_submit(w);
+
+        if (w->ent_share) dirfd_release(w->ent_share);
+        else close(fd);
+        dir_finished(w, n);
+    }
+
+    free(dents);
+#ifdef HAVE_IO_URING
+    uring_free(&w->ring);
+#endif
+    out_flush(&w->out, &ctx->out_mu);
+    if (ctx->stats) worker_stats_end(w, t_begin);
+    return 0;
+}
+
+#endif
+
+// -------------------- duplicates (--dupes) --------------------
+//
+// The walk records each matching file's size (and on Linux its device and
+// inode) with its path. Once it is over, files whose size no other file has
+// are dropped, and so are further links to an inode already recorded. The
+// rest are hashed on their first and last DUPE_EDGE bytes; files that still
+// agree with another are hashed whole; files that agree then are reported.
+// Every step sorts one array by (size, hash) and keeps the runs of two or
+// more. The passes share the walk's threads through an atomic cursor, so
+// big files and small ones spread over them evenly.
+
+#define DUPE_EDGE  4096
+#define DUPE_CHUNK 16       // files a thread takes from a pass at a time
+
+// XXH64: 32-byte stripes through four multiply-rotate lanes, so a whole-file
+// pass runs at memory speed
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    uint8_t buf[32];
+    size_t nbuf;
+} Xxh64;
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t in) {
+    return xxh_rotl(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t h, uint64_t v) {
+    return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(Xxh64 *s) {
+    s->v[0] = XXH_P1 + XXH_P2;
+    s->v[1] = XXH_P2;
+    s->v[2] = 0;
+    s->v[3] = 0 - XXH_P1;
+    s->total = 0;
+    s->nbuf = 0;
+}
+
+static void xxh64_stripe(Xxh64 *s, const uint8_t *p) {
+    for (int i = 0; i < 4; i++) s->v[i] = xxh_round(s->v[i], xxh_read64(p + 8 * i));
+}
+
+static void xxh64_update(Xxh64 *s, const uint8_t *p, size_t n) {
+    s->total += n;
+    if (s->nbuf + n < 32) {
+        memcpy(s->buf + s->nbuf, p, n);
+        s->nbuf += n;
+        return;
+    }
+    if (s->nbuf) {
+        size_t k = 32 - s->nbuf;
+        memcpy(s->buf + s->nbuf, p, k);
+        xxh64_stripe(s, s->buf);
+        p += k;
+        n -= k;
+    }
+    for (; n >= 32; p += 32, n -= 32) xxh64_stripe(s, p);
+    memcpy(s->buf, p, n);
+    s->nbuf = n;
+}
+
+static uint64_t xxh64_digest(const Xxh64 *s) {
+    uint64_t h;
+    if (s->total >= 32) {
+        h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7) + xxh_rotl(s->v[2], 12) + xxh_rotl(s->v[3], 18);
+        for (int i = 0; i < 4; i++) h = xxh_merge(h, s->v[i]);
+    } else {
+        h = s->v[2] + XXH_P5;
+    }
+    h += s->total;
+    const uint8_t *p = s->buf;
+    size_t n = s->nbuf;
+    for (; n >= 8; p += 8, n -= 8) h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (n >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h = xxh_rotl(h ^ (uint64_t)v * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n; p++, n--) h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    return h ^ (h >> 32);
+}
+
+#ifdef _WIN32
+
+typedef HANDLE InFile;
+#define IN_FILE_NONE INVALID_HANDLE_VALUE
+
+static InFile in_open(const pchar *path) {
+    return CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+}
+
+// bytes read at off, 0 at the end, -1 on error
+static long long in_read_at(InFile h, uint8_t *buf, size_t n, uint64_t off) {
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)off;
+    ov.OffsetHigh = (DWORD)(off >> 32);
+    DWORD got;
+    if (!ReadFile(h, buf, (DWORD)n, &got, &ov)) return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    return got;
+}
+
+static void in_close(InFile h) {
+    CloseHandle(h);
+}
+
+#else
+
+typedef int InFile;
+#define IN_FILE_NONE (-1)
+
+static InFile in_open(const pchar *path) {
+    return open(path, CONTENT_OPEN_FLAGS);
+}
+
+static long long in_read_at(InFile fd, uint8_t *buf, size_t n, uint64_t off) {
+    return pread(fd, buf, n, (off_t)off);
+}
+
+static void in_close(InFile fd) {
+    close(fd);
+}
+
+#endif
+
+// f->hash for a pass; 0 if the file could not be read as it was listed
+static int dupe_hash_file(Worker *w, DupeFile *f, int full) {
+    InFile h = in_open(f->path);
+    if (h == IN_FILE_NONE) return 0;
+    Xxh64 s;
+    xxh64_init(&s);
+    int ok = 1;
+    if (!full && f->size > 2 * DUPE_EDGE) {
+        ok = in_read_at(h, w->cbuf, DUPE_EDGE, 0) == DUPE_EDGE &&
+             in_read_at(h, w->cbuf + DUPE_EDGE, DUPE_EDGE, f->size - DUPE_EDGE) == DUPE_EDGE;
+        if (ok) xxh64_update(&s, w->cbuf, 2 * DUPE_EDGE);
+        w->st.hash_bytes += 2 * DUPE_EDGE;
+    } else {
+        uint64_t off = 0;
+        long long got;
+        while ((got = in_read_at(h, w->cbuf, CONTENT_BUF_SIZE, off)) > 0) {
+            xxh64_update(&s, w->cbuf, (size_t)got);
+            off += (uint64_t)got;
+            w->st.hash_bytes += got;
+        }
+        ok = got == 0 && off == f->size;
+    }
+    in_close(h);
+    f->hash = xxh64_digest(&s);
+    return ok;
+}
+
+static THREAD_PROC dupe_hash_thread(void *p) {
+    Worker *w = (Worker*)p;
+    DupePass *ps = w->ctx->dupe_pass;
+    for (;;) {
+        size_t k = (size_t)ATOMIC_ADD64(&ps->next, DUPE_CHUNK);
+        if (k >= ps->n) break;
+        size_t end = k + DUPE_CHUNK < ps->n ? k + DUPE_CHUNK : ps->n;
+        for (; k < end; k++) {
+            if (!dupe_hash_file(w, &ps->files[k], ps->full)) ps->files[k].size = 0;
+        }
+    }
+    return 0;
+}
+
+// files[0..n) hashed on the threads; one runs it alone if none can be started
+static void dupe_pass_run(Ctx *ctx, Worker *ws, thread_t *hs, int threads, DupeFile *files, size_t n, int full) {
+    DupePass ps;
+    ps.files = files;
+    ps.n = n;
+    ps.full = full;
+    ps.next = 0;
+    ctx->dupe_pass = &ps;
+    int started = 0;
+    while (started < threads && thread_start(&hs[started], dupe_hash_thread, &ws[started])) started++;
+    if (started) thread_join_all(hs, started);
+    else dupe_hash_thread(&ws[0]);
+    ctx->dupe_pass = NULL;
+}
+
+static int u64_order(uint64_t a, uint64_t b) {
+    return (a > b) - (a < b);
+}
+
+static int pchar_cmp(const pchar *a, const pchar *b) {
+#ifdef _WIN32
+    return wcscmp(a, b);
+#else
+    return strcmp(a, b);
+#endif
+}
+
+// of several links to one inode, the first path is kept
+static int dupe_cmp_id(const void *a, const void *b) {
+    const DupeFile *x = (const DupeFile*)a, *y = (const DupeFile*)b;
+    int c = u64_order(x->size, y->size);
+    if (!c) c = u64_order(x->dev, y->dev);
+    if (!c) c = u64_order(x->id, y->id);
+    return c ? c : pchar_cmp(x->path, y->path);
+}
+
+static int dupe_cmp_hash(const void *a, const void *b) {
+    const DupeFile *x = (const DupeFile*)a, *y = (const DupeFile*)b;
+    int c = u64_order(x->size, y->size);
+    return c ? c : u64_order(x->hash, y->hash);
+}
+
+// the report's order: largest files first, each group's paths sorted
+static int dupe_cmp_out(const void *a, const void *b) {
+    const DupeFile *x = (const DupeFile*)a, *y = (const DupeFile*)b;
+    int c = u64_order(y->size, x->size);
+    if (!c) c = u64_order(x->hash, y->hash);
+    return c ? c : pchar_cmp(x->path, y->path);
+}
+
+static int dupe_same_size(const DupeFile *a, const DupeFile *b) {
+    return a->size == b->size;
+}
+
+static int dupe_same_hash(const DupeFile *a, const DupeFile *b) {
+    return a->size == b->size && a->hash == b->hash;
+}
+
+// Keeps the files of f (sorted so that equal ones are adjacent) that some
+// other file equals, in order, and returns how many. Unreadable ones go.
+static size_t dupe_keep_shared(DupeFile *f, size_t n, int (*same)(const DupeFile*, const DupeFile*)) {
+    size_t out = 0;
+    for (size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && same(&f[i], &f[j])) j++;
+        if (j - i >= 2 && f[i].size) {
+            memmove(f + out, f + i, (j - i) * sizeof(*f));
+            out += j - i;
+        }
+        i = j;
+    }
+    return out;
+}
+
+// After the walk: prints the groups of files with the same contents among
+// the ones recorded, a blank line after each. 0 if out of memory.
+static int dupes_run(Ctx *ctx, Worker *ws, thread_t *hs, int threads) {
+    size_t n = 0;
+    for (int i = 0; i < threads; i++) {
+        if (ws[i].dup.oom) return 0;
+        n += ws[i].dup.nfiles;
+    }
+    DupeFile *f = (DupeFile*)malloc((n ? n : 1) * sizeof(DupeFile));
+    if (!f) return 0;
+    n = 0;
+    for (int i = 0; i < threads; i++) {
+        for (size_t k = 0; k < ws[i].dup.nfiles; k++) {
+            f[n] = ws[i].dup.files[k];
+            f[n].path = ws[i].dup.paths + f[n].path_off;
+            n++;
+        }
+    }
+
+    // a size no other file has, or one more link to an inode, cannot be a copy
+    qsort(f, n, sizeof(DupeFile), dupe_cmp_id);
+    size_t m = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (m && f[k].id && f[k].id == f[m - 1].id && f[k].dev == f[m - 1].dev && f[k].size == f[m - 1].size) continue;
+        f[m++] = f[k];
+    }
+    n = dupe_keep_shared(f, m, dupe_same_size);
+
+    // the ends first, which is all of a small file; then all of the rest
+    dupe_pass_run(ctx, ws, hs, threads, f, n, 0);
+    qsort(f, n, sizeof(DupeFile), dupe_cmp_hash);
+    n = dupe_keep_shared(f, n, dupe_same_hash);
+    size_t big = 0;
+    while (big < n && f[big].size <= 2 * DUPE_EDGE) big++;
+    if (big < n) {
+        dupe_pass_run(ctx, ws, hs, threads, f + big, n - big, 1);
+        qsort(f + big, n - big, sizeof(DupeFile), dupe_cmp_hash);
+        n = big + dupe_keep_shared(f + big, n - big, dupe_same_hash);
+    }
+
+    qsort(f, n, sizeof(DupeFile), dupe_cmp_out);
+    OutBuf *ob = &ws[0].out;
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        for (; j < n && dupe_same_hash(&f[i], &f[j]); j++) PNAME_OUT_LINE(ob, &ctx->out_mu, f[j].path, f[j].path_len);
+        PNAME_OUT_LINE(ob, &ctx->out_mu, f[i].path, 0);
+        ctx->dupe_groups++;
+        ctx->dupe_files += (LONG64)(j - i);
+        ctx->dupe_bytes += f[i].size * (j - i - 1);
+        i = j;
+    }
+    out_flush(ob, &ctx->out_mu);
+    free(f);
+    return 1;
+}
+
+static void dupe_local_free(DupeLocal *d) {
+    free(d->files);
+    free(d->paths);
+    memset(d, 0, sizeof(*d));
+}
+
+// -------------------- disk usage (--du) --------------------
+//
+// Each directory's node carries the bytes under it. A worker adds the sizes
+// of the files it lists to the directory when the listing ends, and a node
+// adds its total to its parent's when it is freed: the last reference goes
+// only once every child directory is done, so the total is final there.
+// That is also where each worker keeps the heaviest it has seen; they are
+// merged after the walk.
+
+// 1536 -> "1.5 KiB"
+static void du_size_str(char *buf, size_t cap, uint64_t bytes) {
+    static const char *k_units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+    double v = (double)bytes;
+    int u = 0;
+    while (v >= 1024 && u + 1 < (int)ARRAYSIZE(k_units)) {
+        v /= 1024;
+        u++;
+    }
+    if (u) snprintf(buf, cap, "%.1f %s", v, k_units[u]);
+    else snprintf(buf, cap, "%llu B", (unsigned long long)bytes);
+}
+
+// heaviest first, then by path
+static int du_cmp(const void *a, const void *b) {
+    const DuEntry *x = (const DuEntry*)a, *y = (const DuEntry*)b;
+    if (x->bytes != y->bytes) return x->bytes < y->bytes ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+// After the walk: prints the ctx->du_top heaviest directories, size first.
+// 0 if out of memory.
+static int du_print(Ctx *ctx, Worker *ws, int threads) {
+    size_t n = 0;
+    for (int i = 0; i < threads; i++) n += ws[i].du.ntop;
+    DuEntry *all = (DuEntry*)malloc((n ? n : 1) * sizeof(DuEntry));
+    char *line = (char*)malloc(PATH_CAP * 4 + 32);
+    if (!all || !line) {
+        free(all);
+        free(line);
+        return 0;
+    }
+    n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + n, ws[i].du.top, ws[i].du.ntop * sizeof(DuEntry));
+        n += ws[i].du.ntop;
+    }
+    qsort(all, n, sizeof(DuEntry), du_cmp);
+    if (n > ctx->du_top) n = ctx->du_top;
+    OutBuf *ob = &ws[0].out;
+    for (size_t i = 0; i < n; i++) {
+        char size[32];
+        du_size_str(size, sizeof(size), all[i].bytes);
+        int len = snprintf(line, PATH_CAP * 4 + 32, "%10s  %s", size, all[i].path);
+        out_line_utf8(ob, &ctx->out_mu, line, (size_t)len);
+    }
+    out_flush(ob, &ctx->out_mu);
+    free(line);
+    free(all);
+    return 1;
+}
+
+static void du_local_free(DuLocal *d) {
+    for (size_t i = 0; i < d->ntop; i++) free(d->top[i].path);
+    free(d->top);
+    memset(d, 0, sizeof(*d));
+}
+
+// -------------------- main --------------------
+
+static void usage(void) {
+    fwprintf(stderr,
+        L"Usage:\n"
+        L"  ffind <root> <needle> [options]\n"
+        L"  ffind --build-index <root> <index-file> [-t N]\n"
+        L"  ffind --update-index <index-file> [-t N]\n"
+        L"  ffind --index <index-file> <needle> [options]\n"
+        L"  ffind --serve <root> <socket>            (Linux)\n"
+        L"  ffind --query <socket> <needle> [options]\n\n"
+        L"Options:\n"
+        L"  -e ext1,ext2,...  only these extensions (tar.gz style ones too)\n"
+        L"  -E ext1,ext2,...  skip these extensions\n"
+        L"  -f                match against the full path\n"
+        L"  -a needle         another needle (repeatable); lines get a TAB and\n"
+        L"                    the needles that matched\n"
+        L"  -n file           more needles, one per line (UTF-8)\n"
+        L"  -g glob           in place of the needle: names matching the glob\n"
+        L"                    (* ? [a-z] [!a-z]); with -f the whole path\n"
+        L"  -r regex          in place of the needle: names containing a match\n"
+        L"                    (. [] * + ? {m,n} | () ^ $ \\d \\w \\s)\n"
+        L"  -m N              stop after N matches\n"
+        L"  -t N              worker threads\n"
+        L"  -q N              Linux: open directories ahead through io_uring,\n"
+        L"                    N in flight per thread\n"
+        L"  -b dir|fill       flush output per directory, or when the buffer fills\n"
+        L"  --type f|d|l      only files, directories or symlinks (any of them,\n"
+        L"                    e.g. fl); directories are otherwise not reported\n"
+        L"  --size [+|-]N     larger than, smaller than or exactly N bytes;\n"
+        L"                    N takes k, M, G, T\n"
+        L"  --newer N         modified in the last N seconds, or Nm, Nh, Nd\n"
+        L"  -c text           only files that contain text (ASCII case folded);\n"
+        L"                    the needle and other options pick the files\n"
+        L"  --dupes           print groups of files with the same contents, among\n"
+        L"                    the ones the needle and other options pick\n"
+        L"  --du N            print the N directories with the most bytes under\n"
+        L"                    them, counting the files the needle and options pick\n"
+        L"  --exclude-dir glob\n"
+        L"                    never enter directories with this name (* ? [a-z]);\n"
+        L"                    repeatable, also for --build-index and --update-index\n"
+        L"  --exclude-dir-file file\n"
+        L"                    more of them, one per line (UTF-8)\n"
+        L"  --respect-ignore  skip what .gitignore and .ignore files name, and .git\n"
+        L"  --stats=json      report totals and per-thread counters and times\n"
+        L"                    as JSON on stderr, in place of the summary\n"
+        L"  --trace file      write a Chrome trace of the workers: a span per\n"
+        L"                    directory (chrome://tracing, ui.perfetto.dev)\n\n"
+        L"Examples:\n"
+        L"  ffind C:\\\\Users\\\\banis prime -e c,h,cpp\n"
+        L"  ffind C:\\\\ source -f -t 8\n"
+        L"  ffind C:\\\\ password -a secret -a .pem\n"
+        L"  ffind C:\\\\logs -g *.log.[0-9]\n"
+        L"  ffind C:\\\\src \"\" -e c,h -c TODO\n"
+        L"  ffind D:\\\\photos .jpg --dupes --size +100k\n"
+        L"  ffind C:\\\\ \"\" --du 20\n"
+        L"  ffind --index C:\\\\ffind.idx -r ^core\\.[0-9]+$\n"
+        L"  ffind --build-index C:\\\\ C:\\\\ffind.idx\n"
+        L"  ffind --index C:\\\\ffind.idx prime -e c,h\n");
+}
+
+static int default_threads(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+#ifndef FFIND_NO_MAIN
+
+typedef enum { MODE_SCAN, MODE_BUILD_INDEX, MODE_UPDATE_INDEX, MODE_QUERY_INDEX } Mode;
+
+typedef struct {
+    Mode mode;
+    const wchar_t *root;     // scan, build
+    const wchar_t *index;    // build output, update in place, query input
+    const wchar_t **needles; // the positional one, then -a and -n in order
+    size_t nneedles, needles_cap;
+    wchar_t **texts;         // -n file contents, one block per file
+    size_t ntexts, texts_cap;
+    const wchar_t *extcsv;
+    const wchar_t *skipcsv;
+    const wchar_t *pattern;  // -g, -r: in place of the needle
+    int glob;
+    int match_full_path;
+    int threads;
+    int flush_per_dir;
+    long long max_matches;
+    int io_depth;
+    int stats;               // --stats=json
+    const wchar_t *trace;    // --trace file
+    unsigned kinds;          // --type, 0 = not given
+    int size_op;             // --size
+    uint64_t size;
+    long long newer_secs;    // --newer, 0 = not given
+    const wchar_t **excludes; // --exclude-dir globs, then --exclude-dir-file lines
+    size_t nexcludes, excludes_cap;
+    int ignore;              // --respect-ignore
+    const wchar_t *content;  // -c
+    int dupes;               // --dupes
+    int du_top;              // --du N, 0 = not given
+} Options;
+
+static int add_needle(Options *o, const wchar_t *s) {
+    if (!grow_array((void**)&o->needles, &o->needles_cap, o->nneedles + 1, sizeof(*o->needles))) return 0;
+    o->needles[o->nneedles++] = s;
+    return 1;
+}
+
+static int add_exclude(Options *o, const wchar_t *s) {
+    if (!grow_array((void**)&o->excludes, &o->excludes_cap, o->nexcludes + 1, sizeof(*o->excludes))) return 0;
+    o->excludes[o->nexcludes++] = s;
+    return 1;
+}
+
+// -n, --exclude-dir-file: add each line of a UTF-8 file; blank lines are skipped
+static int read_lines(Options *o, const wchar_t *path, int (*add)(Options*, const wchar_t*)) {
+    FILE *f = fopen_read(path);
+    if (!f) {
+        fwprintf(stderr, L"Cannot read %ls\n", path);
+        return 0;
+    }
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    for (;;) {
+        if (!grow_array((void**)&buf, &cap, len + 4096 + 1, 1)) break;
+        size_t got = fread(buf + len, 1, 4096, f);
+        len += got;
+        if (got < 4096) break;
+    }
+    fclose(f);
+    // one wchar_t per byte is always enough
+    wchar_t *text = buf ? (wchar_t*)malloc((len + 1) * sizeof(wchar_t)) : NULL;
+    if (!text || !grow_array((void**)&o->texts, &o->texts_cap, o->ntexts + 1, sizeof(*o->texts))) {
+        free(text);
+        free(buf);
+        fwprintf(stderr, L"Out of memory\n");
+        return 0;
+    }
+    o->texts[o->ntexts++] = text;
+    buf[len] = 0;
+
+    char *p = buf;
+    if (len >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3;
+    wchar_t *out = text;
+    int ok = 1;
+    while (*p && ok) {
+        char *eol = strchr(p, '\n');
+        char *next = eol ? eol + 1 : p + strlen(p);
+        if (eol) *eol = 0;
+        size_t n = strlen(p);
+        if (n && p[n - 1] == '\r') p[--n] = 0;
+        if (n) {
+            size_t k = utf8_to_wide(out, n + 1, p);
+            if (k) {
+                ok = add(o, out);
+                out += k + 1;
+            }
+        }
+        p = next;
+    }
+    free(buf);
+    if (!ok) fwprintf(stderr, L"Out of memory\n");
+    return ok;
+}
+
+static void options_free(Options *o) {
+    for (size_t i = 0; i < o->ntexts; i++) free(o->texts[i]);
+    free(o->texts);
+    free((void*)o->needles);
+    free((void*)o->excludes);
+}
+
+static int is_pattern_opt(const wchar_t *s) {
+    return wcscmp(s, L"-g") == 0 || wcscmp(s, L"-r") == 0;
+}
+
+// The matching half of ctx from o: needles, -g/-r, -e/-E, -f, -m. 0 on
+// failure, with pat->error set for a bad pattern and out of memory otherwise.
+static int match_setup(Ctx *ctx, AcAuto *ac, Pattern *pat, const Options *o) {
+    memset(ac, 0, sizeof(*ac));
+    memset(pat, 0, sizeof(*pat));
+    if (o->pattern && !pat_init(pat, o->pattern, o->glob)) return 0;
+    if (!ext_set_init(&ctx->ext.only, o->extcsv) || !ext_set_init(&ctx->ext.skip, o->skipcsv) ||
+        !needle_init(&ctx->needle, o->pattern ? (pat->fails_fast ? NULL : pat->literal) :
+                                   o->nneedles ? o->needles[0] : NULL) ||
+        (o->nneedles > 1 && !ac_init(ac, o->needles, (uint32_t)o->nneedles))) {
+        needle_free(&ctx->needle);
+        ext_filter_free(&ctx->ext);
+        pat_free(pat);
+        return 0;
+    }
+    ctx->ac = o->nneedles > 1 ? ac : NULL;
+    ctx->pat = o->pattern && !pat->exact ? pat : NULL;
+    ctx->match_full_path = o->match_full_path;
+    ctx->max_matches = o->max_matches;
+    ctx->kinds = o->content || o->dupes ? KIND_FILE : o->kinds ? o->kinds : KIND_DEFAULT;
+    ctx->meta.size_op = o->size_op;
+    ctx->meta.size = o->size;
+    ctx->meta.newer = o->newer_secs > 0;
+    if (ctx->meta.newer) {
+#ifdef _WIN32
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        int64_t t = (int64_t)(((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime);
+        ctx->meta.mtime_min = t - (int64_t)o->newer_secs * 10000000;
+#else
+        ctx->meta.mtime_min = ((int64_t)time(NULL) - (int64_t)o->newer_secs) * 1000000000;
+#endif
+    }
+    return 1;
+}
+
+// --size: [+|-]N[k|M|G], larger than, smaller than or exactly N bytes
+static int parse_size(const wchar_t *s, int *op, uint64_t *size) {
+    *op = *s == L'+' || *s == L'-' ? (int)*s++ : '=';
+    wchar_t *end;
+    if (*s < L'0' || *s > L'9') return 0;
+    unsigned long long n = wcstoull(s, &end, 10);
+    int shift = 0;
+    if (*end == L'k' || *end == L'K') shift = 10;
+    else if (*end == L'm' || *end == L'M') shift = 20;
+    else if (*end == L'g' || *end == L'G') shift = 30;
+    else if (*end == L't' || *end == L'T') shift = 40;
+    if (shift) end++;
+    if (*end || n > (UINT64_MAX >> shift)) return 0;
+    *size = (uint64_t)n << shift;
+    return 1;
+}
 
-static void print_winerr(const wchar_t *what) {
-    DWORD e = GetLastError();
-    wchar_t *msg = NULL;
-    FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-                   NULL, e, 0, (LPWSTR)&msg, 0, NULL);
-    fwprintf(stderr, L"%ls failed (err=%lu): %ls\n", what, (unsigned long)e, msg ? msg : L"(no message)");
-    if (msg) LocalFree(msg);
+// --newer: N[s|m|h|d], seconds by default
+static long long parse_age(const wchar_t *s) {
+    wchar_t *end;
+    if (*s < L'0' || *s > L'9') return 0;
+    long long n = wcstoll(s, &end, 10);
+    long long unit = 1;
+    if (*end == L'm') unit = 60;
+    else if (*end == L'h') unit = 3600;
+    else if (*end == L'd') unit = 86400;
+    if (unit > 1 || *end == L's') end++;
+    if (*end || n <= 0 || n > INT64_MAX / unit) return 0;
+    return n * unit;
 }
 
-static int wcontains_i(const wchar_t *hay, const wchar_t *needle) {
-    if (!needle || !*needle) return 1;
-    size_t nlen = wcslen(needle);
-    for (const wchar_t *p = hay; *p; ++p) {
-        if (_wcsnicmp(p, needle, nlen) == 0) return 1;
+// --type: any of f, d, l, optionally comma separated
+static unsigned parse_kinds(const wchar_t *s) {
+    unsigned k = 0;
+    for (; *s; s++) {
+        if (*s == L'f') k |= KIND_FILE;
+        else if (*s == L'd') k |= KIND_DIR;
+        else if (*s == L'l') k |= KIND_LINK;
+        else if (*s != L',') return 0;
     }
-    return 0;
+    return k;
 }
 
-static const wchar_t* basename_ptr(const wchar_t *path) {
-    const wchar_t *last = path;
-    for (const wchar_t *p = path; *p; ++p) {
-        if (*p == L'\\' || *p == L'/') last = p + 1;
-    }
-    return last;
+static void match_free(Ctx *ctx, AcAuto *ac, Pattern *pat) {
+    needle_free(&ctx->needle);
+    ext_filter_free(&ctx->ext);
+    ac_free(ac);
+    pat_free(pat);
 }
 
-// extcsv like "c,h,cpp" (no dots required). empty => allow all
-static int ext_allowed(const wchar_t *filename, const wchar_t *extcsv) {
-    if (!extcsv || !*extcsv) return 1;
+static int parse_args(Options *o, int argc, wchar_t **argv) {
+    memset(o, 0, sizeof(*o));
+    o->extcsv = L"";
+    o->skipcsv = L"";
+    o->flush_per_dir = out_is_terminal();
 
-    const wchar_t *dot = wcsrchr(filename, L'.');
-    if (!dot || !dot[1]) return 0;
-    const wchar_t *ext = dot + 1;
+    int i;
+    if (argc >= 4 && wcscmp(argv[1], L"--build-index") == 0) {
+        o->mode = MODE_BUILD_INDEX;
+        o->root = argv[2];
+        o->index = argv[3];
+        i = 4;
+    } else if (argc >= 3 && wcscmp(argv[1], L"--update-index") == 0) {
+        o->mode = MODE_UPDATE_INDEX;
+        o->index = argv[2];
+        i = 3;
+    } else if (argc >= 4 && wcscmp(argv[1], L"--index") == 0) {
+        o->mode = MODE_QUERY_INDEX;
+        o->index = argv[2];
+        i = 3;
+        if (!is_pattern_opt(argv[3]) && !add_needle(o, argv[i++])) return 0;
+    } else if (argc >= 3 && argv[1][0] != L'-') {
+        o->mode = MODE_SCAN;
+        o->root = argv[1];
+        i = 2;
+        if (!is_pattern_opt(argv[2]) && !add_needle(o, argv[i++])) return 0;
+    } else {
+        return 0;
+    }
 
-    const wchar_t *p = extcsv;
-    while (*p) {
-        while (*p == L',' || *p == L' ' || *p == L'\t') p++;
-        const wchar_t *start = p;
-        while (*p && *p != L',') p++;
-        size_t len = (size_t)(p - start);
-        if (len > 0) {
-            if (wcslen(ext) == len && _wcsnicmp(ext, start, len) == 0) return 1;
+    for (; i < argc; i++) {
+        if (wcscmp(argv[i], L"-e") == 0 && i + 1 < argc) {
+            o->extcsv = argv[++i];
+        } else if (wcscmp(argv[i], L"-E") == 0 && i + 1 < argc) {
+            o->skipcsv = argv[++i];
+        } else if (wcscmp(argv[i], L"-f") == 0) {
+            o->match_full_path = 1;
+        } else if (wcscmp(argv[i], L"-a") == 0 && i + 1 < argc && o->nneedles) {
+            if (!add_needle(o, argv[++i])) return 0;
+        } else if (wcscmp(argv[i], L"-n") == 0 && i + 1 < argc && o->nneedles) {
+            if (!read_lines(o, argv[++i], add_needle)) return 0;
+        } else if (wcscmp(argv[i], L"-t") == 0 && i + 1 < argc) {
+            o->threads = _wtoi(argv[++i]);
+        } else if (wcscmp(argv[i], L"-q") == 0 && i + 1 < argc) {
+            o->io_depth = _wtoi(argv[++i]);
+            if (o->io_depth < 0 || o->io_depth > 4096) return 0;
+        } else if (is_pattern_opt(argv[i]) && i + 1 < argc && !o->nneedles && !o->pattern &&
+                   (o->mode == MODE_SCAN || o->mode == MODE_QUERY_INDEX)) {
+            o->glob = argv[i][1] == L'g';
+            o->pattern = argv[++i];
+        } else if (wcscmp(argv[i], L"-m") == 0 && i + 1 < argc && (o->nneedles || o->pattern)) {
+            o->max_matches = wcstoll(argv[++i], NULL, 10);
+            if (o->max_matches < 1) return 0;
+        } else if (wcscmp(argv[i], L"--size") == 0 && i + 1 < argc && o->mode == MODE_SCAN) {
+            if (!parse_size(argv[++i], &o->size_op, &o->size)) return 0;
+        } else if (wcscmp(argv[i], L"--newer") == 0 && i + 1 < argc && o->mode == MODE_SCAN) {
+            if (!(o->newer_secs = parse_age(argv[++i]))) return 0;
+        } else if (wcscmp(argv[i], L"--type") == 0 && i + 1 < argc && o->mode == MODE_SCAN) {
+            if (!(o->kinds = parse_kinds(argv[++i]))) return 0;
+        } else if (wcscmp(argv[i], L"--exclude-dir") == 0 && i + 1 < argc && o->mode != MODE_QUERY_INDEX) {
+            if (!add_exclude(o, argv[++i])) return 0;
+        } else if (wcscmp(argv[i], L"--exclude-dir-file") == 0 && i + 1 < argc && o->mode != MODE_QUERY_INDEX) {
+            if (!read_lines(o, argv[++i], add_exclude)) return 0;
+        } else if (wcscmp(argv[i], L"--respect-ignore") == 0 && o->mode == MODE_SCAN) {
+            o->ignore = 1;
+        } else if (wcscmp(argv[i], L"-c") == 0 && i + 1 < argc && o->mode == MODE_SCAN) {
+            o->content = argv[++i];
+            if (!*o->content || wcslen(o->content) > CONTENT_TEXT_MAX) return 0;
+        } else if (wcscmp(argv[i], L"--dupes") == 0 && o->mode == MODE_SCAN) {
+            o->dupes = 1;
+        } else if (wcscmp(argv[i], L"--du") == 0 && i + 1 < argc && o->mode == MODE_SCAN) {
+            o->du_top = _wtoi(argv[++i]);
+            if (o->du_top < 1 || o->du_top > 100000) return 0;
+        } else if (wcscmp(argv[i], L"--stats=json") == 0) {
+            o->stats = 1;
+        } else if (wcscmp(argv[i], L"--trace") == 0 && i + 1 < argc) {
+            o->trace = argv[++i];
+        } else if (wcscmp(argv[i], L"-b") == 0 && i + 1 < argc && wcscmp(argv[i + 1], L"dir") == 0) {
+            o->flush_per_dir = 1;
+            i++;
+        } else if (wcscmp(argv[i], L"-b") == 0 && i + 1 < argc && wcscmp(argv[i + 1], L"fill") == 0) {
+            o->flush_per_dir = 0;
+            i++;
+        } else {
+            fwprintf(stderr, L"Unknown option: %ls\n", argv[i]);
+            return 0;
         }
     }
-    return 0;
+    if ((o->content || o->dupes) && (o->kinds & ~KIND_FILE)) {
+        fwprintf(stderr, L"%ls reads regular files only: --type f or none\n", o->dupes ? L"--dupes" : L"-c");
+        return 0;
+    }
+    if (o->dupes && (o->content || o->max_matches)) {
+        fwprintf(stderr, L"--dupes does not combine with -c or -m\n");
+        return 0;
+    }
+    if (o->du_top && (o->content || o->dupes || o->max_matches || (o->kinds & KIND_DIR))) {
+        fwprintf(stderr, L"--du does not combine with -c, --dupes, -m or --type d\n");
+        return 0;
+    }
+    return o->nneedles || o->pattern || o->mode == MODE_BUILD_INDEX || o->mode == MODE_UPDATE_INDEX;
 }
 
-static wchar_t* wcsdup_heap(const wchar_t *s) {
-    size_t n = wcslen(s);
-    wchar_t *p = (wchar_t*)malloc((n + 1) * sizeof(wchar_t));
-    if (!p) return NULL;
-    memcpy(p, s, (n + 1) * sizeof(wchar_t));
-    return p;
-}
+// ---- serve ----
+//
+// --serve keeps the names under a root in memory and answers queries on a
+// Unix socket; --query is its client. Each directory gets an inotify watch
+// and is then read. When an event names a directory it is read again: its
+// files are replaced, new subdirectories are read, and vanished ones are
+// dropped with their subtree. Everything runs on one thread waiting on the
+// socket and the inotify fd, so a query sees a settled table and never
+// touches the filesystem.
+//
+// A query is the arguments after the root, as they would be given to a scan,
+// each UTF-8 and NUL-terminated, ended by the client shutting down its side.
+// The reply is "OK\n" and the matching paths, one per line, or "ERR message\n".
 
-static int is_dot_or_dotdot(const wchar_t *s) {
-    return (s[0] == L'.' && s[1] == 0) || (s[0] == L'.' && s[1] == L'.' && s[2] == 0);
+#ifndef _WIN32
+
+#define SRV_NONE      UINT32_MAX
+#define SRV_QUERY_MAX (1 << 20)
+#define SRV_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+                        IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+typedef struct {
+    uint32_t parent;        // SRV_NONE for the root
+    int wd;                 // inotify watch, -1 without one
+    int live, dirty;
+    char *name;             // the root's full path, else the name
+    size_t name_len;
+    char *files;            // nfiles x (uint16_t len, name)
+    size_t files_len, files_cap;
+    uint32_t nfiles;
+    uint32_t *subs;         // subdirectories
+    size_t nsubs, subs_cap;
+} SrvDir;
+
+typedef struct {
+    SrvDir *dirs;
+    size_t ndirs, dirs_cap;
+    uint32_t *free_ids;     // dropped dirs, for reuse
+    size_t nfree, free_cap;
+    uint32_t *by_wd;        // inotify wd -> dir
+    size_t by_wd_cap;
+    uint32_t *dirty;        // dirs to read again
+    size_t ndirty, dirty_cap;
+    char *names;            // subdirectory names of the dir being read
+    size_t names_len, names_cap;
+    size_t *offs;
+    size_t noffs, offs_cap;
+    char *dents;
+    int ino;
+    int watch_full;         // out of inotify watches (warned once)
+    int oom;
+    uint64_t nfiles;
+    uint32_t nlive;
+} Srv;
+
+static void srv_mark(Srv *s, uint32_t d) {
+    if (d >= s->ndirs || !s->dirs[d].live || s->dirs[d].dirty) return;
+    if (!grow_array((void**)&s->dirty, &s->dirty_cap, s->ndirty + 1, sizeof(uint32_t))) {
+        s->oom = 1;
+        return;
+    }
+    s->dirs[d].dirty = 1;
+    s->dirty[s->ndirty++] = d;
 }
 
-// Join: dir + '\' + name into out (caller provides buffer)
-static int join_path(wchar_t *out, size_t cap, const wchar_t *dir, const wchar_t *name) {
-    size_t dlen = wcslen(dir);
-    size_t nlen = wcslen(name);
-    int needs_slash = (dlen > 0 && dir[dlen-1] != L'\\' && dir[dlen-1] != L'/');
-    size_t total = dlen + (needs_slash ? 1 : 0) + nlen + 1;
-    if (total > cap) return 0;
-    wcscpy_s(out, cap, dir);
-    if (needs_slash) wcscat_s(out, cap, L"\\");
-    wcscat_s(out, cap, name);
-    return 1;
+// d's full path into out; 0 if it does not fit
+static size_t srv_path(const Srv *s, uint32_t d, char *out, size_t cap) {
+    uint32_t chain[1024];
+    size_t depth = 0;
+    for (; s->dirs[d].parent != SRV_NONE; d = s->dirs[d].parent) {
+        if (depth == ARRAYSIZE(chain)) return 0;
+        chain[depth++] = d;
+    }
+    size_t n = s->dirs[d].name_len;
+    if (n + 1 > cap) return 0;
+    memcpy(out, s->dirs[d].name, n);
+    while (depth) {
+        const SrvDir *e = &s->dirs[chain[--depth]];
+        int needs_sep = n > 0 && out[n - 1] != '/';
+        if (n + needs_sep + e->name_len + 1 > cap) return 0;
+        if (needs_sep) out[n++] = '/';
+        memcpy(out + n, e->name, e->name_len);
+        n += e->name_len;
+    }
+    out[n] = 0;
+    return n;
 }
 
-// Make: dir + "\*" pattern
-static int make_glob(wchar_t *out, size_t cap, const wchar_t *dir) {
-    size_t dlen = wcslen(dir);
-    int needs_slash = (dlen > 0 && dir[dlen-1] != L'\\' && dir[dlen-1] != L'/');
-    size_t total = dlen + (needs_slash ? 1 : 0) + 1 + 1;
-    if (total > cap) return 0;
-    wcscpy_s(out, cap, dir);
-    if (needs_slash) wcscat_s(out, cap, L"\\");
-    wcscat_s(out, cap, L"*");
-    return 1;
+static uint32_t srv_new_dir(Srv *s, uint32_t parent, const char *name, size_t len) {
+    uint32_t d;
+    if (s->nfree) {
+        d = s->free_ids[--s->nfree];
+    } else {
+        if (s->ndirs >= SRV_NONE || !grow_array((void**)&s->dirs, &s->dirs_cap, s->ndirs + 1, sizeof(SrvDir))) return SRV_NONE;
+        d = (uint32_t)s->ndirs++;
+    }
+    SrvDir *e = &s->dirs[d];
+    memset(e, 0, sizeof(*e));
+    e->name = (char*)malloc(len + 1);
+    if (!e->name) {
+        if (grow_array((void**)&s->free_ids, &s->free_cap, s->nfree + 1, sizeof(uint32_t))) s->free_ids[s->nfree++] = d;
+        return SRV_NONE;
+    }
+    memcpy(e->name, name, len);
+    e->name[len] = 0;
+    e->name_len = len;
+    e->parent = parent;
+    e->wd = -1;
+    e->live = 1;
+    s->nlive++;
+    return d;
 }
 
-// -------------------- work queue --------------------
+// d and everything below it
+static void srv_drop(Srv *s, uint32_t d) {
+    SrvDir *e = &s->dirs[d];
+    for (size_t k = 0; k < e->nsubs; k++) srv_drop(s, e->subs[k]);
+    e = &s->dirs[d];
+    // a directory moved within the tree keeps its watch under the new entry
+    if (e->wd >= 0 && (size_t)e->wd < s->by_wd_cap && s->by_wd[e->wd] == d) {
+        inotify_rm_watch(s->ino, e->wd);
+        s->by_wd[e->wd] = SRV_NONE;
+    }
+    s->nfiles -= e->nfiles;
+    s->nlive--;
+    free(e->name);
+    free(e->files);
+    free(e->subs);
+    memset(e, 0, sizeof(*e));
+    if (grow_array((void**)&s->free_ids, &s->free_cap, s->nfree + 1, sizeof(uint32_t))) s->free_ids[s->nfree++] = d;
+}
 
-typedef struct Node {
-    struct Node *next;
-    wchar_t *dir; // owned heap string
-} Node;
+static void srv_watch(Srv *s, uint32_t d, const char *path) {
+    if (s->watch_full) return;
+    int wd = inotify_add_watch(s->ino, path, SRV_WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            fwprintf(stderr, L"Out of inotify watches (fs.inotify.max_user_watches): "
+                             L"changes in directories read from now on are not seen\n");
+            s->watch_full = 1;
+        }
+        return;
+    }
+    size_t need = (size_t)wd + 1;
+    size_t old = s->by_wd_cap;
+    if (!grow_array((void**)&s->by_wd, &s->by_wd_cap, need, sizeof(uint32_t))) {
+        inotify_rm_watch(s->ino, wd);
+        return;
+    }
+    for (size_t k = old; k < s->by_wd_cap; k++) s->by_wd[k] = SRV_NONE;
+    uint32_t had = s->by_wd[wd];
+    if (had != SRV_NONE && had != d && had < s->ndirs) s->dirs[had].wd = -1;
+    s->by_wd[wd] = d;
+    s->dirs[d].wd = wd;
+}
 
-typedef struct {
-    Node *head, *tail;
-    LONG active_workers;     // workers currently processing a dir
-    LONG stop;              // set when done
-    CRITICAL_SECTION mu;
-    CONDITION_VARIABLE cv;
-} WorkQ;
+static int srv_cmp_name(const void *a, const void *b, void *base) {
+    return strcmp((const char*)base + *(const size_t*)a, (const char*)base + *(const size_t*)b);
+}
 
-static void wq_init(WorkQ *q) {
-    q->head = q->tail = NULL;
-    q->active_workers = 0;
-    q->stop = 0;
-    InitializeCriticalSection(&q->mu);
-    InitializeConditionVariable(&q->cv);
+// index into offs of name among the sorted subdirectory names, or -1
+static ptrdiff_t srv_find_name(const Srv *s, const char *name) {
+    size_t lo = 0, hi = s->noffs;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(s->names + s->offs[mid], name);
+        if (c == 0) return (ptrdiff_t)mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
 }
 
-static void wq_destroy(WorkQ *q) {
-    EnterCriticalSection(&q->mu);
-    Node *n = q->head;
-    while (n) {
-        Node *nx = n->next;
-        free(n->dir);
-        free(n);
-        n = nx;
-    }
-    q->head = q->tail = NULL;
-    LeaveCriticalSection(&q->mu);
-    DeleteCriticalSection(&q->mu);
-}
-
-// push dir string (takes ownership)
-static void wq_push_owned(WorkQ *q, wchar_t *dir_owned) {
-    Node *n = (Node*)malloc(sizeof(Node));
-    if (!n) {
-        // out of memory: drop work item
-        free(dir_owned);
+// (Re)reads directory d; its new subdirectories are marked to be read next.
+// A directory that cannot be opened any more is dropped.
+static void srv_read(Srv *s, uint32_t d) {
+    char path[PATH_CAP * 4];
+    size_t plen = srv_path(s, d, path, sizeof(path));
+    if (!plen) return;
+    if (s->dirs[d].wd < 0) srv_watch(s, d, path);
+    int fd = open(path, DIR_OPEN_FLAGS);
+    if (fd < 0) {
+        if (s->dirs[d].parent != SRV_NONE && (errno == ENOENT || errno == ENOTDIR)) {
+            SrvDir *up = &s->dirs[s->dirs[d].parent];
+            for (size_t k = 0; k < up->nsubs; k++) {
+                if (up->subs[k] == d) {
+                    up->subs[k] = up->subs[--up->nsubs];
+                    break;
+                }
+            }
+            srv_drop(s, d);
+        }
+        return;
+    }
+
+    SrvDir *e = &s->dirs[d];
+    s->nfiles -= e->nfiles;
+    e->files_len = 0;
+    e->nfiles = 0;
+    s->names_len = 0;
+    s->noffs = 0;
+    for (;;) {
+        long got = syscall(SYS_getdents64, fd, s->dents, DENTS_BUF_SIZE);
+        if (got <= 0) break;
+        for (long off = 0; off < got; ) {
+            struct linux_dirent64 *de = (struct linux_dirent64*)(s->dents + off);
+            off += de->d_reclen;
+            const char *raw = de->d_name;
+            if (is_dot_or_dotdot_u8(raw)) continue;
+            size_t len = strlen(raw);
+            unsigned char type = de->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, raw, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            if (type == DT_DIR) {
+                if (!grow_array((void**)&s->names, &s->names_cap, s->names_len + len + 1, 1) ||
+                    !grow_array((void**)&s->offs, &s->offs_cap, s->noffs + 1, sizeof(size_t))) {
+                    s->oom = 1;
+                    continue;
+                }
+                s->offs[s->noffs++] = s->names_len;
+                memcpy(s->names + s->names_len, raw, len + 1);
+                s->names_len += len + 1;
+            } else if (len <= 0xFFFF) {
+                if (!grow_array((void**)&e->files, &e->files_cap, e->files_len + len + 2, 1)) {
+                    s->oom = 1;
+                    continue;
+                }
+                uint16_t l16 = (uint16_t)len;
+                memcpy(e->files + e->files_len, &l16, 2);
+                memcpy(e->files + e->files_len + 2, raw, len);
+                e->files_len += len + 2;
+                e->nfiles++;
+            }
+        }
+    }
+    close(fd);
+    s->nfiles += e->nfiles;
+
+    // keep the subdirectories still there, drop the others, add the new ones
+    qsort_r(s->offs, s->noffs, sizeof(size_t), srv_cmp_name, s->names);
+    char *seen = (char*)calloc(s->noffs + 1, 1);
+    if (!seen) {
+        s->oom = 1;
         return;
     }
-    n->dir = dir_owned;
-    n->next = NULL;
+    for (size_t k = 0; k < s->dirs[d].nsubs; ) {
+        uint32_t c = s->dirs[d].subs[k];
+        ptrdiff_t at = srv_find_name(s, s->dirs[c].name);
+        if (at >= 0 && !seen[at]) {
+            seen[at] = 1;
+            k++;
+        } else {
+            e = &s->dirs[d];
+            e->subs[k] = e->subs[--e->nsubs];
+            srv_drop(s, c);
+        }
+    }
+    for (size_t k = 0; k < s->noffs; k++) {
+        if (seen[k]) continue;
+        const char *name = s->names + s->offs[k];
+        uint32_t c = srv_new_dir(s, d, name, strlen(name));
+        e = &s->dirs[d];
+        if (c == SRV_NONE || !grow_array((void**)&e->subs, &e->subs_cap, e->nsubs + 1, sizeof(uint32_t))) {
+            if (c != SRV_NONE) srv_drop(s, c);
+            s->oom = 1;
+            continue;
+        }
+        e->subs[e->nsubs++] = c;
+        srv_mark(s, c);
+    }
+    free(seen);
+}
 
-    EnterCriticalSection(&q->mu);
-    if (q->tail) q->tail->next = n;
-    else q->head = n;
-    q->tail = n;
-    WakeConditionVariable(&q->cv);
-    LeaveCriticalSection(&q->mu);
+// reads every marked directory, and the new ones found on the way
+static void srv_settle(Srv *s) {
+    while (s->ndirty) {
+        uint32_t d = s->dirty[--s->ndirty];
+        if (!s->dirs[d].live || !s->dirs[d].dirty) continue;
+        s->dirs[d].dirty = 0;
+        srv_read(s, d);
+    }
+    if (s->oom) {
+        fwprintf(stderr, L"Out of memory: some names are missing\n");
+        s->oom = 0;
+    }
 }
 
-// pop dir string (caller owns returned dir) or NULL if should stop
-static wchar_t* wq_pop(WorkQ *q) {
-    EnterCriticalSection(&q->mu);
+// marks what the pending events name; 1 if there were any
+static int srv_events(Srv *s) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int any = 0;
     for (;;) {
-        if (q->stop) {
-            LeaveCriticalSection(&q->mu);
-            return NULL;
-        }
-        if (q->head) {
-            Node *n = q->head;
-            q->head = n->next;
-            if (!q->head) q->tail = NULL;
-            wchar_t *dir = n->dir;
-            free(n);
-            InterlockedIncrement(&q->active_workers);
-            LeaveCriticalSection(&q->mu);
-            return dir;
-        }
-        // no queued work: if no one active, we are done
-        if (q->active_workers == 0) {
-            q->stop = 1;
-            WakeAllConditionVariable(&q->cv);
-            LeaveCriticalSection(&q->mu);
-            return NULL;
+        ssize_t got = read(s->ino, buf, sizeof(buf));
+        if (got <= 0) break;
+        any = 1;
+        for (char *p = buf; p < buf + got; ) {
+            const struct inotify_event *ev = (const struct inotify_event*)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events were lost: read everything again
+                for (uint32_t d = 0; d < s->ndirs; d++) srv_mark(s, d);
+                continue;
+            }
+            if (ev->wd < 0 || (size_t)ev->wd >= s->by_wd_cap) continue;
+            uint32_t d = s->by_wd[ev->wd];
+            if (d == SRV_NONE) continue;
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) srv_mark(s, s->dirs[d].parent);
+            else srv_mark(s, d);
         }
-        SleepConditionVariableCS(&q->cv, &q->mu, INFINITE);
     }
+    return any;
 }
 
-// mark worker finished a dir
-static void wq_done_one(WorkQ *q) {
-    EnterCriticalSection(&q->mu);
-    InterlockedDecrement(&q->active_workers);
-    WakeAllConditionVariable(&q->cv);
-    LeaveCriticalSection(&q->mu);
+static int srv_send(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return 0;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 1;
 }
 
-// -------------------- shared settings/stats --------------------
+static void srv_error(int fd, const char *msg) {
+    char line[512];
+    int n = snprintf(line, sizeof(line), "ERR %s\n", msg);
+    srv_send(fd, line, (size_t)n);
+}
 
-typedef struct {
-    const wchar_t *needle;
-    const wchar_t *extcsv;
-    int match_full_path;
-    volatile LONG64 found;
-    volatile LONG64 dirs_scanned;
-    volatile LONG64 files_scanned;
-    CRITICAL_SECTION out_mu; // serialize output
-    WorkQ *q;
-} Ctx;
+static void srv_run_query(const Srv *s, Ctx *ctx, Worker *w, int fd) {
+    char *out = (char*)malloc(OUT_BUF_SIZE);
+    if (!out) {
+        srv_error(fd, "out of memory");
+        return;
+    }
+    memcpy(out, "OK\n", 3);
+    size_t olen = 3;
+    char full[PATH_CAP * 4];
+    LONG64 found = 0;
+    int ok = 1;
 
-// -------------------- worker --------------------
+    for (uint32_t d = 0; ok && d < s->ndirs; d++) {
+        const SrvDir *e = &s->dirs[d];
+        if (!e->live || !e->nfiles) continue;
+        size_t dlen = 0;
+        int dpath = 0;      // full[0..dlen) holds d's path and a separator
+        const char *p = e->files;
+        for (uint32_t k = 0; k < e->nfiles && ok; k++) {
+            uint16_t len;
+            memcpy(&len, p, 2);
+            const char *name = p + 2;
+            p += 2 + len;
 
-static DWORD WINAPI worker_thread(LPVOID p) {
-    Ctx *ctx = (Ctx*)p;
+            if (!ext_allowed8(&ctx->ext, name, len)) continue;
+            if (!ctx->match_full_path && !worker_match8(w, name, len)) continue;
+            if (!dpath) {
+                dlen = srv_path(s, d, full, sizeof(full) - 1);
+                if (dlen && full[dlen - 1] != '/') full[dlen++] = '/';
+                dpath = 1;
+            }
+            if (!dlen) break;
+            if (dlen + len + 1 > sizeof(full)) continue;
+            memcpy(full + dlen, name, len);
+            full[dlen + len] = 0;
 
-    // stack-ish buffers to avoid heap churn
-    wchar_t glob[MAX_PATH * 8];
-    wchar_t full[MAX_PATH * 8];
+            if (ctx->match_full_path && !worker_match8(w, full, dlen + len)) continue;
+            size_t flen = dlen + len;
+            if (ctx->ac) flen = ac_tag8(ctx->ac, &w->hits, full, flen, sizeof(full) - 1);
+            if (olen + flen + 1 > OUT_BUF_SIZE) {
+                ok = srv_send(fd, out, olen);
+                olen = 0;
+            }
+            memcpy(out + olen, full, flen);
+            out[olen + flen] = '\n';
+            olen += flen + 1;
+            if (++found == ctx->max_matches) ok = 0;
+        }
+    }
+    srv_send(fd, out, olen);
+    free(out);
+}
 
-    for (;;) {
-        wchar_t *dir = wq_pop(ctx->q);
-        if (!dir) break;
+// one connection: read the query, answer, close
+static void srv_client(const Srv *s, const wchar_t *root, int fd) {
+    struct timeval tv = { 5, 0 };   // a stuck client must not stall the server for long
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-        InterlockedIncrement64(&ctx->dirs_scanned);
+    char *q = (char*)malloc(SRV_QUERY_MAX);
+    size_t qlen = 0;
+    int done = 0;
+    while (q && qlen < SRV_QUERY_MAX) {
+        ssize_t got = recv(fd, q + qlen, SRV_QUERY_MAX - qlen, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            done = got == 0 && qlen > 0 && q[qlen - 1] == 0;
+            break;
+        }
+        qlen += (size_t)got;
+    }
+    if (!done) {
+        srv_error(fd, q ? "incomplete query" : "out of memory");
+        free(q);
+        return;
+    }
 
-        if (!make_glob(glob, ARRAYSIZE(glob), dir)) {
-            free(dir);
-            wq_done_one(ctx->q);
-            continue;
+    // argv of a scan of root: ffind <root> <query...>
+    int argc = 2;
+    for (size_t i = 0; i < qlen; i += strlen(q + i) + 1) argc++;
+    wchar_t **argv = (wchar_t**)calloc((size_t)argc + 1, sizeof(wchar_t*));
+    int ok = argv != NULL;
+    if (ok) {
+        argv[0] = (wchar_t*)L"ffind";
+        argv[1] = (wchar_t*)root;
+    }
+    int a = 2;
+    for (size_t i = 0; ok && i < qlen; i += strlen(q + i) + 1) {
+        size_t n = strlen(q + i);
+        argv[a] = (wchar_t*)malloc((n + 1) * sizeof(wchar_t));
+        if (!argv[a]) {
+            ok = 0;
+            break;
         }
+        utf8_to_wide(argv[a], n + 1, q + i);
+        // these would read or write files on the server
+        if (wcscmp(argv[a], L"-n") == 0 || wcscmp(argv[a], L"--trace") == 0 ||
+            wcscmp(argv[a], L"--exclude-dir-file") == 0) ok = -1;
+        a++;
+    }
+    free(q);
 
-        WIN32_FIND_DATAW fd;
-        HANDLE h = FindFirstFileW(glob, &fd);
-        if (h == INVALID_HANDLE_VALUE) {
-            free(dir);
-            wq_done_one(ctx->q);
-            continue;
+    Options o;
+    memset(&o, 0, sizeof(o));
+    if (ok == 0) {
+        srv_error(fd, "out of memory");
+    } else if (ok < 0) {
+        srv_error(fd, "-n, --trace and --exclude-dir-file are not available in a query");
+    } else if (!parse_args(&o, argc, argv)) {
+        srv_error(fd, "bad query: give a needle, -g or -r and scan options");
+    } else if (o.kinds || o.size_op || o.newer_secs || o.nexcludes || o.ignore || o.content || o.dupes ||
+               o.du_top) {
+        srv_error(fd, "--type, --size, --newer, --exclude-dir, --respect-ignore, -c, --dupes and --du need a scan: "
+                      "the server keeps only names");
+    } else {
+        Ctx ctx;
+        AcAuto ac;
+        Pattern pat;
+        memset(&ctx, 0, sizeof(ctx));
+        if (!match_setup(&ctx, &ac, &pat, &o)) {
+            char msg[256];
+            if (pat.error) snprintf(msg, sizeof(msg), "bad pattern: %ls at offset %d", pat.error, (int)pat.error_at);
+            else snprintf(msg, sizeof(msg), "out of memory");
+            srv_error(fd, msg);
+        } else {
+            Worker *w = (Worker*)calloc(1, sizeof(Worker));
+            if (w) w->ctx = &ctx;
+            if (!w || (ctx.ac && !ac_hits_init(&w->hits, ctx.ac))) srv_error(fd, "out of memory");
+            else srv_run_query(s, &ctx, w, fd);
+            if (w) ac_hits_free(&w->hits);
+            free(w);
+            match_free(&ctx, &ac, &pat);
         }
+    }
+    options_free(&o);
+    if (argv) {
+        for (int i = 2; i < argc; i++) free(argv[i]);
+        free(argv);
+    }
+}
 
-        do {
-            const wchar_t *name = fd.cFileName;
-            if (is_dot_or_dotdot(name)) continue;
+static int serve(const wchar_t *root, const wchar_t *sock) {
+    Srv s;
+    memset(&s, 0, sizeof(s));
+    char croot[PATH_CAP * 4];
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (!wide_to_utf8(croot, sizeof(croot), root) || !wide_to_utf8(addr.sun_path, sizeof(addr.sun_path), sock)) {
+        fwprintf(stderr, L"Path too long\n");
+        return 2;
+    }
+    s.dents = (char*)malloc(DENTS_BUF_SIZE);
+    s.ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (!s.dents || s.ino < 0) {
+        fwprintf(stderr, s.dents ? L"inotify not available\n" : L"Out of memory\n");
+        return 1;
+    }
 
-            if (!join_path(full, ARRAYSIZE(full), dir, name)) {
-                // path too long for our buffer: skip (upgrade later with dynamic buffers/\\?\)
-                continue;
-            }
+    int rfd = open(croot, DIR_OPEN_FLAGS);
+    if (rfd < 0) {
+        fwprintf(stderr, L"Cannot read %ls\n", root);
+        return 1;
+    }
+    close(rfd);
 
-            if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                // avoid cycles via junctions/symlinks
-                if (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+    // a socket left by an earlier server is replaced; any other file is not
+    struct stat st;
+    if (lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(addr.sun_path);
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t um = umask(077);     // queries show every name: owner only
+    int bound = lfd >= 0 && bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(um);
+    if (!bound || listen(lfd, 64) != 0) {
+        fwprintf(stderr, L"Cannot listen on %ls: %s\n", sock, strerror(errno));
+        return 1;
+    }
 
-                // enqueue subdir
-                wchar_t *copy = wcsdup_heap(full);
-                if (copy) wq_push_owned(ctx->q, copy);
-            } else {
-                InterlockedIncrement64(&ctx->files_scanned);
+    match_init();
+    double t0 = now_seconds();
+    uint32_t r = srv_new_dir(&s, SRV_NONE, croot, strlen(croot));
+    if (r == SRV_NONE) {
+        fwprintf(stderr, L"Out of memory\n");
+        return 1;
+    }
+    srv_mark(&s, r);
+    srv_settle(&s);
+    fwprintf(stderr, L"Serving %lu dirs, %llu files under %ls on %ls (read in %.3f s)\n",
+        (unsigned long)s.nlive, (unsigned long long)s.nfiles, root, sock, now_seconds() - t0);
 
-                if (!ext_allowed(name, ctx->extcsv)) continue;
+    for (;;) {
+        struct pollfd pf[2] = { { lfd, POLLIN, 0 }, { s.ino, POLLIN, 0 } };
+        if (poll(pf, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pf[1].revents) {
+            // let a burst of changes finish before reading directories again
+            int quiet = 0;
+            for (int k = 0; k < 100 && !quiet; k++) {
+                srv_events(&s);
+                struct pollfd pi = { s.ino, POLLIN, 0 };
+                quiet = poll(&pi, 1, 10) <= 0;
+            }
+            srv_settle(&s);
+        }
+        if (pf[0].revents) {
+            int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            srv_client(&s, root, fd);
+            close(fd);
+        }
+    }
+    close(lfd);
+    return 1;
+}
 
-                const wchar_t *target = ctx->match_full_path ? full : basename_ptr(full);
-                if (wcontains_i(target, ctx->needle)) {
-                    InterlockedIncrement64(&ctx->found);
+// --query: sends the arguments to a server and prints its answer
+static int serve_query(const wchar_t *sock, int argc, wchar_t **argv) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (!wide_to_utf8(addr.sun_path, sizeof(addr.sun_path), sock)) {
+        fwprintf(stderr, L"Path too long\n");
+        return 2;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fwprintf(stderr, L"Cannot connect to %ls: %s\n", sock, strerror(errno));
+        return 1;
+    }
+    for (int i = 0; i < argc; i++) {
+        char *a = utf8_dup(argv[i]);
+        if (!a || !srv_send(fd, a, strlen(a) + 1)) {
+            free(a);
+            fwprintf(stderr, L"Cannot send the query\n");
+            return 1;
+        }
+        free(a);
+    }
+    shutdown(fd, SHUT_WR);
 
-                    EnterCriticalSection(&ctx->out_mu);
-                    wprintf(L"%ls\n", full);
-                    LeaveCriticalSection(&ctx->out_mu);
-                }
+    // status line, then the matches straight through
+    char buf[64 * 1024];
+    size_t have = 0;
+    int status = -1;
+    for (;;) {
+        ssize_t got = recv(fd, buf + have, sizeof(buf) - have, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        have += (size_t)got;
+        if (status < 0) {
+            char *eol = (char*)memchr(buf, '\n', have);
+            if (!eol && have < sizeof(buf)) continue;
+            size_t line = eol ? (size_t)(eol - buf) + 1 : have;
+            if (have >= 3 && memcmp(buf, "OK\n", 3) == 0) {
+                status = 0;
+            } else {
+                fwprintf(stderr, L"%.*s\n", (int)(line - (eol ? 1 : 0)), buf);
+                status = 2;
+                break;
             }
+            memmove(buf, buf + line, have - line);
+            have -= line;
+        }
+        out_write_all(buf, have);
+        have = 0;
+    }
+    close(fd);
+    if (status < 0) fwprintf(stderr, L"No answer from %ls\n", sock);
+    return status < 0 ? 1 : status;
+}
 
-        } while (FindNextFileW(h, &fd));
+#else
 
-        FindClose(h);
-        free(dir);
-        wq_done_one(ctx->q);
-    }
+static int serve(const wchar_t *root, const wchar_t *sock) {
+    (void)root; (void)sock;
+    fwprintf(stderr, L"--serve needs Linux (inotify)\n");
+    return 2;
+}
 
-    return 0;
+static int serve_query(const wchar_t *sock, int argc, wchar_t **argv) {
+    (void)sock; (void)argc; (void)argv;
+    fwprintf(stderr, L"--query needs Linux\n");
+    return 2;
 }
 
-// -------------------- timing --------------------
+#endif
 
-static double qpc_seconds(void) {
-    static LARGE_INTEGER freq = {0};
-    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
-    LARGE_INTEGER t;
-    QueryPerformanceCounter(&t);
-    return (double)t.QuadPart / (double)freq.QuadPart;
-}
+// --stats=json: the summary plus each worker's counters, on one line per worker
+static void print_stats_json(const Ctx *ctx, const Worker *ws, int n, Mode mode, double secs,
+                             int stopped, uint64_t index_bytes) {
+    static const wchar_t *k_mode[] = { L"scan", L"build-index", L"update-index", L"index" };
+    WorkerStats sum;
+    double out = 0;
+    memset(&sum, 0, sizeof(sum));
+    for (int i = 0; i < n; i++) {
+        sum.entries += ws[i].st.entries;
+        sum.name_bytes += ws[i].st.name_bytes;
+        sum.stat_calls += ws[i].st.stat_calls;
+        sum.wait += ws[i].st.wait;
+        sum.list += ws[i].st.list;
+        sum.match += ws[i].st.match;
+        out += ws[i].out.secs;
+    }
 
-// -------------------- main --------------------
+    fwprintf(stderr, L"{\"mode\": \"%ls\", \"threads\": %d, \"time_s\": %.6f, ", k_mode[mode], n, secs);
+    if (ctx->build_index) {
+        fwprintf(stderr, L"\"dirs_reused\": %lld, \"index_bytes\": %llu, ",
+            (long long)ctx->dirs_reused, (unsigned long long)index_bytes);
+    } else {
+        fwprintf(stderr, L"\"found\": %lld, \"stopped\": %ls, \"first_match_s\": %.6f, ",
+            (long long)ctx->found, stopped ? L"true" : L"false", ctx->found ? ctx->first_match : 0.0);
+    }
+    fwprintf(stderr, L"\"dirs\": %lld, \"files\": %lld, \"entries\": %lld, \"name_bytes\": %lld, "
+        L"\"stat_calls\": %lld, \"dirs_pruned\": %lld, \"ignored\": %lld, \"ignore_files\": %lld, "
+        L"\"content_files\": %lld, \"content_bytes\": %lld, \"hash_bytes\": %lld, \"dupe_groups\": %lld, "
+        L"\"dupe_files\": %lld, \"dupe_bytes\": %llu, \"du_bytes\": %llu, "
+        L"\"wait_s\": %.6f, \"list_s\": %.6f, \"match_s\": %.6f, \"out_s\": %.6f, \"workers\": [",
+        (long long)ctx->dirs_scanned, (long long)ctx->files_scanned, (long long)sum.entries,
+        (long long)sum.name_bytes, (long long)sum.stat_calls, (long long)ctx->dirs_pruned,
+        (long long)ctx->ignored, (long long)ctx->ignore_files, (long long)ctx->content_files,
+        (long long)ctx->content_bytes, (long long)ctx->hash_bytes, (long long)ctx->dupe_groups,
+        (long long)ctx->dupe_files, (unsigned long long)ctx->dupe_bytes, (unsigned long long)ctx->du_total,
+        sum.wait, sum.list, sum.match, out);
+    for (int i = 0; i < n; i++) {
+        const WorkerStats *st = &ws[i].st;
+        fwprintf(stderr, L"%ls\n  {\"dirs\": %lld, \"files\": %lld, \"entries\": %lld, \"name_bytes\": %lld, "
+            L"\"stat_calls\": %lld, \"wait_s\": %.6f, \"list_s\": %.6f, \"match_s\": %.6f, \"out_s\": %.6f}",
+            i ? L"," : L"", (long long)st->dirs, (long long)st->files, (long long)st->entries,
+            (long long)st->name_bytes, (long long)st->stat_calls, st->wait, st->list, st->match, ws[i].out.secs);
+    }
+    fwprintf(stderr, L"\n]}\n");
+}
 
-static void usage(void) {
-    fwprintf(stderr,
-        L"Usage:\n"
-        L"  ffind <root> <needle> [-e ext1,ext2,...] [-f] [-t N]\n\n"
-        L"Examples:\n"
-        L"  ffind C:\\\\Users\\\\banis prime -e c,h,cpp\n"
-        L"  ffind C:\\\\ source -f -t 8\n");
+// --trace: the workers' spans as Chrome trace events
+static int write_trace(const wchar_t *path, const Worker *ws, int n, double base) {
+    FILE *f = fopen_write(path);
+    if (!f) return 0;
+    fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+          "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"ffind\"}}", f);
+    uint64_t lost = 0;
+    for (int i = 0; i < n; i++) lost += trace_write_ring(f, &ws[i].trace, i, base);
+    fputs("\n]}\n", f);
+    int ok = !ferror(f);
+    if (fclose(f) != 0) ok = 0;
+    if (lost) fwprintf(stderr, L"Trace: %llu oldest spans dropped\n", (unsigned long long)lost);
+    return ok;
 }
 
 int wmain(int argc, wchar_t **argv) {
-    if (argc < 3) { usage(); return 2; }
+    if (argc == 4 && wcscmp(argv[1], L"--serve") == 0) return serve(argv[2], argv[3]);
+    if (argc >= 4 && wcscmp(argv[1], L"--query") == 0) return serve_query(argv[2], argc - 3, argv + 3);
 
-    const wchar_t *root = argv[1];
-    const wchar_t *needle = argv[2];
-    const wchar_t *extcsv = L"";
-    int match_full_path = 0;
-    int threads = 0;
+    Options opt;
+    if (!parse_args(&opt, argc, argv)) { options_free(&opt); usage(); return 2; }
 
-    for (int i = 3; i < argc; i++) {
-        if (wcscmp(argv[i], L"-e") == 0 && i + 1 < argc) {
-            extcsv = argv[++i];
-        } else if (wcscmp(argv[i], L"-f") == 0) {
-            match_full_path = 1;
-        } else if (wcscmp(argv[i], L"-t") == 0 && i + 1 < argc) {
-            threads = _wtoi(argv[++i]);
+    int threads = opt.threads;
+    if (threads <= 0) {
+        threads = default_threads();
+        if (threads < 1) threads = 1;
+    }
+
+    match_init();
+
+    Ctx ctx;
+    AcAuto ac;
+    Pattern pat;
+    memset(&ctx, 0, sizeof(ctx));
+    if (!match_setup(&ctx, &ac, &pat, &opt)) {
+        if (pat.error) fwprintf(stderr, L"Bad pattern: %ls at offset %d\n", pat.error, (int)pat.error_at);
+        else fwprintf(stderr, L"Out of memory\n");
+        options_free(&opt);
+        return pat.error ? 2 : 1;
+    }
+    PatSet prune;
+    memset(&prune, 0, sizeof(prune));
+    if (opt.nexcludes && !pat_set_init(&prune, opt.excludes, opt.nexcludes, 0, 0)) {
+        if (prune.error) {
+            fwprintf(stderr, L"Bad --exclude-dir %ls: %ls at offset %d\n",
+                opt.excludes[prune.bad], prune.error, (int)prune.error_at);
         } else {
-            fwprintf(stderr, L"Unknown option: %ls\n", argv[i]);
-            usage();
-            return 2;
+            fwprintf(stderr, L"Out of memory\n");
+        }
+        match_free(&ctx, &ac, &pat);
+        options_free(&opt);
+        return prune.error ? 2 : 1;
+    }
+    ctx.prune = opt.nexcludes ? &prune : NULL;
+    ctx.ignore = opt.ignore;
+    ctx.dupes = opt.dupes;
+    ctx.du_top = (size_t)opt.du_top;
+    ContentText content;
+    memset(&content, 0, sizeof(content));
+    if (opt.content) {
+        if (!content_init(&content, opt.content)) {
+            fwprintf(stderr, L"Out of memory\n");
+            match_free(&ctx, &ac, &pat);
+            pat_set_free(&prune);
+            options_free(&opt);
+            return 1;
         }
+        ctx.content = &content;
+#ifndef _WIN32
+        content_catch_sigbus();
+#endif
     }
 
-    if (threads <= 0) {
-        SYSTEM_INFO si;
-        GetSystemInfo(&si);
-        threads = (int)si.dwNumberOfProcessors;
-        if (threads < 1) threads = 1;
+#ifndef _WIN32
+    // queued children keep their parent's fd open; give ourselves room for that
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        if (rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            if (rl.rlim_cur > 1 << 20) rl.rlim_cur = 1 << 20;
+            setrlimit(RLIMIT_NOFILE, &rl);
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+        g_fd_budget = (LONG)(rl.rlim_cur / 2);
     }
+#endif
 
-    WorkQ q;
-    wq_init(&q);
+    Index ix;
+    if ((opt.mode == MODE_QUERY_INDEX || opt.mode == MODE_UPDATE_INDEX) && !idx_open(&ix, opt.index)) {
+        fwprintf(stderr, L"Cannot read index: %ls\n", opt.index);
+        idx_close(&ix);
+        return 1;
+    }
 
-    // seed root
-    wchar_t *root_copy = wcsdup_heap(root);
-    if (!root_copy) {
+    WorkQ q;
+    thread_t *hs = (thread_t*)malloc((size_t)threads * sizeof(thread_t));
+    Worker *workers = (Worker*)calloc((size_t)threads, sizeof(Worker));
+    wchar_t *root = NULL;
+    if (opt.mode == MODE_UPDATE_INDEX) root = idx_root_dup(&ix);
+    else if (opt.root) root = wcsdup_heap(opt.root);
+    if (!wq_init(&q, threads, ctx.content != NULL) || !hs || !workers || (opt.mode != MODE_QUERY_INDEX && !root)) {
         fwprintf(stderr, L"Out of memory\n");
+        match_free(&ctx, &ac, &pat);
+        free(root);
+        free(workers);
+        free(hs);
         wq_destroy(&q);
         return 1;
     }
-    wq_push_owned(&q, root_copy);
 
-    Ctx ctx;
-    ctx.needle = needle;
-    ctx.extcsv = extcsv;
-    ctx.match_full_path = match_full_path;
-    ctx.found = 0;
-    ctx.dirs_scanned = 0;
-    ctx.files_scanned = 0;
+    ctx.flush_per_dir = opt.flush_per_dir;
+    ctx.io_depth = opt.io_depth;
+    ctx.stats = opt.stats;
+    ctx.trace = opt.trace != NULL;
+    ctx.build_index = opt.mode == MODE_BUILD_INDEX || opt.mode == MODE_UPDATE_INDEX;
+    ctx.ix = opt.mode == MODE_QUERY_INDEX ? &ix : NULL;
+    ctx.prev = opt.mode == MODE_UPDATE_INDEX ? &ix : NULL;
+    if (ctx.ix && ctx.pat) {
+        Needle lit;     // even when the scan does without it
+        ctx.cand = needle_init(&lit, pat.literal) ? idx_candidates(&ix, &lit, ctx.match_full_path) : NULL;
+        needle_free(&lit);
+    } else if (ctx.ix) {
+        ctx.cand = ctx.ac ? idx_candidates_ac(&ix, ctx.ac, ctx.match_full_path)
+                          : idx_candidates(&ix, &ctx.needle, ctx.match_full_path);
+    }
     InitializeCriticalSection(&ctx.out_mu);
     ctx.q = &q;
 
-    HANDLE *hs = (HANDLE*)malloc((size_t)threads * sizeof(HANDLE));
-    if (!hs) {
+    for (int i = 0; i < threads; i++) {
+        workers[i].ctx = &ctx;
+        workers[i].visit = k_visit[visit_flags(&ctx)];
+        workers[i].out.timed = ctx.stats;
+        wq_local_init(&workers[i].wq, i);
+        if (!out_init(&workers[i].out) || (ctx.ac && !ac_hits_init(&workers[i].hits, ctx.ac)) ||
+            (ctx.trace && !trace_init(&workers[i].trace)) ||
+            ((ctx.content || ctx.dupes) && !(workers[i].cbuf = (uint8_t*)malloc(CONTENT_BUF_SIZE))) ||
+            (ctx.du_top && !(workers[i].du.top = (DuEntry*)malloc(ctx.du_top * sizeof(DuEntry))))) {
+            // not enough memory for every buffer: run with what we have
+            threads = i;
+            break;
+        }
+    }
+    if (threads == 0) {
         fwprintf(stderr, L"Out of memory\n");
-        DeleteCriticalSection(&ctx.out_mu);
-        wq_destroy(&q);
         return 1;
     }
 
-    double t0 = qpc_seconds();
+    // seed root
+    if (root) {
+        size_t len;
+        pchar *top = pchar_dup(root, &len);
+        Node *n = top ? node_new(&workers[0].arena, NULL, top, len, 0, ctx.prev ? 0 : IDX_NONE) : NULL;
+        free(top);
+        if (!n || !wq_push(&q, &workers[0].wq, n)) {
+            fwprintf(stderr, L"Out of memory\n");
+            return 1;
+        }
+        ctx.next_dir_id = 1;
+    }
+
+    double t0 = now_seconds();
 
     for (int i = 0; i < threads; i++) {
-        hs[i] = CreateThread(NULL, 0, worker_thread, &ctx, 0, NULL);
-        if (!hs[i]) {
-            print_winerr(L"CreateThread");
+        if (!thread_start(&hs[i], ctx.ix ? idx_query_thread : worker_thread, &workers[i])) {
+            print_syserr(L"CreateThread");
             threads = i; // wait only created ones
             break;
         }
     }
 
-    WaitForMultipleObjects((DWORD)threads, hs, TRUE, INFINITE);
+    thread_join_all(hs, threads);
+
+    double t1 = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        ctx.dirs_scanned += workers[i].st.dirs;
+        ctx.files_scanned += workers[i].st.files;
+        ctx.stat_calls += workers[i].st.stat_calls;
+        ctx.dirs_pruned += workers[i].st.pruned;
+        ctx.ignored += workers[i].st.ignored;
+        ctx.ignore_files += workers[i].st.ignore_files;
+        ctx.content_files += workers[i].st.content_files;
+        ctx.content_bytes += workers[i].st.content_bytes;
+        ctx.dupe_candidates += (LONG64)workers[i].dup.nfiles;
+        ctx.found += workers[i].du.files;
+    }
+    if (q.stop) {
+        wq_drain(&q, &workers[0].arena);
+        if (ctx.found > ctx.max_matches) ctx.found = ctx.max_matches;
+    }
 
-    double t1 = qpc_seconds();
+    int rc = 0;
+    uint64_t index_bytes = 0;
+    if (ctx.prev) {
+        // unmapped before the new index replaces it
+        idx_close(&ix);
+        ctx.prev = NULL;
+    }
+    if (ctx.build_index) {
+        index_bytes = idx_write(&ctx, workers, q.nworkers, root, opt.index);
+        if (!index_bytes) {
+            fwprintf(stderr, L"Cannot write index: %ls\n", opt.index);
+            rc = 1;
+        }
+        t1 = now_seconds();
+    }
+    if (ctx.dupes) {
+        if (!dupes_run(&ctx, workers, hs, threads)) {
+            fwprintf(stderr, L"Out of memory\n");
+            rc = 1;
+        }
+        for (int i = 0; i < threads; i++) ctx.hash_bytes += workers[i].st.hash_bytes;
+        ctx.found = ctx.dupe_files;
+        t1 = now_seconds();
+    }
+    if (ctx.du_top && !du_print(&ctx, workers, threads)) {
+        fwprintf(stderr, L"Out of memory\n");
+        rc = 1;
+    }
+    if (ctx.ix) ctx.dirs_scanned = (LONG64)ix.h->ndirs;
+    if (ctx.found && !ctx.dupes && !ctx.du_top) ctx.first_match -= t0;
+    if (opt.stats) print_stats_json(&ctx, workers, threads, opt.mode, t1 - t0, q.stop, index_bytes);
+    if (opt.trace && !write_trace(opt.trace, workers, threads, t0)) {
+        fwprintf(stderr, L"Cannot write trace: %ls\n", opt.trace);
+        rc = 1;
+    }
 
-    for (int i = 0; i < threads; i++) CloseHandle(hs[i]);
     free(hs);
+    for (int i = 0; i < q.nworkers; i++) {
+        out_free(&workers[i].out, &ctx.out_mu);
+        idx_local_free(&workers[i].ix);
+        arena_destroy(&workers[i].arena);
+        ac_hits_free(&workers[i].hits);
+        trace_free(&workers[i].trace);
+        free(workers[i].cbuf);
+        dupe_local_free(&workers[i].dup);
+        du_local_free(&workers[i].du);
+    }
+    free(workers);
 
     DeleteCriticalSection(&ctx.out_mu);
+    match_free(&ctx, &ac, &pat);
+    pat_set_free(&prune);
+    content_free(&content);
+    options_free(&opt);
+    free((void*)ctx.cand);
+    free(root);
     wq_destroy(&q);
+    if (ctx.ix) idx_close(&ix);
+
+    if (opt.stats) return rc;
 
+    if (ctx.io_depth && !ctx.ix) {
+        if (ctx.io_rings) fwprintf(stderr, L"io_uring: %ld of %d workers, %d opens in flight each\n", (long)ctx.io_rings, threads, ctx.io_depth);
+        else fwprintf(stderr, L"io_uring not available: used blocking opens\n");
+    }
+
+    if (ctx.build_index) {
+        fwprintf(stderr, L"Indexed %lld dirs, %lld files\n",
+            (long long)ctx.dirs_scanned,
+            (long long)ctx.files_scanned);
+        if (ctx.prune) fwprintf(stderr, L"Excluded %lld dirs\n", (long long)ctx.dirs_pruned);
+        if (opt.mode == MODE_UPDATE_INDEX) {
+            fwprintf(stderr, L"Reused %lld unchanged dirs, re-read %lld\n",
+                (long long)ctx.dirs_reused,
+                (long long)(ctx.dirs_scanned - ctx.dirs_reused));
+        }
+        fwprintf(stderr,
+            L"Index: %ls (%.1f MiB)\nThreads: %d\nTime: %.3f s\n",
+            opt.index,
+            index_bytes / (1024.0 * 1024.0),
+            threads,
+            (t1 - t0));
+        return rc;
+    }
+
+    if (ctx.found && !ctx.dupes && !ctx.du_top) fwprintf(stderr, L"First match: %.3f s\n", ctx.first_match);
     fwprintf(stderr,
-        L"Found %lld match(es)\nScanned %lld dirs, %lld files\nThreads: %d\nTime: %.3f s\n",
+        L"Found %lld match(es)%ls\nScanned %lld dirs, %lld files\nThreads: %d\nTime: %.3f s\n",
         (long long)ctx.found,
+        q.stop ? L" (stopped at -m limit)" : L"",
         (long long)ctx.dirs_scanned,
         (long long)ctx.files_scanned,
         threads,
         (t1 - t0));
+    if (ctx.prune) fwprintf(stderr, L"Excluded %lld dirs\n", (long long)ctx.dirs_pruned);
+    if (ctx.ignore) {
+        fwprintf(stderr, L"Ignored %lld entries, by %lld ignore files\n",
+            (long long)ctx.ignored, (long long)ctx.ignore_files);
+    }
+    if (ctx.content) {
+        fwprintf(stderr, L"Searched %lld files, %.1f MiB\n",
+            (long long)ctx.content_files, ctx.content_bytes / (1024.0 * 1024.0));
+    }
+    if (ctx.dupes) {
+        fwprintf(stderr, L"Duplicates: %lld files in %lld groups, %.1f MiB reclaimable\nCompared %lld files, hashed %.1f MiB\n",
+            (long long)ctx.dupe_files, (long long)ctx.dupe_groups, ctx.dupe_bytes / (1024.0 * 1024.0),
+            (long long)ctx.dupe_candidates, ctx.hash_bytes / (1024.0 * 1024.0));
+    }
+    if (ctx.du_top) fwprintf(stderr, L"Total size: %.1f MiB\n", ctx.du_total / (1024.0 * 1024.0));
+    if (ctx.meta.size_op || ctx.meta.newer) {
+        // names turned down before --size/--newer needed their metadata
+        fwprintf(stderr, L"Stat calls: %lld, avoided %lld\n",
+            (long long)ctx.stat_calls, (long long)(ctx.files_scanned - ctx.stat_calls));
+    }
 
-    return 0;
+    return rc;
+}
+
+#ifndef _WIN32
+int main(int argc, char **argv) {
+    // wide stdio follows the locale; names themselves are decoded as UTF-8
+    setlocale(LC_ALL, "");
+
+    wchar_t **wargv = (wchar_t**)calloc((size_t)argc + 1, sizeof(wchar_t*));
+    if (!wargv) return 1;
+    for (int i = 0; i < argc; i++) {
+        size_t cap = strlen(argv[i]) + 1;
+        wargv[i] = (wchar_t*)malloc(cap * sizeof(wchar_t));
+        if (!wargv[i]) return 1;
+        wargv[i][0] = 0;
+        utf8_to_wide(wargv[i], cap, argv[i]);
+    }
+    return wmain(argc, wargv);
 }
+#endif
+
+#endif // FFIND_NO_MAIN
@@ -0,0 +1,69 @@
+// Pattern checks: -g/-r DFAs against names given as raw bytes, the way the
+// Linux walker hands them over, including names that are not valid UTF-8.
+// Prints each case that fails and exits 1 if any did.
+//
+//   gcc -O2 -pthread test/test_pattern.c -o test_pattern
+//   cl /O2 test\test_pattern.c
+//
+// Usage: test_pattern
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define FFIND_NO_MAIN
+#include "../ffind.c"
+
+static const struct {
+    int glob;
+    const wchar_t *src;
+    const char *name;
+    int match;
+} k_cases[] = {
+    // valid UTF-8: one character each
+    { 1, L"caf?",     "cafe",          1 },
+    { 1, L"caf?",     "caf\xc3\xa9",   1 },
+    { 0, L"^caf.$",   "caf\xc3\xa9",   1 },
+    { 0, L"^caf[^e]$", "caf\xc3\xa9",  1 },
+    { 1, L"caf?",     "caf",           0 },
+    { 0, L"^caf[^e]$", "cafe",         0 },
+    // Latin-1 e-acute: a lead byte with nothing after it
+    { 1, L"caf?",     "caf\xe9",       1 },
+    { 0, L"^caf.$",   "caf\xe9",       1 },
+    { 0, L"^caf[^a]$", "caf\xe9",      1 },
+    { 0, L"^[^a]+$",  "caf\xe9",       0 },
+    { 0, L"^[^a]+$",  "cf\xe9",        1 },
+    // a stray continuation byte, and bytes that never occur in UTF-8
+    { 1, L"x?y",      "x\x80y",        1 },
+    { 0, L"^x.y$",    "x\x80y",        1 },
+    { 0, L"^x[^a]y$", "x\x80y",        1 },
+    { 1, L"x?y",      "x\xc0y",        1 },
+    { 1, L"x?y",      "x\xffy",        1 },
+    // the bytes still have to be there
+    { 1, L"x?y",      "xy",            0 },
+    { 0, L"^x.y$",    "x\x80\x80\x80\x80y", 0 },
+};
+
+int main(void) {
+    int failed = 0;
+    for (size_t k = 0; k < ARRAYSIZE(k_cases); k++) {
+        Pattern p;
+        if (!pat_init(&p, k_cases[k].src, k_cases[k].glob)) {
+            fprintf(stderr, "%ls: %ls\n", k_cases[k].src, p.error ? p.error : L"out of memory");
+            return 1;
+        }
+        const char *name = k_cases[k].name;
+        int got = pat_match8(&p, name, strlen(name));
+        if (got != k_cases[k].match) {
+            printf("FAIL %s %ls on \"", k_cases[k].glob ? "-g" : "-r", k_cases[k].src);
+            for (const char *s = name; *s; s++) {
+                if ((unsigned char)*s < 0x80) putchar(*s);
+                else printf("\\x%02x", (unsigned char)*s);
+            }
+            printf("\": %s, expected %s\n", got ? "match" : "no match", k_cases[k].match ? "match" : "no match");
+            failed++;
+        }
+        pat_free(&p);
+    }
+    printf("%d of %d cases passed\n", (int)ARRAYSIZE(k_cases) - failed, (int)ARRAYSIZE(k_cases));
+    return failed ? 1 : 0;
+}